@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# generates the deterministic probe/hash benchmark corpus used by
+# 'make bench':  bench-corpus.sh <dir> [files per type]
+#
+# files are named <type>-<n>.<extn>, test-ff-probe reports per <type>
+# requires the ffmpeg cli built with libmp3lame, libvorbis and libx264
+
+set -e
+
+DIR=${1:?usage: $0 <dir> [files per type]}
+N=${2:-4}
+SECS=180
+FFMPEG=${FFMPEG:-ffmpeg}
+
+mkdir -p "$DIR"
+cd "$DIR"
+
+FF="$FFMPEG -nostdin -hide_banner -loglevel error -y"
+BITEXACT="-fflags +bitexact -flags:v +bitexact -flags:a +bitexact -map_metadata -1"
+
+# large (~1MB) cover and tag, as commonly found in ripped/purchased files
+$FF -f lavfi -i "testsrc2=size=1400x1400:rate=1" -frames:v 1 $BITEXACT cover.png
+COMMENT=$(head -c 60000 /dev/zero | tr '\0' 'x')
+
+i=1
+while [ $i -le $N ]
+do
+    n=$(printf "%02d" $i)
+    SRC="-f lavfi -i sine=frequency=$((220*i)):sample_rate=44100:duration=$SECS -ac 2"
+    META="-metadata title=bench-$n -metadata artist=gpod-utils -metadata album=bench -metadata track=$i"
+
+    $FF $SRC $BITEXACT $META -c:a libmp3lame -b:a 192k                  mp3-cbr-xing-$n.mp3
+    $FF $SRC $BITEXACT $META -c:a libmp3lame -b:a 192k -write_xing 0    mp3-cbr-noxing-$n.mp3
+    $FF $SRC $BITEXACT $META -c:a libmp3lame -q:a 2                     mp3-vbr-xing-$n.mp3
+    $FF $SRC $BITEXACT $META -c:a libmp3lame -q:a 2 -write_xing 0       mp3-vbr-noxing-$n.mp3
+    $FF $SRC $BITEXACT $META -c:a aac -b:a 160k                         m4a-$n.m4a
+    $FF $SRC $BITEXACT $META -c:a flac                                  flac-$n.flac
+    $FF $SRC $BITEXACT $META -c:a libvorbis -q:a 5                      ogg-$n.ogg
+    $FF $SRC $BITEXACT $META -c:a pcm_s16le                             wav-$n.wav
+    $FF $SRC $BITEXACT $META -c:a pcm_s16be                             aiff-$n.aiff
+
+    # large id3v2/metadata blocks with embedded artwork ahead of the audio
+    $FF $SRC -i cover.png -map 0:a -map 1:v $BITEXACT $META -metadata comment=$COMMENT \
+        -c:a libmp3lame -b:a 192k -c:v copy -id3v2_version 3 -disposition:v attached_pic   mp3-tags-$n.mp3
+    $FF $SRC -i cover.png -map 0:a -map 1:v $BITEXACT $META -metadata comment=$COMMENT \
+        -c:a aac -b:a 160k -c:v copy -disposition:v attached_pic                           m4a-tags-$n.m4a
+    $FF $SRC -i cover.png -map 0:a -map 1:v $BITEXACT $META -metadata comment=$COMMENT \
+        -c:a flac -c:v copy -disposition:v attached_pic                                    flac-tags-$n.flac
+
+    $FF -f lavfi -i "testsrc2=size=640x480:rate=30:duration=30" \
+        -f lavfi -i "sine=frequency=$((220*i)):sample_rate=44100:duration=30" -ac 2 \
+        $BITEXACT $META -c:v libx264 -profile:v baseline -b:v 1.5M -threads 1 -c:a aac -b:a 128k  m4v-h264-$n.m4v
+
+    i=$((i+1))
+done
+
+rm -f cover.png
+sync
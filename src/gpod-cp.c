@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -48,6 +49,7 @@
 
 #include "gpod-ffmpeg.h"
 #include "gpod-utils.h"
+#include "gpod-cache.h"
 
 struct {
     const char*  itdb_path;
@@ -56,16 +58,24 @@ struct {
     enum gpod_ff_enc  enc;
     bool enc_fallback;
     enum gpod_ff_transcode_quality  xcode_quality;
+    enum gpod_ff_resampler  resampler;
+    enum gpod_ff_resample_precision  resample_precision;
     bool  sync_meta;
     time_t  time_added;
     bool  sanitize;
     bool  replace;
+    bool  soundcheck;
+    bool  artwork;
+    bool  cache;
     struct {
       const char*  pl;
       unsigned  limit;
     } recent;
     unsigned short  max_threads;
+    unsigned  inflight;
+    int  readahead;
     int  mediatype;
+    const char*  stats_json;
 } opts = {
    .itdb_path =  NULL,
    .cksum = true,
@@ -73,16 +83,43 @@ struct {
    .enc = GPOD_FF_ENC_FDKAAC,
    .enc_fallback = true,
    .xcode_quality = GPOD_FF_XCODE_VBR1,
+   .resampler = GPOD_FF_RESAMPLE_SWR,
+   .resample_precision = GPOD_FF_RESAMPLE_STD,
    .sync_meta = true,
    .time_added = 0,
    .sanitize = true,
    .replace = true,
+   .soundcheck = true,
+   .artwork = true,
+   .cache = true,
    .recent = {
        .pl = NULL,
        .limit = 50,
    },
    .max_threads = 1,
+   .inflight = 0,
+   .readahead = -1,
    .mediatype = ITDB_MEDIATYPE_AUDIO,
+   .stats_json = NULL,
+};
+
+// per file pipeline stages that are timed
+enum gpod_cp_stage {
+    GPOD_CP_STAGE_PROBE = 0,
+    GPOD_CP_STAGE_XCODE,
+    GPOD_CP_STAGE_REMUX,
+    GPOD_CP_STAGE_LOUDNESS,
+    GPOD_CP_STAGE_ARTWORK,
+    GPOD_CP_STAGE_HASH,
+    GPOD_CP_STAGE_COPY,
+    GPOD_CP_STAGE_COMMIT,
+    GPOD_CP_STAGE_PREFETCH,
+    GPOD_CP_STAGE_LOCK,
+    GPOD_CP_STAGE_MAX
+};
+
+static const char*  gpod_cp_stage_names[GPOD_CP_STAGE_MAX] = {
+    "probe", "transcode", "remux", "loudness", "artwork", "hash", "copy", "db commit", "prefetch", "lock wait"
 };
 
 struct {
@@ -91,27 +128,72 @@ struct {
     uint32_t  other;
     size_t    bytes;
     guint     xcode_time;
+    guint64   xcode_media;    // usecs of transcoded input
+    guint64   xcode_elapsed;  // usecs spent transcoding it
+    uint32_t  updated;
 
     unsigned  recent_playlists;
     unsigned  recent_tracks;
+
+    struct gpod_latency  stage[GPOD_CP_STAGE_MAX];
 } stats = { 0 };
 
+#define GPOD_CP_STAGE_ADD(stage_, then_, bytes_)  gpod_latency_add(&stats.stage[(stage_)], g_get_monotonic_time() - (then_), (bytes_))
+
+// all strings interned in gpod_cp_report.strs
 struct gpod_replaced {
-    char*  title;
-    char*  artist;
-    char*  album;
-    char  path[PATH_MAX];
-    char  new_path[PATH_MAX];
+    const char*  title;
+    const char*  artist;
+    const char*  album;
+    const char*  path;
+    const char*  new_path;
+};
+
+/* compact records of failures/replacements reported on exit - strings are
+ * interned so repeated artist/album names aren't duplicated per record
+ */
+struct gpod_cp_report {
+    GMutex  lck;
+    GStringChunk*  strs;
+    GPtrArray*  failed;    // const char* path
+    GArray*  replaced;     // struct gpod_replaced
 };
 
-static void  replaced_destroy(gpointer obj_)
+static void  gpod_cp_report_init(struct gpod_cp_report* obj_)
 {
-    struct gpod_replaced*  r = (struct gpod_replaced*)obj_;
-    g_free(r->title);
-    g_free(r->artist);
-    g_free(r->album);
+    g_mutex_init(&obj_->lck);
+    obj_->strs = g_string_chunk_new(4096);
+    obj_->failed = g_ptr_array_new();
+    obj_->replaced = g_array_new(FALSE, FALSE, sizeof(struct gpod_replaced));
+}
 
-    g_free(obj_);
+static void  gpod_cp_report_free(struct gpod_cp_report* obj_)
+{
+    g_array_free(obj_->replaced, TRUE);
+    g_ptr_array_free(obj_->failed, TRUE);
+    g_string_chunk_free(obj_->strs);
+    g_mutex_clear(&obj_->lck);
+}
+
+static void  gpod_cp_report_failed(struct gpod_cp_report* obj_, const char* path_)
+{
+    g_mutex_lock(&obj_->lck);
+    g_ptr_array_add(obj_->failed, g_string_chunk_insert(obj_->strs, path_));
+    g_mutex_unlock(&obj_->lck);
+}
+
+static void  gpod_cp_report_replaced(struct gpod_cp_report* obj_, const Itdb_Track* existing_, const Itdb_Track* track_)
+{
+    g_mutex_lock(&obj_->lck);
+    const struct gpod_replaced  replaced = {
+        .title    = g_string_chunk_insert_const(obj_->strs, existing_->title ? existing_->title : ""),
+        .artist   = g_string_chunk_insert_const(obj_->strs, existing_->artist ? existing_->artist : ""),
+        .album    = g_string_chunk_insert_const(obj_->strs, existing_->album ? existing_->album : ""),
+        .path     = g_string_chunk_insert(obj_->strs, existing_->ipod_path ? existing_->ipod_path : ""),
+        .new_path = g_string_chunk_insert(obj_->strs, track_->ipod_path ? track_->ipod_path : "")
+    };
+    g_array_append_val(obj_->replaced, replaced);
+    g_mutex_unlock(&obj_->lck);
 }
 
 struct gpod_cp_log_ctx {
@@ -133,6 +215,71 @@ static void  gpod_cp_log(const struct gpod_cp_log_ctx* ctx_, const char* fmt_, .
     g_free(tmp);
 }
 
+/* embedded artwork is typically identical for every track of an album: keyed
+ * by the sha1 of the image as found in the file, each is decoded/scaled once
+ * and the result (empty if it couldn't be) shared by the workers
+ */
+#define GPOD_CP_ARTWORK_MAX  320  // px, largest thumb of the classic/video
+
+static struct {
+    GMutex  lck;
+    GHashTable*  tbl;  // sha1 -> GBytes
+    unsigned  hits;
+    unsigned  scaled;
+} artwork_cache = { 0 };
+
+// probe/hash results of the src files from previous runs
+static struct gpod_cache*  gpod_cp_cache = NULL;
+
+static GBytes*  _artwork(const struct gpod_ff_media_info* mi_)
+{
+    gchar*  key = g_compute_checksum_for_data(G_CHECKSUM_SHA1, mi_->artwork.data, mi_->artwork.size);
+    GBytes*  art;
+
+    g_mutex_lock(&artwork_cache.lck);
+    if (artwork_cache.tbl == NULL) {
+        artwork_cache.tbl = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_bytes_unref);
+    }
+    if ( (art = g_hash_table_lookup(artwork_cache.tbl, key)) ) {
+        ++artwork_cache.hits;
+        g_bytes_ref(art);
+    }
+    g_mutex_unlock(&artwork_cache.lck);
+
+    if (art) {
+        g_free(key);
+        return art;
+    }
+
+    // scaled outside the lock, workers racing on the same image keep the first
+    uint8_t*  data = NULL;
+    int  size = 0;
+    char*  err = NULL;
+    if (gpod_ff_artwork_scale(&data, &size, mi_->artwork.codec_id, mi_->artwork.data, mi_->artwork.size, GPOD_CP_ARTWORK_MAX, &err) < 0) {
+        g_printerr("failed to process artwork from %s - %s\n", mi_->path, err ? err : "<unknown error>");
+    }
+    free(err);
+    art = g_bytes_new_with_free_func(data, size, free, data);
+
+    g_mutex_lock(&artwork_cache.lck);
+    {
+        GBytes*  existing = g_hash_table_lookup(artwork_cache.tbl, key);
+        if (existing) {
+            g_bytes_unref(art);
+            art = existing;
+            g_free(key);
+        }
+        else {
+            ++artwork_cache.scaled;
+            g_hash_table_insert(artwork_cache.tbl, key, art);
+        }
+        g_bytes_ref(art);
+    }
+    g_mutex_unlock(&artwork_cache.lck);
+
+    return art;
+}
+
 static bool  _track_key_valid(Itdb_Track* track_)
 {
     return track_->title && track_->album && track_->artist &&
@@ -145,13 +292,16 @@ static bool  _track_key_valid(Itdb_Track* track_)
  * attempt transcode otherwise NULL retruned
  */
 static Itdb_Track*
-_track(const char* file_, struct gpod_ff_transcode_ctx* xfrm_, uint64_t uuid_, Itdb_IpodGeneration idevice_, time_t time_added_, bool sanitize_, char** err_)
+_track(const char* file_, guint src_cksum_, struct gpod_ff_transcode_ctx* xfrm_, uint64_t uuid_, Itdb_IpodGeneration idevice_, time_t time_added_, bool sanitize_, char** err_)
 {
     struct gpod_ff_media_info  mi;
     gpod_ff_media_info_init(&mi);
 
     const char*  file = file_;
-    if (gpod_ff_scan(&mi, file, idevice_, err_) < 0) {
+    gint64  then = g_get_monotonic_time();
+    const int  scanned = gpod_cache_scan(gpod_cp_cache, &mi, file, idevice_, false, err_);
+    GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_PROBE, then, mi.file_size);
+    if (scanned < 0) {
 	if (!mi.has_audio) {
             if (*err_) {
                 const char*  err = "no audio - ";
@@ -169,6 +319,29 @@ _track(const char* file_, struct gpod_ff_transcode_ctx* xfrm_, uint64_t uuid_, I
     }
 
     Itdb_Track*  track = NULL;
+    bool  measured = false;  // loudness metered by the transcode
+    if (!mi.supported_ipod_fmt && mi.remux && !mi.has_video)
+    {
+	/* codec is fine but not its container, copy the audio packets into
+	 * one the iPod can play - failing that, fallback to transcode
+	 */
+	snprintf(xfrm_->path, PATH_MAX, "%s-%u-%" PRIu64 ".%s", xfrm_->tmpprfx, mi.audio.codec_id, uuid_, mi.remux);
+
+	then = g_get_monotonic_time();
+	const int  remuxed = gpod_ff_remux(&mi, xfrm_, err_);
+	GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_REMUX, then, mi.file_size);
+	if (remuxed < 0) {
+	    g_unlink(xfrm_->path);
+	    xfrm_->path[0] = '\0';
+	    free(*err_);
+	    *err_ = NULL;
+	}
+	else {
+	    mi.supported_ipod_fmt = true;
+	    file = xfrm_->path;
+	}
+    }
+
     if (!mi.supported_ipod_fmt)
     {
 	if (mi.has_audio && !mi.has_video)
@@ -178,7 +351,10 @@ _track(const char* file_, struct gpod_ff_transcode_ctx* xfrm_, uint64_t uuid_, I
 	     */
 	    snprintf(xfrm_->path, PATH_MAX, "%s-%u-%" PRIu64 ".%s", xfrm_->tmpprfx, xfrm_->audio_opts.codec_id, uuid_, xfrm_->extn);
 
-	    if (gpod_ff_transcode(&mi, xfrm_, err_) < 0) {
+	    then = g_get_monotonic_time();
+	    const int  xcoded = gpod_ff_transcode(&mi, xfrm_, err_);
+	    GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_XCODE, then, mi.file_size);
+	    if (xcoded < 0) {
 		char err[1024];
 		snprintf(err, 1024, "unsupported iPod file type %u bytes %s (%d %d/%d/%d) - %s", mi.file_size, mi.type, mi.audio.codec_id, mi.audio.bitrate, mi.audio.samplerate, mi.audio.channels, *err_ ? *err_ : "");
 		if (*err_) {
@@ -188,38 +364,96 @@ _track(const char* file_, struct gpod_ff_transcode_ctx* xfrm_, uint64_t uuid_, I
 	    }
 	    else {
 		mi.supported_ipod_fmt = true;
+		measured = xfrm_->loudness;
 		file = xfrm_->path;
 	    }
 	}
-	else
+	else if (mi.has_video)
 	{
-	    if (mi.has_video)
-	    {
-		char err[1024];
-		snprintf(err, 1024, "unsupported iPod video file: %s %ux%u @ %i kb/s, %.3f fps, %i channels @ %i",
-                                mi.type, mi.video.width, mi.video.height, mi.video.bitrate/1000, mi.video.fps, mi.audio.channels, mi.audio.bitrate);
+	    snprintf(xfrm_->path, PATH_MAX, "%s-%u-%" PRIu64 ".m4v", xfrm_->tmpprfx, mi.video.codec_id, uuid_);
 
+	    then = g_get_monotonic_time();
+	    const int  xcoded = gpod_ff_transcode_video(&mi, xfrm_, err_);
+	    GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_XCODE, then, mi.file_size);
+	    if (xcoded < 0) {
+		char err[1024];
+		snprintf(err, 1024, "unsupported iPod video file: %s %ux%u @ %i kb/s, %.3f fps, %i channels @ %i - %s",
+                                mi.type, mi.video.width, mi.video.height, mi.video.bitrate/1000, mi.video.fps, mi.audio.channels, mi.audio.bitrate, *err_ ? *err_ : "");
+		if (*err_) {
+		    free(*err_);
+		}
 		*err_ = g_strdup(err);
 	    }
+	    else {
+		mi.supported_ipod_fmt = true;
+		measured = xfrm_->loudness;
+		file = xfrm_->path;
+	    }
 	}
     }
 
     // couldnt be transcoded ....
     if (!mi.supported_ipod_fmt) {
+	gpod_ff_media_info_free(&mi);
 	return NULL;
     }
 
     track = gpod_ff_meta_to_track(&mi, time_added_, sanitize_);
     track->mediatype |= opts.mediatype;
 
+    /* transcodes were metered as they decoded, anything copied as is needs
+     * its own decode pass - on this worker, in parallel with the others
+     */
+    if (xfrm_->loudness) {
+        double  lufs = xfrm_->lufs;
+        if (!measured) {
+            char*  err = NULL;
+            then = g_get_monotonic_time();
+            if (gpod_ff_loudness_scan(&lufs, file, MAX(xfrm_->threads, 1), &err) != 0) {
+                lufs = 0;
+            }
+            GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_LOUDNESS, then, mi.file_size);
+            free(err);
+        }
+        if (lufs != 0) {
+            track->soundcheck = gpod_ff_soundcheck(lufs);
+        }
+    }
+
+    /* libgpod only holds the image data until the db is written, attaching
+     * it here keeps the decode/scale on the worker - itdb_write() still
+     * renders the device's thumbnail formats from it
+     */
+    if (opts.artwork && mi.artwork.data) {
+        then = g_get_monotonic_time();
+        GBytes*  art = _artwork(&mi);
+        gsize  n = 0;
+        const guchar*  data = g_bytes_get_data(art, &n);
+        if (n) {
+            itdb_track_set_thumbnails_from_data(track, data, n);
+        }
+        g_bytes_unref(art);
+        GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_ARTWORK, then, mi.artwork.size);
+    }
+
     gpod_ff_media_info_free(&mi);
 
+    // untouched src audio is what's copied, no need to hash it again
+    gpod_store_src_cksum(track, src_cksum_);
+    if (src_cksum_ && file == file_) {
+        track->unk196 = src_cksum_;
+        return track;
+    }
+
     // needs full path because the track has no itdb structure at this point
+    then = g_get_monotonic_time();
     gpod_store_cksum(track, file);
+    GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_HASH, then, track->size);
     return track;
 }
 
 
+// the track's cksum is already stored, this is only a lookup
 static bool  _track_exists(const Itdb_Track* track_, const struct gpod_track_fs_hash*  tfsh_, const char* path_)
 {
     return gpod_track_fs_hash_contains(tfsh_, track_, path_);
@@ -232,7 +466,9 @@ static bool  _track_exists(const Itdb_Track* track_, const struct gpod_track_fs_
 static int  gpod_write_db(Itdb_iTunesDB* itdb, const char* mountpoint, GSList** pending)
 {
     GError*  error = NULL;
+    const gint64  then = g_get_monotonic_time();
     itdb_write(itdb, &error);
+    GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_COMMIT, then, 0);
 
     bool  ret = true;
 
@@ -266,7 +502,7 @@ static int  gpod_cp_track(const struct gpod_cp_log_ctx* lctx_,
                           GSList** pending_,
                           struct gpod_track_fs_hash*  tfsh_,
                           Itdb_Playlist**  recentpl_,
-                          GHashTable* tracks_, GSList** replaced_,
+                          GHashTable* tracks_, struct gpod_cp_report* report_,
                           GError** error_)
 {
     Itdb_Track*  track = *track_;
@@ -286,16 +522,29 @@ static int  gpod_cp_track(const struct gpod_cp_log_ctx* lctx_,
         itdb_track_add(itdb, track, -1);
         itdb_playlist_add_track(mpl_, track, -1);
 
+        const gint64  then = g_get_monotonic_time();
         bool  ok = itdb_cp_track_to_ipod (track, xfrm_->path[0] ? xfrm_->path : path_, error_);
+        GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_COPY, then, ok ? track->size : 0);
 
         if (ok)
         {
             stats.xcode_time += (xfrm_->path[0]) ? xcodetime_ : 0;
             ++(*added_);
             itdb_filename_ipod2fs(track->ipod_path);
-            gpod_cp_log(lctx_, "{ title='%s' artist='%s' album='%s' ipod_path='%s' }\n", track->title ? track->title : "", track->artist ? track->artist : "", track->album ? track->album : "", track->ipod_path);
+
+            char  realtime[64] = { 0 };
+            if (xfrm_->path[0] && xfrm_->realtime > 0) {
+                const guint64  media = track->tracklen * 1000ULL;
+                stats.xcode_media += media;
+                stats.xcode_elapsed += media / xfrm_->realtime;
+                snprintf(realtime, sizeof(realtime), " xcode=%.1fx realtime (%u threads)", xfrm_->realtime, MAX(xfrm_->threads, 1));
+            }
+            gpod_cp_log(lctx_, "{ title='%s' artist='%s' album='%s' ipod_path='%s' }%s\n", track->title ? track->title : "", track->artist ? track->artist : "", track->album ? track->album : "", track->ipod_path, realtime);
 
             *pending_ = g_slist_append(*pending_, g_strdup(track->ipod_path));
+            if (opts.cksum) {
+                gpod_track_fs_hash_add(tfsh_, track);
+            }
 
             switch (track->mediatype) {
                 case ITDB_MEDIATYPE_AUDIO:  ++stats.music;  break;
@@ -349,16 +598,12 @@ static int  gpod_cp_track(const struct gpod_cp_log_ctx* lctx_,
                     sprintf(path, "%s/%s", itdb_get_mountpoint(itdb), existing_trk->ipod_path);
                     g_unlink(path);
 
-                    struct gpod_replaced*  replaced = (struct gpod_replaced*)g_malloc0(sizeof(struct gpod_replaced));
-                    replaced->title = g_strdup(existing_trk->title);
-                    replaced->artist = g_strdup(existing_trk->artist);
-                    replaced->album = g_strdup(existing_trk->album);
-                    strncpy(replaced->path, existing_trk->ipod_path, PATH_MAX);
-                    strncpy(replaced->new_path, track->ipod_path, PATH_MAX);
+                    gpod_cp_report_replaced(report_, existing_trk, track);
 
+                    if (opts.cksum) {
+                        gpod_track_fs_hash_remove(tfsh_, existing_trk);
+                    }
                     itdb_track_remove(existing_trk);
-
-                    *(replaced_) = g_slist_append(*(replaced_), (gpointer)replaced);
                 }
                 g_slist_free(existing_trks);
             }
@@ -399,21 +644,26 @@ struct gpod_cp_pool_args {
 
     time_t  time_added;
     uint32_t*  added;
-    GSList**  replaced;
     uint32_t*  dupl;
 
-    GSList**  failed;
-    GMutex  failed_lck;
+    struct gpod_cp_report*  report;
     const Itdb_IpodInfo* ipodinfo;
     GHashTable*  tracks;
+
+    // bounded number of queued/running tasks
+    unsigned  inflight;
+    unsigned  inflight_max;
+    GMutex  inflight_lck;
+    GCond  inflight_cond;
+    bool  dispatched;  // every input has been queued
 };
 
 struct gpod_cp_pool_args*  gpod_cp_pa_init(
         Itdb_iTunesDB* itdb_, Itdb_Playlist* mpl_, const char* mountpoint_,
-        const Itdb_IpodInfo* ipodinfo_, time_t time_added_, uint32_t* added_, GSList** failed_, GHashTable* tracks_, GSList** replaced_, uint32_t* dupl_,
+        const Itdb_IpodInfo* ipodinfo_, time_t time_added_, uint32_t* added_, struct gpod_cp_report* report_, GHashTable* tracks_, uint32_t* dupl_,
         GSList** pending_,
         struct gpod_track_fs_hash*  tfsh_,
-        Itdb_Playlist*  recentpl_)
+        Itdb_Playlist*  recentpl_, unsigned inflight_max_)
 {
     struct gpod_cp_pool_args*  args = (struct gpod_cp_pool_args*)g_malloc0(sizeof(struct gpod_cp_pool_args));
 
@@ -429,20 +679,23 @@ struct gpod_cp_pool_args*  gpod_cp_pa_init(
 
     args->time_added = time_added_;
     args->added = added_;
-    args->failed = failed_;
-    args->replaced = replaced_;
+    args->report = report_;
     args->dupl = dupl_;
 
-    g_mutex_init(&args->failed_lck);
+    args->inflight_max = inflight_max_;
+
     g_mutex_init(&args->cp_lck);
+    g_mutex_init(&args->inflight_lck);
+    g_cond_init(&args->inflight_cond);
 
     return args;
 }
 
 void  gpod_cp_pa_free(struct gpod_cp_pool_args*  args_)
 {
-    g_mutex_clear(&args_->failed_lck);
     g_mutex_clear(&args_->cp_lck);
+    g_mutex_clear(&args_->inflight_lck);
+    g_cond_clear(&args_->inflight_cond);
     g_free(args_);
 }
 
@@ -470,6 +723,175 @@ void gpod_cp_ta_free(struct gpod_cp_thread_args* obj_)
     g_free(obj_);
 }
 
+/* block the producer until there's room in the window, this keeps the pool's
+ * queue (and the per task args) bounded irrespective of number of inputs
+ */
+static void  gpod_cp_inflight_acquire(struct gpod_cp_pool_args* pargs_)
+{
+    g_mutex_lock(&pargs_->inflight_lck);
+    while (pargs_->inflight >= pargs_->inflight_max) {
+        g_cond_wait(&pargs_->inflight_cond, &pargs_->inflight_lck);
+    }
+    ++pargs_->inflight;
+    g_mutex_unlock(&pargs_->inflight_lck);
+}
+
+static void  gpod_cp_inflight_release(struct gpod_cp_pool_args* pargs_)
+{
+    g_mutex_lock(&pargs_->inflight_lck);
+    --pargs_->inflight;
+    g_cond_signal(&pargs_->inflight_cond);
+    g_mutex_unlock(&pargs_->inflight_lck);
+}
+
+// tag fields that are taken from the src on a metadata only update
+static const size_t  gpod_cp_meta_str_fields[] = {
+    offsetof(Itdb_Track, title),
+    offsetof(Itdb_Track, album),
+    offsetof(Itdb_Track, artist),
+    offsetof(Itdb_Track, genre),
+    offsetof(Itdb_Track, comment),
+    offsetof(Itdb_Track, sort_title),
+    offsetof(Itdb_Track, sort_album),
+    offsetof(Itdb_Track, sort_artist),
+};
+
+#define GPOD_CP_TRACK_STR(track_, offset_)  (*(gchar**)((char*)(track_) + (offset_)))
+
+static bool  _track_meta_equal(const Itdb_Track* a_, const Itdb_Track* b_)
+{
+    for (unsigned i=0; i<sizeof(gpod_cp_meta_str_fields)/sizeof(size_t); ++i) {
+        if (g_strcmp0(GPOD_CP_TRACK_STR(a_, gpod_cp_meta_str_fields[i]), GPOD_CP_TRACK_STR(b_, gpod_cp_meta_str_fields[i])) != 0) {
+            return false;
+        }
+    }
+    return a_->track_nr == b_->track_nr && a_->year == b_->year;
+}
+
+static void  _track_meta_copy(Itdb_Track* dest_, const Itdb_Track* src_)
+{
+    for (unsigned i=0; i<sizeof(gpod_cp_meta_str_fields)/sizeof(size_t); ++i) {
+        gchar**  dest = &GPOD_CP_TRACK_STR(dest_, gpod_cp_meta_str_fields[i]);
+        g_free(*dest);
+        *dest = g_strdup(GPOD_CP_TRACK_STR(src_, gpod_cp_meta_str_fields[i]));
+    }
+    dest_->track_nr = src_->track_nr;
+    dest_->year = src_->year;
+    dest_->time_modified = time(NULL);
+}
+
+/* the src audio is already on the device: if the track it would replace, with
+ * the same title/artist/album, has that audio then update its tags in place
+ * instead of a transcode/copy/replace
+ *
+ * returns 1 if updated, 0 if there's no such track or its tags are unchanged,
+ * <0 on failure to read the src
+ */
+static int  gpod_cp_meta_update(const struct gpod_cp_log_ctx* lctx_, struct gpod_cp_pool_args* pargs_, const char* path_, guint src_cksum_)
+{
+    // only a track with a full title/artist/album is ever replaced, avoid the probe otherwise
+    bool  candidate = false;
+    g_mutex_lock(&pargs_->cp_lck);
+    for (GSList* l = gpod_track_fs_hash_lookup_cksum(pargs_->tfsh, src_cksum_); l && !candidate; l=l->next) {
+        candidate = _track_key_valid((Itdb_Track*)l->data);
+    }
+    g_mutex_unlock(&pargs_->cp_lck);
+    if (!candidate) {
+        return 0;
+    }
+
+    // tags only, the fast probe is enough
+    struct gpod_ff_media_info  mi;
+    gpod_ff_media_info_init(&mi);
+    char*  err = NULL;
+
+    gint64  then = g_get_monotonic_time();
+    const int  scanned = gpod_cache_scan(gpod_cp_cache, &mi, path_, pargs_->ipodinfo->ipod_generation, true, &err);
+    GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_PROBE, then, mi.file_size);
+    g_free(err);
+    if (scanned < 0) {
+        gpod_ff_media_info_free(&mi);
+        return -1;
+    }
+
+    // only the tags are used, the audio itself never leaves the src
+    mi.supported_ipod_fmt = true;
+    Itdb_Track*  src = gpod_ff_meta_to_track(&mi, 0, opts.sanitize);
+    gpod_ff_media_info_free(&mi);
+
+    if (!_track_key_valid(src)) {
+        itdb_track_free(src);
+        return 0;
+    }
+
+    int  updated = 0;
+    then = g_get_monotonic_time();
+    g_mutex_lock(&pargs_->cp_lck);
+    GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_LOCK, then, 0);
+
+    // lookup again, may have been replaced whilst unlocked
+    GSList*  same_audio = gpod_track_fs_hash_lookup_cksum(pargs_->tfsh, src_cksum_);
+    Itdb_Track*  target = NULL;
+    for (GSList* l = (GSList*)g_hash_table_lookup(pargs_->tracks, src); l && target == NULL; l=l->next) {
+        if (g_slist_find(same_audio, l->data)) {
+            target = (Itdb_Track*)l->data;
+        }
+    }
+
+    if (target && !_track_meta_equal(target, src))
+    {
+        gpod_track_htbl_remove(pargs_->tracks, target);
+        _track_meta_copy(target, src);
+        gpod_track_htbl_insert(pargs_->tracks, target);
+
+        gpod_cp_log(lctx_, "{ title='%s' artist='%s' album='%s' ipod_path='%s' } metadata updated\n", target->title ? target->title : "", target->artist ? target->artist : "", target->album ? target->album : "", target->ipod_path);
+        updated = 1;
+        ++stats.updated;
+    }
+    g_mutex_unlock(&pargs_->cp_lck);
+
+    itdb_track_free(src);
+    return updated;
+}
+
+/* each worker keeps its encoder/resampler/buffers across the files it
+ * transcodes - the pool's threads outlive the pool (glib keeps them for
+ * reuse) so the sessions are also recorded here and freed once the pool is
+ * torn down
+ */
+static GPrivate  gpod_cp_xcode_session = G_PRIVATE_INIT(NULL);
+
+static struct {
+    GMutex  lck;
+    GPtrArray*  all;
+} gpod_cp_xcode_sessions = { 0 };
+
+static struct gpod_ff_transcode_session*  gpod_cp_xcode_session_get()
+{
+    struct gpod_ff_transcode_session*  session = g_private_get(&gpod_cp_xcode_session);
+    if (session == NULL && (session = gpod_ff_transcode_session_new()) )
+    {
+        g_private_set(&gpod_cp_xcode_session, session);
+
+        g_mutex_lock(&gpod_cp_xcode_sessions.lck);
+        if (gpod_cp_xcode_sessions.all == NULL) {
+            gpod_cp_xcode_sessions.all = g_ptr_array_new_with_free_func((GDestroyNotify)gpod_ff_transcode_session_free);
+        }
+        g_ptr_array_add(gpod_cp_xcode_sessions.all, session);
+        g_mutex_unlock(&gpod_cp_xcode_sessions.lck);
+    }
+    return session;
+}
+
+// only once no worker can run
+static void  gpod_cp_xcode_sessions_free()
+{
+    if (gpod_cp_xcode_sessions.all) {
+        g_ptr_array_free(gpod_cp_xcode_sessions.all, TRUE);
+        gpod_cp_xcode_sessions.all = NULL;
+    }
+}
+
 void gpod_cp_thread(gpointer args_, gpointer pool_args_)
 {
     struct gpod_cp_thread_args*  args = (struct gpod_cp_thread_args*)args_;
@@ -486,6 +908,12 @@ void gpod_cp_thread(gpointer args_, gpointer pool_args_)
     struct timeval  tv = { 0 };
     uint64_t  uuid = -1;
     guint  then, now;
+    gint64  lck_then;
+    guint  src_cksum = 0;
+    bool  existing = false;
+    char*  existing_title = NULL;
+    char*  existing_artist = NULL;
+    char*  existing_album = NULL;
 
     if (gpod_stop) {
         goto thread_cleanup;
@@ -497,21 +925,70 @@ void gpod_cp_thread(gpointer args_, gpointer pool_args_)
     }
 
     gpod_ff_transcode_ctx_init(&xfrm, opts.enc, opts.xcode_quality, opts.sync_meta);
+    xfrm.audio_opts.resampler = opts.resampler;
+    xfrm.audio_opts.resample_precision = opts.resample_precision;
+    xfrm.loudness = opts.soundcheck;
+    xfrm.session = gpod_cp_xcode_session_get();
+
+    /* once every file is queued and there are fewer left than workers, share
+     * the idle workers between the remaining files to encode long inputs in
+     * segments or to thread the video codecs - while the walk is still
+     * queueing, a short inflight count is the window filling up
+     */
+    g_mutex_lock(&pargs->inflight_lck);
+    if (pargs->dispatched && pargs->inflight < opts.max_threads) {
+        xfrm.threads = xfrm.segments = opts.max_threads / pargs->inflight;
+    }
+    g_mutex_unlock(&pargs->inflight_lck);
+
+    /* demux only hash of the src audio - if its already on the device, either
+     * copied as is or as the src of a transcode, we can avoid any decode/encode
+     */
+    if (opts.cksum) {
+        GStatBuf  st;
+        const uint64_t  size = g_stat(args->path, &st) == 0 ? st.st_size : 0;
+
+        then = g_get_monotonic_time();
+        src_cksum = gpod_cache_hash_file(gpod_cp_cache, args->path);
+        GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_HASH, then, size);
+    }
 
+    lck_then = g_get_monotonic_time();
     g_mutex_lock(&pargs->cp_lck);
+    GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_LOCK, lck_then, 0);
     gettimeofday(&tv, NULL);
+    if (src_cksum) {
+        // copied, the track may be replaced by another worker once unlocked
+        GSList*  l = gpod_track_fs_hash_lookup_cksum(pargs->tfsh, src_cksum);
+        if ( (existing = l != NULL) ) {
+            const Itdb_Track*  t = (const Itdb_Track*)l->data;
+            existing_title = g_strdup(t->title ? t->title : "");
+            existing_artist = g_strdup(t->artist ? t->artist : "");
+            existing_album = g_strdup(t->album ? t->album : "");
+        }
+    }
     g_mutex_unlock(&pargs->cp_lck);
     uuid = tv.tv_sec * 1000000 + tv.tv_usec;
 
+    if (existing) {
+        // same audio but tags may have been updated
+        if (!opts.replace || gpod_cp_meta_update(&lctx, pargs, args->path, src_cksum) <= 0)
+        {
+            g_mutex_lock(&pargs->cp_lck);
+            gpod_cp_log(&lctx, "{ title='%s' artist='%s' album='%s' ipod_path= *** DUPL %lu *** }\n", existing_title, existing_artist, existing_album, src_cksum);
+            ++(*pargs->dupl);
+            g_mutex_unlock(&pargs->cp_lck);
+        }
+        goto thread_cleanup;
+    }
+
     then = g_get_monotonic_time();
-    if ( (track = _track(args->path, &xfrm, uuid, pargs->ipodinfo->ipod_generation, pargs->time_added, opts.sanitize, &err)) == NULL) {
+    if ( (track = _track(args->path, src_cksum, &xfrm, uuid, pargs->ipodinfo->ipod_generation, pargs->time_added, opts.sanitize, &err)) == NULL) {
         gpod_cp_log(&lctx, "{ } track err - %s\n", err ? err : "<>");
         g_free(err);
         err = NULL;
 
-        g_mutex_lock(&pargs->failed_lck);
-        *(pargs->failed) = g_slist_append(*(pargs->failed), (gpointer)g_strdup(args->path));
-        g_mutex_unlock(&pargs->failed_lck);
+        gpod_cp_report_failed(pargs->report, args->path);
     }
     else
     {
@@ -520,11 +997,13 @@ void gpod_cp_thread(gpointer args_, gpointer pool_args_)
             goto thread_cleanup;
         }
 
+        lck_then = g_get_monotonic_time();
         g_mutex_lock(&pargs->cp_lck);
+        GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_LOCK, lck_then, 0);
         if (gpod_cp_track(&lctx,
                           pargs->itdb, pargs->mpl, &track, pargs->mountpoint, pargs->added, pargs->dupl,
-                          &xfrm, then-now, args->path, pargs->pending, pargs->tfsh, &pargs->recentpl,
-                          pargs->tracks, pargs->replaced,
+                          &xfrm, now-then, args->path, pargs->pending, pargs->tfsh, &pargs->recentpl,
+                          pargs->tracks, pargs->report,
                           &error) < 0) {
             ++(pargs->fatal);
         }
@@ -537,8 +1016,107 @@ thread_cleanup:
         g_error_free(error);
         error = NULL;
     }
+    g_free(existing_title);
+    g_free(existing_artist);
+    g_free(existing_album);
 
     gpod_cp_ta_free(args);
+    gpod_cp_inflight_release(pargs);
+}
+
+static bool  _count_files(const gchar* path_, void* n_)
+{
+    ++(*(uint32_t*)n_);
+    return !gpod_stop;
+}
+
+// max bytes of any one file to pull into the page cache ahead of the workers
+#define GPOD_CP_PREFETCH_MAX  (64*1024*1024)
+
+/* hint the kernel to start reading the file so it's (mostly) resident by
+ * the time a worker opens it - runs on its own thread as WILLNEED can block
+ * on some filesystems (nfs)
+ */
+static void  gpod_cp_prefetch(gpointer path_, gpointer unused_)
+{
+    char*  path = (char*)path_;
+    int  fd;
+
+    if (!gpod_stop && (fd = open(path, O_RDONLY)) >= 0)
+    {
+        struct stat  st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            const off_t  len = st.st_size < GPOD_CP_PREFETCH_MAX ? st.st_size : GPOD_CP_PREFETCH_MAX;
+            // only the hint is timed, the read itself is async - no throughput
+            const gint64  then = g_get_monotonic_time();
+            posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+            GPOD_CP_STAGE_ADD(GPOD_CP_STAGE_PREFETCH, then, 0);
+        }
+        close(fd);
+    }
+    g_free(path);
+}
+
+struct gpod_cp_dispatch {
+    GThreadPool*  tp;
+    struct gpod_cp_pool_args*  pargs;
+    uint32_t  N;
+    uint32_t*  requested;
+
+    // files walked and being prefetched but not yet dispatched
+    GThreadPool*  prefetch;
+    GQueue  ahead;
+};
+
+static void  _dispatch(struct gpod_cp_dispatch* d_, const gchar* path_)
+{
+    gpod_cp_inflight_acquire(d_->pargs);
+    g_thread_pool_push(d_->tp, (void*)gpod_cp_ta_init(path_, d_->N, ++(*d_->requested)), NULL);
+}
+
+static bool  _dispatch_file(const gchar* path_, void* dispatch_)
+{
+    struct gpod_cp_dispatch*  d = (struct gpod_cp_dispatch*)dispatch_;
+    if (gpod_stop) {
+        return false;
+    }
+
+    if (d->prefetch == NULL) {
+        _dispatch(d, path_);
+        return true;
+    }
+
+    g_thread_pool_push(d->prefetch, g_strdup(path_), NULL);
+    g_queue_push_tail(&d->ahead, g_strdup(path_));
+
+    if (g_queue_get_length(&d->ahead) > (guint)opts.readahead) {
+        char*  path = (char*)g_queue_pop_head(&d->ahead);
+        _dispatch(d, path);
+        g_free(path);
+    }
+    return true;
+}
+
+static void  _dispatch_drain(struct gpod_cp_dispatch* d_)
+{
+    char*  path;
+    while ( (path = (char*)g_queue_pop_head(&d_->ahead)) ) {
+        if (!gpod_stop) {
+            _dispatch(d_, path);
+        }
+        g_free(path);
+    }
+
+    g_mutex_lock(&d_->pargs->inflight_lck);
+    d_->pargs->dispatched = true;
+    g_mutex_unlock(&d_->pargs->inflight_lck);
+
+    if (d_->prefetch) {
+        // anything not yet prefetched is already with the workers
+        g_thread_pool_free(d_->prefetch, TRUE, TRUE);
+        d_->prefetch = NULL;
+    }
 }
 
 
@@ -595,6 +1173,72 @@ void  gpod_cp_destroy()
     unlink(GPOD_CP_LOCKFILE);
 }
 
+static void  gpod_cp_stats_init()
+{
+    for (unsigned i=0; i<GPOD_CP_STAGE_MAX; ++i) {
+        gpod_latency_init(&stats.stage[i], gpod_cp_stage_names[i]);
+    }
+}
+
+static void  gpod_cp_stats_destroy()
+{
+    for (unsigned i=0; i<GPOD_CP_STAGE_MAX; ++i) {
+        gpod_latency_clear(&stats.stage[i]);
+    }
+}
+
+static void  gpod_cp_stats_print()
+{
+    g_print("stage timings (msecs):\n"
+            "  %-10s %7s %10s %10s %10s %12s %9s\n", "stage", "count", "p50", "p95", "max", "total", "MB/s");
+    for (unsigned i=0; i<GPOD_CP_STAGE_MAX; ++i)
+    {
+        const struct gpod_latency*  l = &stats.stage[i];
+        if (l->count == 0) {
+            continue;
+        }
+        char  mbps[32] = "-";
+        if (l->bytes) {
+            snprintf(mbps, sizeof(mbps), "%.2f", gpod_latency_mbps(l));
+        }
+        g_print("  %-10s %7" G_GUINT64_FORMAT " %10.3f %10.3f %10.3f %12.3f %9s\n",
+                l->name, l->count,
+                gpod_latency_percentile(l, 50)/1000.0,
+                gpod_latency_percentile(l, 95)/1000.0,
+                l->max/1000.0,
+                l->total/1000.0,
+                mbps);
+    }
+}
+
+static int  gpod_cp_stats_json(const char* path_, guint64 elapsed_)
+{
+    FILE*  f = strcmp(path_, "-") == 0 ? stdout : fopen(path_, "w");
+    if (f == NULL) {
+        g_printerr("failed to write stats to %s - %s\n", path_, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"elapsed_usecs\": %" G_GUINT64_FORMAT ",\n  \"threads\": %u,\n  \"stages\": [", elapsed_, opts.max_threads);
+    for (unsigned i=0; i<GPOD_CP_STAGE_MAX; ++i)
+    {
+        const struct gpod_latency*  l = &stats.stage[i];
+        fprintf(f, "%s\n    { \"stage\": \"%s\", \"count\": %" G_GUINT64_FORMAT ", "
+                   "\"p50_usecs\": %" G_GUINT64_FORMAT ", \"p95_usecs\": %" G_GUINT64_FORMAT ", \"max_usecs\": %" G_GUINT64_FORMAT ", "
+                   "\"total_usecs\": %" G_GUINT64_FORMAT ", \"bytes\": %" G_GUINT64_FORMAT ", \"mb_per_sec\": %.3f }",
+                i ? "," : "",
+                l->name, l->count,
+                gpod_latency_percentile(l, 50), gpod_latency_percentile(l, 95), l->max,
+                l->total, l->bytes, gpod_latency_mbps(l));
+    }
+    fprintf(f, "\n  ]\n}\n");
+
+    if (f != stdout) {
+        fclose(f);
+    }
+    return 0;
+}
+
 void  _usage(const char* argv0_)
 {
     char *basename = g_path_get_basename(argv0_);
@@ -650,15 +1294,21 @@ void  _usage(const char* argv0_)
     g_print ("usage: %s  [OPTIONS] <file|directory> [<file|directory> ...]\n"
 	     "\n"
              "    adds specified files to iPod/iTunesDB\n"
-             "    Will automatically transcode unsupported audio (flac,wav etc) to .m4a\n"
+             "    Will automatically transcode unsupported audio (flac,wav etc) to .m4a and video to h264 .m4v\n"
              "\n"
 	     "  iPod\n"
              "    -M  --mount-point              <iPod dir>               location of iPod data, as directory mount point\n"
 	     "    -T  --threads                  <max threads>            number of threads for xcoding/copying - default: #system vCPUs\n"
+	     "    -W  --inflight                 <max tasks>              max files queued/in progress at any time - default: 2x threads\n"
+	     "    -A  --readahead                <files>                  prefetch files into page cache this many ahead of the workers - 0 to disable, default: #threads\n"
+	     "    -J  --stats-json               <file|->                 write per stage timings as json\n"
+	     "    -C  --disable-probe-cache                               disable the cache of src file probe/checksum results ($XDG_CACHE_HOME/gpod-utils)\n"
 	     "\n"
              "    -c  --disable-tracks-checksum-validate                  disable generate checksum validation of each file in iTunesDB\n"
              "                                                            comparison to prevent duplicate\n"
 	     "    -S  --disable-tracks-sanitize                           disable text sanitization; chars like ’ to '\n"
+	     "    -L  --disable-tracks-soundcheck                         disable EBU R128 loudness measurement for the iPod's Sound Check\n"
+	     "    -a  --disable-tracks-artwork                            disable import of embedded artwork\n"
 	     "    -r  --tracks-replace           <Y|N>                    replace existing track of same title/album/artist - default: Y\n"
 	     "    -m  --tracks-media-type        <media type>             podcast|audiobook (audio/video determined automatically)\n"
 	     "    -t  --tracks-time-added        <time added>             spoof 'added' time to specified date in ISO8601\n"
@@ -669,6 +1319,7 @@ void  _usage(const char* argv0_)
 	     "    -q  --encoder-quality          <0-9>                    VBR level (ffmpeg -q:a 0-9)\n"
 	     "                                   <128,160,192,256,320>    CBR 128..320k (not applicable for alac)\n"
 	     "    -d  --encoder-metadata-sync    <Y|N>                    sync metadata - default: Y\n"
+	     "    -R  --encoder-resampler        <swr|soxr>[:fast|high]   sample rate conversion engine and precision - default: swr\n"
 	     "\n"
 	     "  Playlist\n"
 	     "    -P  --playlist-name            <name>                   generate specific 'recently added' playlist - if not specified, default 'Recent' playlists are generated\n"
@@ -696,9 +1347,15 @@ int main (int argc, char *argv[])
 	{"mount-point", 		1, 0, 'M' },
 	{"force-unsupported",		0, 0, 'F' },
 	{"threads", 			1, 0, 'T' },
+	{"inflight", 			1, 0, 'W' },
+	{"readahead", 			1, 0, 'A' },
+	{"stats-json", 			1, 0, 'J' },
+	{"disable-probe-cache",		0, 0, 'C' },
 
 	{"disable-tracks-checksum-validate", 0, 0, 'c' },
 	{"disable-tracks-sanitize",	2, 0, 'S' },
+	{"disable-tracks-soundcheck",	0, 0, 'L' },
+	{"disable-tracks-artwork",	0, 0, 'a' },
 	{"tracks-replace",		2, 0, 'r' },
 	{"tracks-media-type", 		1, 0, 'm' },
 	{"tracks-time-added", 		1, 0, 't' },
@@ -707,6 +1364,7 @@ int main (int argc, char *argv[])
 	{"disable-encoder-fallback", 	0, 0, 'E' },
 	{"encoder-quality", 		1, 0, 'q' },
 	{"encoder-metadata-sync", 	2, 0, 'd' },
+	{"encoder-resampler", 		1, 0, 'R' },
 
 	{"playlist-name", 		1, 0, 'P' },
 	{"playlist-limit", 		1, 0, 'n' },
@@ -740,7 +1398,11 @@ int main (int argc, char *argv[])
         switch (c) {
             case 'M':  opts.itdb_path = optarg;  break;
             case 'c':  opts.cksum = false;  break;
+            case 'L':  opts.soundcheck = false;  break;
+            case 'a':  opts.artwork = false;  break;
             case 'F':  opts.force = true;  break;
+            case 'J':  opts.stats_json = optarg;  break;
+            case 'C':  opts.cache = false;  break;
 
 	    case 'E':
 		opts.enc_fallback = false;
@@ -755,6 +1417,22 @@ int main (int argc, char *argv[])
 		}
 	    } break;
 
+	    case 'R':
+	    {
+		const char*  precision = strchr(optarg, ':');
+		const size_t  n = precision ? (size_t)(precision - optarg) : strlen(optarg);
+
+		if      (strncasecmp(optarg, "soxr", n) == 0)  opts.resampler = GPOD_FF_RESAMPLE_SOXR;
+		else if (strncasecmp(optarg, "swr", n) == 0)   opts.resampler = GPOD_FF_RESAMPLE_SWR;
+
+		if (precision) {
+		    ++precision;
+		    if      (strcasecmp(precision, "fast") == 0)  opts.resample_precision = GPOD_FF_RESAMPLE_FAST;
+		    else if (strcasecmp(precision, "high") == 0)  opts.resample_precision = GPOD_FF_RESAMPLE_HIGH;
+		    else                                          opts.resample_precision = GPOD_FF_RESAMPLE_STD;
+		}
+	    } break;
+
             case 'e':
 	    {
 		const struct gpod_ff_enc_support*  p = gpod_ff_encoders;
@@ -862,6 +1540,13 @@ int main (int argc, char *argv[])
 		    opts.time_added = -1;
 		}
 	    } break;
+            case 'W':
+            {
+                // <= 0 falls back to the default
+                const int  inflight = atoi(optarg);
+                opts.inflight = inflight > 0 ? (unsigned)inflight : 0;
+            } break;
+            case 'A':  opts.readahead = atoi(optarg);  break;
             case 'T':
             {
                 unsigned short  req_max_threads = (unsigned short)atoi(optarg);
@@ -939,6 +1624,14 @@ int main (int argc, char *argv[])
         return 2;
     }
 
+    if (opts.cache) {
+        char*  err = NULL;
+        if ( (gpod_cp_cache = gpod_cache_open(NULL, &err)) == NULL) {
+            g_printerr("probe cache unavailable, continuing without - %s\n", err ? err : "unknown error");
+            free(err);
+        }
+    }
+
 
     Itdb_Playlist*  mpl = itdb_playlist_mpl(itdb);
 
@@ -946,25 +1639,40 @@ int main (int argc, char *argv[])
     uint32_t  requested = 0;
     uint32_t  dupl = 0;
 
-    GSList*  files = NULL;
-    GSList*  failed = NULL;
-    GSList*  replaced = NULL;
-    int  i = optind;
-    while (i < argc) {
-	const char*  what = argv[i++];
-	int  arglen =  strlen(what);
+    /* inputs are walked twice, once to count and again to dispatch, so that
+     * memory use doesn't grow with the number of files requested
+     */
+    const char**  inputs = (const char**)g_malloc0(sizeof(const char*)*(argc-optind+1));
+    uint32_t  N = 0;
+    {
+	const char**  in = inputs;
+	int  i = optind;
+	while (i < argc) {
+	    const char*  what = argv[i++];
+	    int  arglen =  strlen(what);
+
+	    if (what[arglen-1] == '/') {
+		--arglen;
+	    }
 
-	if (what[arglen-1] == '/') {
-	    --arglen;
+	    if (strncmp(what, mountpoint, arglen) == 0) {
+		g_printerr("source includes ipod mount point, %s - ignoring\n", mountpoint);
+		continue;
+	    }
+	    *in++ = what;
+	    gpod_walk_dir_foreach(what, _count_files, &N);
 	}
+    }
 
-	if (strncmp(what, mountpoint, arglen) == 0) {
-	    g_printerr("source includes ipod mount point, %s - ignoring\n", mountpoint);
-	    continue;
-	}
-        gpod_walk_dir(what, &files);
+    struct gpod_cp_report  report;
+    gpod_cp_report_init(&report);
+
+    if (opts.inflight == 0) {
+	opts.inflight = opts.max_threads*2;
+    }
+    if (opts.readahead < 0) {
+	opts.readahead = opts.max_threads;
     }
-    const uint32_t  N = g_slist_length(files);
 
 
     GSList*  pending = NULL;
@@ -1008,7 +1716,8 @@ int main (int argc, char *argv[])
 	g_printf("requested transcoding NOT available%s\n", extra);
     }
 
-    guint  then = g_get_monotonic_time();
+    gint64  then = g_get_monotonic_time();
+    gpod_cp_stats_init();
 
     struct gpod_track_fs_hash  tfsh;
     if (opts.cksum && (support & (SUPPORT_DEVICE|SUPPORT_FORCED) )) {
@@ -1025,8 +1734,8 @@ int main (int argc, char *argv[])
 
 	// create thread pool and throw all tasks (direct cp and xcode)
 	struct gpod_cp_pool_args*  pool_args = gpod_cp_pa_init(itdb, mpl, mountpoint,
-							       ipodinfo, opts.time_added, &added, &failed, tracks, &replaced, &dupl,
-							       &pending, &tfsh, recentpl);
+							       ipodinfo, opts.time_added, &added, &report, tracks, &dupl,
+							       &pending, &tfsh, recentpl, opts.inflight);
 
 	GThreadPool*  tp = g_thread_pool_new((GFunc)gpod_cp_thread, (gpointer)pool_args,
 					     opts.max_threads,
@@ -1035,19 +1744,19 @@ int main (int argc, char *argv[])
 	g_print("processing %u tracks over %u threads\n", N, opts.max_threads);
 
 	then = g_get_monotonic_time();
-	GSList*  p = files;
-	while (p && !gpod_stop && (support & (SUPPORT_DEVICE|SUPPORT_FORCED)) )
-	{
-	    ++requested;
-	    const char*  path = (const char*)(p->data);
-	    p = p->next;
-
-	    struct gpod_cp_thread_args*  args = gpod_cp_ta_init(path, N, requested);
-	    g_thread_pool_push(tp, (void*)args, NULL);
+	struct gpod_cp_dispatch  dispatch = { tp, pool_args, N, &requested };
+	g_queue_init(&dispatch.ahead);
+	if (opts.readahead > 0) {
+	    dispatch.prefetch = g_thread_pool_new((GFunc)gpod_cp_prefetch, NULL, 1, TRUE, NULL);
 	}
+	for (const char** in = inputs; *in && !gpod_stop && (support & (SUPPORT_DEVICE|SUPPORT_FORCED)); ++in) {
+	    gpod_walk_dir_foreach(*in, _dispatch_file, &dispatch);
+	}
+	_dispatch_drain(&dispatch);
 
 	// wait for all tasks
 	g_thread_pool_free(tp, FALSE, TRUE);
+	gpod_cp_xcode_sessions_free();
 	gpod_cp_pa_free(pool_args);
 	pool_args = NULL;
 	tp = NULL;
@@ -1056,29 +1765,22 @@ int main (int argc, char *argv[])
 	    gpod_track_fs_hash_destroy(&tfsh);
 	}
 
-	if (failed)
+	if (report.failed->len)
 	{
 	    g_print("failed tracks:\n");
-	    for (p=failed; p!=NULL; p=p->next) {
-		g_print("  %s\n", p->data);
+	    for (guint j=0; j<report.failed->len; ++j) {
+		g_print("  %s\n", (const char*)g_ptr_array_index(report.failed, j));
 	    }
-	    g_slist_free_full(failed, g_free);
-	    failed = NULL;
 	}
-	g_slist_free_full(files, g_free);
-	files = NULL;
 
-	if (replaced)
+	if (report.replaced->len)
 	{
 	    g_print("replaced tracks:\n");
-	    for (p=replaced; p!=NULL; p=p->next)
+	    for (guint j=0; j<report.replaced->len; ++j)
 	    {
-		struct gpod_replaced*  r = (struct gpod_replaced*)p->data;
+		const struct gpod_replaced*  r = &g_array_index(report.replaced, struct gpod_replaced, j);
 		g_print("  %s => %s { title='%s' artist='%s' album='%s' }\n", r->path, r->new_path, r->title, r->artist, r->album);
 	    }
-
-	    g_slist_free_full(replaced, replaced_destroy);
-	    replaced = NULL;
 	}
 
 	if (tracks) {
@@ -1105,10 +1807,15 @@ int main (int argc, char *argv[])
 	ret = gpod_write_db(itdb, mountpoint, NULL);
     }
 
+    const gint64  now = g_get_monotonic_time();
     char duration[32] = { 0 };
-    gpod_duration(duration, then, g_get_monotonic_time());
-    char xcode_duration[32] = { 0 };
-    gpod_duration(xcode_duration, stats.xcode_time, 0);
+    gpod_duration(duration, then, now);
+    char xcode_duration[64] = { 0 };
+    gpod_duration(xcode_duration, 0, stats.xcode_time);
+    if (stats.xcode_elapsed) {
+        const size_t  n = strlen(xcode_duration);
+        snprintf(xcode_duration+n, sizeof(xcode_duration)-n, ", %.1fx realtime", stats.xcode_media/(double)stats.xcode_elapsed);
+    }
 
     char  userterm[128] = { 0 };
     if (gpod_stop) {
@@ -1121,11 +1828,34 @@ int main (int argc, char *argv[])
     }
 
 
-    g_print("iPod total tracks=%u  %u/%u items %s  dupl=%u  music=%u video=%u other=%u  in %s%s (ttl xcode %s)\n", g_list_length(itdb_playlist_mpl(itdb)->members), ret < 0 ? 0 : added, N, stats_size, dupl, stats.music, stats.video, stats.other, duration, userterm, xcode_duration);
+    g_print("iPod total tracks=%u  %u/%u items %s  dupl=%u upd=%u  music=%u video=%u other=%u  in %s%s (ttl xcode %s)\n", g_list_length(itdb_playlist_mpl(itdb)->members), ret < 0 ? 0 : added, N, stats_size, dupl, stats.updated, stats.music, stats.video, stats.other, duration, userterm, xcode_duration);
+
+    if (artwork_cache.scaled) {
+        g_print("artwork: %u images processed, %u tracks shared them\n", artwork_cache.scaled, artwork_cache.hits);
+    }
+    if (gpod_cp_cache) {
+        struct gpod_cache_stats  cstats;
+        gpod_cache_stats(gpod_cp_cache, &cstats);
+        g_print("probe cache: %u hits, %u misses\n", cstats.hits, cstats.misses);
+    }
+
+    gpod_cp_stats_print();
+    if (opts.stats_json) {
+        gpod_cp_stats_json(opts.stats_json, (guint)(now-then));
+    }
+    gpod_cp_stats_destroy();
+
+    gpod_cp_report_free(&report);
+    g_free(inputs);
 
     itdb_device_free(itdev);
     itdb_free(itdb);
 
+    if (artwork_cache.tbl) {
+        g_hash_table_destroy(artwork_cache.tbl);
+    }
+    gpod_cache_close(gpod_cp_cache);
+
     gpod_cp_destroy();
 
     return ret;
@@ -7,6 +7,7 @@
 #define QUERY_TBL \
   "CREATE TABLE IF NOT EXISTS tracks (" \
     "  id         INTEGER PRIMARY KEY NOT NULL," \
+    "  dbid       INTEGER UNIQUE," \
     "  ipod_path  VARCHAR(4096) NOT NULL,"       \
     "  mediatype  INTEGER NOT NULL,"       \
     "  title      VARCHAR(2048)," \
@@ -95,15 +96,68 @@
 #define QUERY_IDX1 \
   "CREATE INDEX IF NOT EXISTS idx_key_flds ON tracks(title, album, artist, genre);"
  
+// bulk load settings, restored to the defaults once the rows are loaded
+#define QUERY_BULK_PRAGMA \
+  "PRAGMA journal_mode = OFF;" \
+  "PRAGMA synchronous = OFF;"
+#define QUERY_FINAL_PRAGMA \
+  "PRAGMA journal_mode = DELETE;" \
+  "PRAGMA synchronous = FULL;"
+
 const char*  db_init_queries[] = {
+  QUERY_BULK_PRAGMA,
   QUERY_DROP,
   QUERY_TBL,
+  NULL
+};
+
+// created after the rows are loaded, cheaper than maintaining per insert
+const char*  db_index_queries[] = {
   QUERY_IDX,
   QUERY_IDX1,
   NULL
 };
 
+const char*  db_final_queries[] = {
+  QUERY_FINAL_PRAGMA,
+  NULL
+};
+
+/* incremental sync of an existing db: rows are matched on the track's
+ * persistent dbid, the id is reassigned whenever the iTunesDB is written;
+ * playing a track on the device does not change its time_modified
+ */
+#define QUERY_SYNC_SELECT \
+  "SELECT dbid, id, time_modified, time_played, playcount, rating FROM tracks;"
+#define QUERY_SYNC_DELETE \
+  "DELETE FROM tracks WHERE dbid = ?;"
+
+/* replace also drops any row holding the (reassigned) id of another track,
+ * that track's row is rewritten in turn as its id has changed too - rows of
+ * tracks no longer on the device must be deleted beforehand
+ */
+#define QUERY_INSERT_VERB(verb) \
+  verb " INTO tracks (" \
+    "id, dbid, ipod_path, mediatype," \
+    "title, artist, album, genre, filetype, composer, grouping, albumartist, sort_artist, sort_title, sort_album, sort_albumartist, sort_composer," \
+    "size, tracklen, cd_nr, cds, track_nr, tracks, bitrate, samplerate, year, time_added, time_modified, time_played, rating, playcount, playcount2, recent_playcount," \
+    "checksum, " \
+    "unk126, unk132, unk144, unk148, unk152, unk179, unk180, unk196, unk204, unk220, unk224, unk228, unk232, unk236, unk240, unk244, unk252" \
+    "    )" \
+    "  VALUES (?, ?, ?, ?," \
+    "          ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?," \
+    "          ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?," \
+    "          ?," \
+    "          ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?" \
+    "         );"
+
+#define QUERY_INSERT  QUERY_INSERT_VERB("INSERT")
+#define QUERY_UPSERT  QUERY_INSERT_VERB("INSERT OR REPLACE")
+
 #undef QUERY_TBL
 #undef QUERY_IDX
+#undef QUERY_IDX1
+#undef QUERY_BULK_PRAGMA
+#undef QUERY_FINAL_PRAGMA
 
 #endif
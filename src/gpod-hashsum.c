@@ -7,6 +7,7 @@
 
 #include <gpod-utils.h>
 #include <gpod-ffmpeg.h>
+#include <gpod-cache.h>
 
 
 int main(int argc, char* argv[])
@@ -14,12 +15,13 @@ int main(int argc, char* argv[])
     const char* argv0 = basename(argv[0]);
 
     if (argc == 1 || argc == 2 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)) {
-	printf("usage:  %s: <files>\n"
+	printf("usage:  %s: [--no-cache] <files>\n"
 	       "\n"
 	       "   reports for each input:\n"
 	       "       file DBJ hash file sha1 sum | audio hash | audio DJB hash\n"
 	       "\n"
 	       "   Idneitfiers used by gpod utils to identify duplicate files.\n"
+	       "   Results are cached ($XDG_CACHE_HOME/gpod-utils) unless --no-cache\n"
 	       "\n"
 	       , argv0);
 	return -1;
@@ -31,6 +33,16 @@ int main(int argc, char* argv[])
     char* err = NULL;
     char*  streamhash = NULL;
     int  arg = 1;
+
+    struct gpod_cache*  cache = NULL;
+    if (strcmp(argv[arg], "--no-cache") == 0) {
+	++arg;
+    }
+    else if ( (cache = gpod_cache_open(NULL, &err)) == NULL) {
+	free(err);
+	err = NULL;
+    }
+
     while (arg < argc)
     {
 	const char*  path = argv[arg++];
@@ -39,8 +51,8 @@ int main(int argc, char* argv[])
 	err = NULL;
 	streamhash = NULL;
 
-	ret = gpod_hash_digest_file(&res, path);
-	gpod_ff_audio_hash(&streamhash, path, &err);
+	ret = gpod_cache_digest_file(cache, &res, path);
+	gpod_cache_audio_hash(cache, &streamhash, path, &err);
 
 	if (err) {
 	    printf("%s - %s\n", err, path);
@@ -53,6 +65,7 @@ int main(int argc, char* argv[])
 	free(streamhash);
 	free(err);
     }
+    gpod_cache_close(cache);
 
     return 0;
 }
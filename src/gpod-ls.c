@@ -28,14 +28,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
 #include <limits.h>
 #include <unistd.h>
+#include <errno.h>
 #include <getopt.h>
 
 #include <glib.h>
 #include <gmodule.h>
-#include <json.h>
 #include <gpod/itdb.h>
 #ifdef HAVE_SQLITE3
 #include <sqlite3.h>
@@ -45,18 +46,40 @@ typedef void* sqlite3;
 
 #include "gpod-db.h"
 #include "gpod-utils.h"
+#include "gpod-json.h"
+#include "gpod-arrow.h"
 
 
 #ifdef HAVE_SQLITE3
-bool  db_create(sqlite3 *hdl_)
+// reused for every row, rows are loaded in a single transaction
+static sqlite3_stmt*  db_insert = NULL;
+
+// incremental sync against the rows already in the db
+struct db_row {
+    gint64  dbid;
+    gint64  id;
+    gint64  time_modified;
+    gint64  time_played;
+    gint64  playcount;
+    gint64  rating;
+};
+
+static struct {
+    GHashTable*  rows;  // dbid -> db_row, those not (yet) seen in the iTunesDB
+    unsigned  inserted;
+    unsigned  updated;
+    unsigned  deleted;
+    unsigned  unchanged;
+} db_sync = { NULL, 0, 0, 0, 0 };
+
+static bool  db_exec(sqlite3 *hdl_, const char** queries_, const char* what_)
 {
-    int  ret;
     char*  err = NULL;
 
-    const char**  p = db_init_queries;
+    const char**  p = queries_;
     while (*p) {
-        if ((ret = sqlite3_exec(hdl_, *p, NULL, NULL, &err)) != SQLITE_OK) {
-            g_printerr ("failed to create db objects - %s\n", err);
+        if (sqlite3_exec(hdl_, *p, NULL, NULL, &err) != SQLITE_OK) {
+            g_printerr ("failed to %s - %s\n", what_, err);
             sqlite3_free(err);
             return false;
         }
@@ -65,325 +88,1001 @@ bool  db_create(sqlite3 *hdl_)
     return true;
 }
 
-bool  db_add_track(sqlite3 *hdl_, const Itdb_Track* track_)
+static bool  db_prepare(sqlite3 *hdl_, const char* query_)
 {
-#define QADD_TMPL \
-  "INSERT INTO tracks (" \
-    "id, ipod_path, mediatype," \
-    "title, artist, album, genre, filetype, composer, grouping, albumartist, sort_artist, sort_title, sort_album, sort_albumartist, sort_composer," \
-    "size, tracklen, cd_nr, cds, track_nr, tracks, bitrate, samplerate, year, time_added, time_modified, time_played, rating, playcount, playcount2, recent_playcount," \
-    "checksum, " \
-    "unk126, unk132, unk144, unk148, unk152, unk179, unk180, unk196, unk204, unk220, unk224, unk228, unk232, unk236, unk240, unk244, unk252" \
-    "    )" \
-    "  VALUES (%d, '%q', %d," \
-    "          %Q, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %Q," \
-    "          %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d," \
-    "          %u," \
-    "          %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u" \
-    "         );"
-
-  char*  err = NULL;
-  char*  query = sqlite3_mprintf(QADD_TMPL, 
-                                track_->id, track_->ipod_path, track_->mediatype,
-                                track_->title, track_->artist, track_->album, track_->genre, track_->filetype, track_->composer, track_->grouping, track_->albumartist, track_->sort_artist, track_->sort_title, track_->sort_album, track_->sort_albumartist, track_->sort_composer, 
-                                track_->size, track_->tracklen, track_->cd_nr, track_->cds, track_->track_nr, track_->tracks, track_->bitrate, track_->samplerate, track_->year, track_->time_added, track_->time_modified, track_->time_played, track_->rating, track_->playcount, track_->playcount2, track_->recent_playcount,
-				gpod_saved_cksum(track_),
-				track_->unk126, track_->unk132, track_->unk144, track_->unk148, track_->unk152, track_->unk179, track_->unk180, track_->unk196, track_->unk204, track_->unk220, track_->unk224, track_->unk228, track_->unk232, track_->unk236, track_->unk240, track_->unk244, track_->unk252
-				);
-
-#undef QADD_TMPL
-
-  sqlite3_stmt*  stmt = NULL;
-
-  int  ret;
-  int  n = 5;
-  while (n--) 
-  {
-      if ( (ret = sqlite3_prepare_v2(hdl_, query, -1, &stmt, NULL)) != SQLITE_OK) {
-          sqlite3_free(query);
-          g_printerr("failed to prepare DB query - %s (%s)\n", sqlite3_errmsg(hdl_), sqlite3_errstr(ret));
-          return false;
-      }
-
-      while (ret = sqlite3_step(stmt) == SQLITE_ROW) {
-          ;   // keep going...
-      }
-      sqlite3_finalize(stmt);
-
-      if (ret != SQLITE_SCHEMA)
-        break;
-    }
-
-    sqlite3_free(err);
-    sqlite3_free(query);
-    if (ret != SQLITE_OK) {
-        g_printerr("failed to insert data - %s (%s)\n", sqlite3_errmsg(hdl_), sqlite3_errstr(ret));
+    int  ret;
+
+    if ( (ret = sqlite3_prepare_v2(hdl_, query_, -1, &db_insert, NULL)) != SQLITE_OK) {
+        g_printerr("failed to prepare DB query - %s (%s)\n", sqlite3_errmsg(hdl_), sqlite3_errstr(ret));
+        return false;
+    }
+
+    const char*  begin[] = { "BEGIN TRANSACTION", NULL };
+    if (!db_exec(hdl_, begin, "start txn")) {
+        sqlite3_finalize(db_insert);
+        db_insert = NULL;
         return false;
     }
     return true;
 }
-#endif
 
-static void
-json_object_add_string(json_object* obj_, const char* tag_, const char* data_)
+bool  db_create(sqlite3 *hdl_)
 {
-    json_object_object_add(obj_, tag_, data_ ? json_object_new_string(data_) : NULL);
+    return db_exec(hdl_, db_init_queries, "create db objects") &&
+           db_prepare(hdl_, QUERY_INSERT);
 }
 
-static void
-json_object_add_int(json_object* obj_, const char* tag_, const int data_)
+/* load the dbid/id/modified/played of the rows in an existing db, tracks are
+ * then only written if new or changed - a db without these (older gpod-ls)
+ * is rebuilt
+ *
+ * rows of tracks no longer on the device are deleted up front: an upsert
+ * that replaces another row holding its reassigned id then only ever drops
+ * the row of a track still to be rewritten
+ */
+bool  db_sync_begin(sqlite3 *hdl_, const Itdb_iTunesDB* itdb_)
 {
-    json_object_object_add(obj_, tag_, json_object_new_int(data_));
+    sqlite3_stmt*  stmt = NULL;
+    if (sqlite3_prepare_v2(hdl_, QUERY_SYNC_SELECT, -1, &stmt, NULL) != SQLITE_OK) {
+        g_printerr("existing DB not suitable for sync, rebuilding - %s\n", sqlite3_errmsg(hdl_));
+        return db_create(hdl_);
+    }
+
+    db_sync.rows = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        struct db_row*  row = g_new(struct db_row, 1);
+        row->dbid = sqlite3_column_int64(stmt, 0);
+        row->id = sqlite3_column_int64(stmt, 1);
+        row->time_modified = sqlite3_column_int64(stmt, 2);
+        row->time_played = sqlite3_column_int64(stmt, 3);
+        row->playcount = sqlite3_column_int64(stmt, 4);
+        row->rating = sqlite3_column_int64(stmt, 5);
+        g_hash_table_replace(db_sync.rows, &row->dbid, row);
+    }
+    sqlite3_finalize(stmt);
+
+    if (!db_prepare(hdl_, QUERY_UPSERT)) {
+        g_hash_table_destroy(db_sync.rows);
+        db_sync.rows = NULL;
+        return false;
+    }
+
+    GHashTable*  present = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (const GList* it = itdb_->tracks; it != NULL; it = it->next) {
+        const gint64  dbid = (gint64)((const Itdb_Track*)it->data)->dbid;
+        const struct db_row*  row = g_hash_table_lookup(db_sync.rows, &dbid);
+        if (row) {
+            g_hash_table_add(present, (gpointer)&row->dbid);
+        }
+    }
+
+    if (sqlite3_prepare_v2(hdl_, QUERY_SYNC_DELETE, -1, &stmt, NULL) == SQLITE_OK)
+    {
+        GHashTableIter  hiter;
+        gpointer  key;
+        g_hash_table_iter_init(&hiter, db_sync.rows);
+        while (g_hash_table_iter_next(&hiter, &key, NULL)) {
+            if (g_hash_table_contains(present, key)) {
+                continue;
+            }
+            sqlite3_bind_int64(stmt, 1, *(const gint64*)key);
+            if (sqlite3_step(stmt) == SQLITE_DONE) {
+                db_sync.deleted += sqlite3_changes(hdl_);
+            }
+            sqlite3_reset(stmt);
+            g_hash_table_iter_remove(&hiter);
+        }
+        sqlite3_finalize(stmt);
+    }
+    g_hash_table_destroy(present);
+    return true;
 }
 
-static void
-json_object_add_uint(json_object* obj_, const char* tag_, const uint64_t data_)
+// commit the rows and build the indexes over them
+bool  db_finalise(sqlite3 *hdl_)
 {
-    json_object_object_add(obj_, tag_, json_object_new_uint64(data_));
+    sqlite3_finalize(db_insert);
+    db_insert = NULL;
+
+    if (db_sync.rows)
+    {
+        g_hash_table_destroy(db_sync.rows);
+        db_sync.rows = NULL;
+
+        const char*  commit[] = { "COMMIT TRANSACTION", NULL };
+        return db_exec(hdl_, commit, "commit txn") &&
+               db_exec(hdl_, db_index_queries, "create db indexes");
+    }
+
+    const char*  commit[] = { "COMMIT TRANSACTION", NULL };
+    return db_exec(hdl_, commit, "commit txn") &&
+           db_exec(hdl_, db_index_queries, "create db indexes") &&
+           db_exec(hdl_, db_final_queries, "restore db settings");
 }
 
-static void
-json_object_add_boolean(json_object* obj_, const char* tag_, const bool data_)
+bool  db_add_track(sqlite3 *hdl_, const Itdb_Track* track_)
 {
-    json_object_object_add(obj_, tag_, json_object_new_boolean(data_));
-}
+    sqlite3_stmt*  stmt = db_insert;
+    int  i = 0;
+
+    bool  update = false;
+    if (db_sync.rows)
+    {
+        const gint64  dbid = (gint64)track_->dbid;
+        const struct db_row*  row = g_hash_table_lookup(db_sync.rows, &dbid);
+        if (row) {
+            const bool  unchanged = row->id == track_->id && row->time_modified == track_->time_modified &&
+                                    row->time_played == track_->time_played && row->playcount == track_->playcount &&
+                                    row->rating == track_->rating;
+            g_hash_table_remove(db_sync.rows, &dbid);
+            if (unchanged) {
+                ++db_sync.unchanged;
+                return true;
+            }
+            update = true;
+        }
+    }
+
+    sqlite3_bind_int64(stmt, ++i, track_->id);
+    sqlite3_bind_int64(stmt, ++i, (sqlite3_int64)track_->dbid);
+    sqlite3_bind_text(stmt, ++i, track_->ipod_path ? track_->ipod_path : "", -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, ++i, track_->mediatype);
+
+    const char*  text[] = {
+        track_->title, track_->artist, track_->album, track_->genre, track_->filetype, track_->composer, track_->grouping, track_->albumartist,
+        track_->sort_artist, track_->sort_title, track_->sort_album, track_->sort_albumartist, track_->sort_composer
+    };
+    for (unsigned t=0; t<sizeof(text)/sizeof(text[0]); ++t) {
+        sqlite3_bind_text(stmt, ++i, text[t], -1, SQLITE_STATIC);  // NULL binds as NULL
+    }
+
+    const sqlite3_int64  num[] = {
+        track_->size, track_->tracklen, track_->cd_nr, track_->cds, track_->track_nr, track_->tracks, track_->bitrate, track_->samplerate,
+        track_->year, track_->time_added, track_->time_modified, track_->time_played, track_->rating, track_->playcount, track_->playcount2, track_->recent_playcount,
+        gpod_saved_cksum(track_),
+        track_->unk126, track_->unk132, track_->unk144, track_->unk148, track_->unk152, track_->unk179, track_->unk180, track_->unk196,
+        track_->unk204, track_->unk220, track_->unk224, track_->unk228, track_->unk232, track_->unk236, track_->unk240, track_->unk244, track_->unk252
+    };
+    for (unsigned n=0; n<sizeof(num)/sizeof(num[0]); ++n) {
+        sqlite3_bind_int64(stmt, ++i, num[n]);
+    }
 
+    const int  ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
 
-typedef struct _TrkHash {
-    uint64_t  high;    // file size/len/artist/title/album
-    uint64_t  med;     // artist/title
-    uint64_t  low;     // file size/len
-} TrkHash;
+    if (ret != SQLITE_DONE) {
+        g_printerr("failed to insert data - %s (%s)\n", sqlite3_errmsg(hdl_), sqlite3_errstr(ret));
+        return false;
+    }
+    if (update)  ++db_sync.updated;
+    else         ++db_sync.inserted;
+    return true;
+}
+#endif
 
-static TrkHash*  hash_trk_init(const Itdb_Track* track_, bool cksum_)
+/* duplicate detection: each level sorts a flat array of fixed width keys,
+ * the strings represented by 64bit hashes, so that candidates are adjacent
+ * and only those with equal keys have their fields compared exactly
+ */
+enum dup_match {
+    DUP_HIGH = 0,  // checksum, or file size/len/artist/title/album
+    DUP_MED,       // artist/title
+    DUP_LOW,       // file size/len/bitrate/samplerate
+    DUP_MAX
+};
+
+static const char*  dup_match_names[DUP_MAX] = { "high", "med", "low" };
+
+struct dup_key {
+    uint64_t  k[3];
+    const Itdb_Track*  track;
+    enum dup_match  match;
+    bool  cksum;  // high matched on checksum only
+};
+
+// fnv-1a, g_str_hash() is only 32bit
+static uint64_t  _dup_strhash(const char* s_)
 {
-   TrkHash*  o = malloc(sizeof(TrkHash)); 
-   memset(o, 0, sizeof(TrkHash));
+    uint64_t  h = 0xcbf29ce484222325ULL;
+    if (s_ == NULL) {
+        return 0;
+    }
+    while (*s_) {
+        h ^= (unsigned char)*s_++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
 
-   o->low = track_->size + track_->tracklen + track_->bitrate + track_->samplerate;
-   o->med = (track_->artist ? g_str_hash(track_->artist) : 0)  + (track_->title ? g_str_hash(track_->title) : 0);
+// 0 if x and y are duplicates
+static int  _dup_cmp_group(const struct dup_key* x, const struct dup_key* y)
+{
+    for (unsigned i=0; i<3; ++i) {
+        if (x->k[i] != y->k[i]) {
+            return x->k[i] < y->k[i] ? -1 : 1;
+        }
+    }
 
-   if (!cksum_) {
-       o->high = o->low + o->med + (track_->album ? g_str_hash(track_->album) : 0);
-   }
-   else {
-       const guint  hash = gpod_saved_cksum(track_);
-       o->high = hash > 0 ? hash : gpod_hash(track_);
-   }
+    // same bucket, confirm the hashed fields
+    int  ret = 0;
+    switch (x->match)
+    {
+        case DUP_HIGH:
+            if (x->cksum) {
+                break;
+            }
+            if ( (ret = g_strcmp0(x->track->album, y->track->album)) ) {
+                break;
+            }
+            // fall through
+        case DUP_MED:
+            if ( (ret = g_strcmp0(x->track->artist, y->track->artist)) == 0) {
+                ret = g_strcmp0(x->track->title, y->track->title);
+            }
+            break;
 
-   return o;
+        case DUP_LOW:
+        default:
+            break;
+    }
+    return ret;
 }
 
-static void  hash_trk_free(gpointer p_)
+static int  _dup_cmp(const void* x_, const void* y_)
 {
-    free(p_);
+    const struct dup_key*  x = (const struct dup_key*)x_;
+    const struct dup_key*  y = (const struct dup_key*)y_;
+
+    const int  ret = _dup_cmp_group(x, y);
+    if (ret) {
+        return ret;
+    }
+
+    // stable order of a group's members
+    return x->track->id < y->track->id ? -1 : x->track->id > y->track->id;
 }
 
-static guint  hask_trk_low(gconstpointer v_)
-{ return ((const TrkHash*)v_)->low; }
+static bool  _dup_key(struct dup_key* key_, const Itdb_Track* track_, enum dup_match match_, guint cksum_, bool use_cksum_)
+{
+    memset(key_, 0, sizeof(struct dup_key));
+    key_->track = track_;
+    key_->match = match_;
 
-static gboolean  hask_trk_low_equals(gconstpointer v0_, gconstpointer v1_)
+    const uint64_t  size = ((uint64_t)track_->size << 32) | (uint32_t)track_->tracklen;
+    const uint64_t  fmt = ((uint64_t)track_->bitrate << 32) | (uint32_t)track_->samplerate;
+
+    switch (match_)
+    {
+        case DUP_HIGH:
+            if (use_cksum_) {
+                // no checksum, unreadable file, is not a match
+                key_->cksum = true;
+                key_->k[0] = cksum_;
+                return cksum_ != 0;
+            }
+            key_->k[0] = size;
+            key_->k[1] = fmt;
+            key_->k[2] = _dup_strhash(track_->artist) ^ (_dup_strhash(track_->title) * 31) ^ (_dup_strhash(track_->album) * 37);
+            break;
+
+        case DUP_MED:
+            if (track_->artist == NULL && track_->title == NULL) {
+                return false;
+            }
+            key_->k[0] = _dup_strhash(track_->artist);
+            key_->k[1] = _dup_strhash(track_->title);
+            break;
+
+        case DUP_LOW:
+        default:
+            key_->k[0] = size;
+            key_->k[1] = fmt;
+    }
+    return true;
+}
+
+struct dup_cksum_args {
+    GPtrArray*  tracks;
+    guint*  cksums;
+};
+
+static void  _dup_cksum_thread(gpointer arg_, gpointer pool_args_)
 {
-    return ((const TrkHash*)v0_)->low == ((const TrkHash*)v1_)->low;
+    struct dup_cksum_args*  args = (struct dup_cksum_args*)pool_args_;
+    const guint  i = GPOINTER_TO_UINT(arg_) - 1;
+
+    args->cksums[i] = gpod_hash(g_ptr_array_index(args->tracks, i));
 }
 
-static guint  hask_trk_med(gconstpointer v_)
-{ return ((const TrkHash*)v_)->med; }
+/* checksums of the tracks, those not stored in the db are generated from
+ * the files on the device over the given number of threads
+ */
+static guint*  _dup_cksums(GPtrArray* tracks_, unsigned threads_)
+{
+    struct dup_cksum_args  args = { tracks_, g_new0(guint, tracks_->len) };
+    GThreadPool*  tp = NULL;
+
+    for (guint i=0; i<tracks_->len; ++i)
+    {
+        const Itdb_Track*  track = g_ptr_array_index(tracks_, i);
+        if ( (args.cksums[i] = gpod_saved_cksum(track)) ) {
+            continue;
+        }
+        if (tp == NULL) {
+            tp = g_thread_pool_new(_dup_cksum_thread, &args, threads_ ? threads_ : 1, TRUE, NULL);
+        }
+        g_thread_pool_push(tp, GUINT_TO_POINTER(i+1), NULL);
+    }
+    if (tp) {
+        g_thread_pool_free(tp, FALSE, TRUE);
+    }
+    return args.cksums;
+}
 
-static gboolean  hask_trk_med_equals(gconstpointer v0_, gconstpointer v1_)
+static void  dup_group_json(struct gpod_json* w_, const struct dup_key* keys_, unsigned count_)
 {
-    return ((const TrkHash*)v0_)->med == ((const TrkHash*)v1_)->med;
+    const Itdb_Track*  first = keys_[0].track;
+
+    gpod_json_object_begin(w_, NULL);
+
+    gpod_json_int(w_, "size", first->size);
+    gpod_json_int(w_, "tracklen", first->tracklen);
+    gpod_json_int(w_, "bitrate", first->bitrate);
+    gpod_json_int(w_, "samplerate", first->samplerate);
+    gpod_json_int(w_, "count", count_-1);
+
+    struct tm  tm;
+    char dt[20];
+    gpod_json_array_begin(w_, "items");
+    for (unsigned n=0; n<count_; ++n) {
+        const Itdb_Track*  track = keys_[n].track;
+        gpod_json_object_begin(w_, NULL);
+
+        gpod_json_int(w_, "id", track->id);
+        gpod_json_string(w_, "ipod_path", track->ipod_path);
+        gpod_json_int(w_, "mediatype", track->mediatype);
+
+        gpod_json_string(w_, "title", track->title);
+        gpod_json_string(w_, "artist", track->artist);
+        gpod_json_string(w_, "album", track->album);
+        gpod_json_string(w_, "genre", track->genre);
+
+        gmtime_r(&track->time_added, &tm);
+        strftime(dt, 20, "%Y-%m-%dT%H:%M:%S", &tm);
+        gpod_json_string(w_, "date_added", dt);
+
+        gpod_json_uint(w_, "size", track->size);
+        gpod_json_uint(w_, "checksum", gpod_saved_cksum(track));
+
+        gpod_json_object_end(w_);
+    }
+    gpod_json_array_end(w_);
+
+    gpod_json_object_end(w_);
 }
 
-static guint  hask_trk_high(gconstpointer v_)
-{ return ((const TrkHash*)v_)->high; }
+// the ipod_analysis duplicate groups of the master playlist's tracks
+static void  dup_analysis_json(struct gpod_json* w_, GPtrArray* tracks_, bool cksum_, unsigned threads_)
+{
+    guint*  cksums = cksum_ ? _dup_cksums(tracks_, threads_) : NULL;
+    struct dup_key*  keys = g_new(struct dup_key, tracks_->len ? tracks_->len : 1);
+
+    gpod_json_array_begin(w_, "duplicates");
+    for (enum dup_match m=0; m<DUP_MAX; ++m)
+    {
+        unsigned  n = 0;
+        for (guint i=0; i<tracks_->len; ++i) {
+            if (_dup_key(&keys[n], g_ptr_array_index(tracks_, i), m, cksums ? cksums[i] : 0, cksum_)) {
+                ++n;
+            }
+        }
+        qsort(keys, n, sizeof(struct dup_key), _dup_cmp);
+
+        gpod_json_object_begin(w_, NULL);
+        gpod_json_string(w_, "match", dup_match_names[m]);
+        gpod_json_array_begin(w_, "tracks");
+
+        unsigned  i = 0;
+        while (i < n)
+        {
+            unsigned  j = i+1;
+            while (j < n && _dup_cmp_group(&keys[i], &keys[j]) == 0) {
+                ++j;
+            }
+            if (j-i > 1) {
+                dup_group_json(w_, keys+i, j-i);
+            }
+            i = j;
+        }
+
+        gpod_json_array_end(w_);
+        gpod_json_object_end(w_);
+    }
+    gpod_json_array_end(w_);
+
+    g_free(keys);
+    g_free(cksums);
+}
 
-static gboolean  hask_trk_high_equals(gconstpointer v0_, gconstpointer v1_)
+
+/* track fields, as named in the json output, for --fields and --where
+ */
+enum ls_type {
+    LS_STR = 0,
+    LS_INT,
+    LS_UINT
+};
+
+struct ls_field {
+    const char*  name;
+    enum ls_type  type;
+    size_t  offset;
+    size_t  size;
+};
+
+#define LS_FIELD_STR(f)       { #f, LS_STR, offsetof(Itdb_Track, f), sizeof(gchar*) }
+#define LS_FIELD_NUM(n, f)    { n, (__typeof__(((Itdb_Track*)0)->f))-1 < 0 ? LS_INT : LS_UINT, \
+                                offsetof(Itdb_Track, f), sizeof(((Itdb_Track*)0)->f) }
+
+// in verbose output order
+static const struct ls_field  ls_fields[] = {
+    LS_FIELD_NUM("id", id),
+    LS_FIELD_STR(ipod_path),
+    LS_FIELD_NUM("mediatype", mediatype),
+    LS_FIELD_STR(title),
+    LS_FIELD_STR(artist),
+    LS_FIELD_STR(album),
+    LS_FIELD_STR(genre),
+    LS_FIELD_STR(filetype),
+    LS_FIELD_STR(composer),
+    LS_FIELD_STR(grouping),
+    LS_FIELD_STR(albumartist),
+    LS_FIELD_STR(sort_artist),
+    LS_FIELD_STR(sort_title),
+    LS_FIELD_STR(sort_album),
+    LS_FIELD_STR(sort_albumartist),
+    LS_FIELD_STR(sort_composer),
+    LS_FIELD_NUM("size", size),
+    LS_FIELD_NUM("tracklen", tracklen),
+    LS_FIELD_NUM("cd_nr", cd_nr),
+    LS_FIELD_NUM("cds", cds),
+    LS_FIELD_NUM("track_nr", track_nr),
+    LS_FIELD_NUM("tracks", tracks),
+    LS_FIELD_NUM("bitrate", bitrate),
+    LS_FIELD_NUM("samplerate", samplerate),
+    LS_FIELD_NUM("year", year),
+    LS_FIELD_NUM("time_added", time_added),
+    LS_FIELD_NUM("time_modified", time_modified),
+    LS_FIELD_NUM("time_played", time_played),
+    LS_FIELD_NUM("rating", rating),
+    LS_FIELD_NUM("playcount", playcount),
+    LS_FIELD_NUM("playcount2", playcount2),
+    LS_FIELD_NUM("recent_playcount", recent_playcount),
+    LS_FIELD_NUM("checksum", unk196),  // gpod_saved_cksum()
+
+    { NULL, LS_STR, 0, 0 }
+};
+
+// non master playlists
+static const char*  ls_terse_fields[] = {
+    "id", "ipod_path", "mediatype", "title", "artist", "album", "genre", "albumartist", "rating", "checksum", NULL
+};
+
+enum ls_op {
+    LS_OP_EQ = 0,
+    LS_OP_NE,
+    LS_OP_LE,
+    LS_OP_GE,
+    LS_OP_LT,
+    LS_OP_GT,
+    LS_OP_SUBSTR,
+    LS_OP_MAX
+};
+
+// 2 char ops ahead of their 1 char prefixes
+static const char*  ls_op_names[LS_OP_MAX] = { "=", "!=", "<=", ">=", "<", ">", "~" };
+
+struct ls_cond {
+    const struct ls_field*  field;
+    enum ls_op  op;
+    char*  str;
+    gint64  num;
+};
+
+static struct {
+    const struct ls_field**  fields;    // NULL terminated, NULL for the default sets
+    const struct ls_field**  terse;
+    GPtrArray*  where;                  // of GArray of ls_cond: OR of ANDs, NULL matches all
+} ls_query = { NULL, NULL, NULL };
+
+
+static const struct ls_field*  _field_find(const char* name_, size_t len_)
 {
-    return ((const TrkHash*)v0_)->high == ((const TrkHash*)v1_)->high;
+    for (const struct ls_field* f = ls_fields; f->name; ++f) {
+        if (strlen(f->name) == len_ && strncmp(f->name, name_, len_) == 0) {
+            return f;
+        }
+    }
+    return NULL;
 }
 
-typedef struct _TrkHashes {
-    GHashTable*  high;
-    GHashTable*  med;
-    GHashTable*  low;
-} TrkHashTbl;
+static const char*  _field_str(const struct ls_field* f_, const Itdb_Track* track_)
+{
+    return *(const gchar* const*)((const char*)track_ + f_->offset);
+}
 
-static void  hash_tbl_init(TrkHashTbl* o_)
+static gint64  _field_int(const struct ls_field* f_, const Itdb_Track* track_)
 {
-    o_->high = g_hash_table_new(hask_trk_high, hask_trk_high_equals);
-    o_->med = g_hash_table_new(hask_trk_med, hask_trk_med_equals);
-    o_->low = g_hash_table_new(hask_trk_low, hask_trk_low_equals);
+    const char*  p = (const char*)track_ + f_->offset;
+    const bool  sgn = f_->type == LS_INT;
+
+    switch (f_->size)
+    {
+        case 1:  return sgn ? *(const gint8*)p  : *(const guint8*)p;
+        case 2:  return sgn ? *(const gint16*)p : *(const guint16*)p;
+        case 4:  return sgn ? *(const gint32*)p : *(const guint32*)p;
+        case 8:
+        default: return *(const gint64*)p;
+    }
 }
 
-static void  hash_tbl_val_destroy(gpointer k_, gpointer v_, gpointer d_)
+static void  _field_json(struct gpod_json* w_, const struct ls_field* f_, const Itdb_Track* track_)
 {
-    g_slist_free(v_);
+    switch (f_->type)
+    {
+        case LS_STR:   gpod_json_string(w_, f_->name, _field_str(f_, track_));  break;
+        case LS_INT:   gpod_json_int(w_, f_->name, _field_int(f_, track_));  break;
+        case LS_UINT:  gpod_json_uint(w_, f_->name, (guint64)_field_int(f_, track_));  break;
+    }
 }
 
-static void  hash_tbl_free(TrkHashTbl* o_)
+static const struct ls_field**  _fields_resolve(const char** names_)
 {
-    g_hash_table_foreach(o_->high, hash_tbl_val_destroy, NULL);
-    g_hash_table_destroy(o_->high);
-    g_hash_table_foreach(o_->med, hash_tbl_val_destroy, NULL);
-    g_hash_table_destroy(o_->med);
-    g_hash_table_foreach(o_->low, hash_tbl_val_destroy, NULL);
-    g_hash_table_destroy(o_->low);
-    memset(o_, 0, sizeof(TrkHashTbl));
+    unsigned  n = 0;
+    while (names_[n]) {
+        ++n;
+    }
+    const struct ls_field**  fields = g_new0(const struct ls_field*, n+1);
+    for (unsigned i=0; i<n; ++i) {
+        fields[i] = _field_find(names_[i], strlen(names_[i]));
+        g_assert(fields[i]);
+    }
+    return fields;
 }
 
-static void  hash_tbl_json(gpointer k_, gpointer v_, gpointer d_)
+// comma separated list of field names
+static bool  ls_fields_parse(const char* spec_)
 {
-    GSList*  l = (GSList*)v_;
-    const int  count = g_slist_length(l);
-    if (count < 2) {
-        return;
+    char**  names = g_strsplit(spec_, ",", -1);
+    const unsigned  n = g_strv_length(names);
+
+    const struct ls_field**  fields = g_new0(const struct ls_field*, n+1);
+    unsigned  j = 0;
+    bool  ret = true;
+    for (unsigned i=0; i<n; ++i)
+    {
+        char*  name = g_strstrip(names[i]);
+        if (*name == '\0') {
+            continue;
+        }
+        if ( (fields[j] = _field_find(name, strlen(name))) == NULL) {
+            g_printerr("unknown field '%s'\n", name);
+            ret = false;
+            break;
+        }
+        ++j;
     }
+    g_strfreev(names);
 
-    json_object*  jarray = (json_object*)d_;
+    if (!ret || j == 0) {
+        if (ret) {
+            g_printerr("no fields in '%s'\n", spec_);
+        }
+        g_free(fields);
+        return false;
+    }
+    g_free(ls_query.fields);
+    ls_query.fields = fields;
+    return true;
+}
 
-    json_object*  jobj = json_object_new_object();
-    json_object*  jtracks = json_object_new_array();
+static bool  _cond_parse(struct ls_cond* cond_, char* term_)
+{
+    memset(cond_, 0, sizeof(struct ls_cond));
+
+    // leftmost operator, the longest at that position
+    char*  at = NULL;
+    enum ls_op  op = LS_OP_MAX;
+    for (enum ls_op i=0; i<LS_OP_MAX; ++i) {
+        char*  p = strstr(term_, ls_op_names[i]);
+        if (p && (at == NULL || p < at)) {
+            at = p;
+            op = i;
+        }
+    }
+    if (at == NULL) {
+        g_printerr("no operator in '%s'\n", g_strstrip(term_));
+        return false;
+    }
 
-    json_object_add_int(jobj, "size", ((Itdb_Track*)l->data)->size);
-    json_object_add_int(jobj, "tracklen", ((Itdb_Track*)l->data)->tracklen);
-    json_object_add_int(jobj, "bitrate", ((Itdb_Track*)l->data)->bitrate);
-    json_object_add_int(jobj, "samplerate", ((Itdb_Track*)l->data)->samplerate);
+    char*  name = term_;
+    char*  value = at + strlen(ls_op_names[op]);
+    *at = '\0';
+    if (op == LS_OP_EQ && *value == '=') {
+        ++value;  // '==' as '='
+    }
+    name = g_strstrip(name);
+    value = g_strstrip(value);
 
-    struct tm  tm;
-    char dt[20];
-    for (GSList* i=l; i!= NULL; i=i->next) {
-        json_object*  jtrack = json_object_new_object();
+    if ( (cond_->field = _field_find(name, strlen(name))) == NULL) {
+        g_printerr("unknown field '%s'\n", name);
+        return false;
+    }
+    cond_->op = op;
 
-        json_object_add_int(jtrack, "id", ((Itdb_Track*)i->data)->id);
-        json_object_add_string(jtrack, "ipod_path", ((Itdb_Track*)i->data)->ipod_path);
-        json_object_add_int(jtrack, "mediatype", ((Itdb_Track*)i->data)->mediatype);
+    // optionally quoted
+    const size_t  len = strlen(value);
+    if (len >= 2 && (value[0] == '\'' || value[0] == '"') && value[len-1] == value[0]) {
+        value[len-1] = '\0';
+        ++value;
+    }
 
-        json_object_add_string(jtrack, "title", ((Itdb_Track*)i->data)->title);
-        json_object_add_string(jtrack, "artist", ((Itdb_Track*)i->data)->artist);
-        json_object_add_string(jtrack, "album", ((Itdb_Track*)i->data)->album);
-        json_object_add_string(jtrack, "genre", ((Itdb_Track*)i->data)->genre);
+    if (cond_->field->type == LS_STR) {
+        cond_->str = op == LS_OP_SUBSTR ? g_utf8_casefold(value, -1) : g_strdup(value);
+    }
+    else {
+        char*  end = NULL;
+        cond_->num = g_ascii_strtoll(value, &end, 10);
+        if (op == LS_OP_SUBSTR || end == value || *end) {
+            g_printerr("invalid numeric comparison '%s %s %s'\n", name, ls_op_names[op], value);
+            return false;
+        }
+    }
+    return true;
+}
 
-        gmtime_r(&(((Itdb_Track*)i->data)->time_added), &tm);
-        strftime(dt, 20, "%Y-%m-%dT%H:%M:%S", &tm);
-        json_object_add_string(jtrack, "date_added", dt);
+static void  _conds_free(gpointer conds_)
+{
+    GArray*  conds = (GArray*)conds_;
+    for (unsigned i=0; i<conds->len; ++i) {
+        g_free(g_array_index(conds, struct ls_cond, i).str);
+    }
+    g_array_free(conds, TRUE);
+}
 
-        json_object_add_uint(jtrack, "size", ((Itdb_Track*)i->data)->size);
-        json_object_add_uint(jtrack, "checksum", gpod_saved_cksum((Itdb_Track*)i->data));
+/* the next term, up to an '&&' or '||' outside of a quoted value which is
+ * returned in sep_ ('\0' at the end) - a quote only opens at the start of
+ * a value so apostrophes in unquoted values are taken as is
+ */
+static char*  _term_next(const char** expr_, char* sep_)
+{
+    const char*  p = *expr_;
+    char  prev = '\0';  // last non space outside of quotes
+    char  quote = '\0';
 
-        json_object_array_add(jtracks, jtrack);
+    for (; *p; ++p)
+    {
+        if (quote) {
+            if (*p == quote) {
+                quote = '\0';
+            }
+            continue;
+        }
+        if ((*p == '\'' || *p == '"') && prev && strchr("=<>~", prev)) {
+            quote = *p;
+            continue;
+        }
+        if ((*p == '&' || *p == '|') && p[1] == *p) {
+            break;
+        }
+        if (!g_ascii_isspace(*p)) {
+            prev = *p;
+        }
     }
-    json_object_add_int(jobj, "count", count-1);
-    json_object_object_add(jobj, "items", jtracks);
 
-    json_object_array_add(jarray, jobj);
+    char*  term = g_strndup(*expr_, p - *expr_);
+    *sep_ = *p;
+    *expr_ = *p ? p+2 : p;
+    return term;
 }
 
-static json_object*
-_track (Itdb_Track *track, bool verbose_, sqlite3* hdl_, TrkHashTbl* htbl_, bool cksum_)
+/* <field> <op> <value> terms joined by '&&' and '||', '&&' binding tighter -
+ * no parentheses
+ */
+static bool  ls_where_parse(const char* expr_)
 {
-    static unsigned  inscnt = 0;
-    json_object*  jobj = json_object_new_object();
+    GPtrArray*  where = g_ptr_array_new_with_free_func(_conds_free);
+    GArray*  conds = NULL;
+    bool  ret = true;
 
-    itdb_filename_ipod2fs(track->ipod_path);
-    if (verbose_)
+    const char*  p = expr_;
+    char  sep = '|';
+    while (ret && sep)
     {
-        json_object_add_int(jobj, "id", track->id);
-        json_object_add_string(jobj, "ipod_path", track->ipod_path);
-        json_object_add_int(jobj, "mediatype", track->mediatype);
-        json_object_add_string(jobj, "title", track->title);
-        json_object_add_string(jobj, "artist", track->artist);
-        json_object_add_string(jobj, "album", track->album);
-        json_object_add_string(jobj, "genre", track->genre);
-        json_object_add_string(jobj, "filetype", track->filetype);
-        json_object_add_string(jobj, "composer", track->composer);
-        json_object_add_string(jobj, "grouping", track->grouping);
-        json_object_add_string(jobj, "albumartist", track->albumartist);
-        json_object_add_string(jobj, "sort_artist", track->sort_artist);
-        json_object_add_string(jobj, "sort_title", track->sort_title);
-        json_object_add_string(jobj, "sort_album", track->sort_album);
-        json_object_add_string(jobj, "sort_albumartist", track->sort_albumartist);
-        json_object_add_string(jobj, "sort_composer", track->sort_composer);
-        json_object_add_int(jobj, "size", track->size);
-        json_object_add_int(jobj, "tracklen", track->tracklen);
-        json_object_add_int(jobj, "cd_nr", track->cd_nr);
-        json_object_add_int(jobj, "cds", track->cds);
-        json_object_add_int(jobj, "track_nr", track->track_nr);
-        json_object_add_int(jobj, "tracks", track->tracks);
-        json_object_add_int(jobj, "bitrate", track->bitrate);
-        json_object_add_int(jobj, "samplerate", track->samplerate);
-        json_object_add_int(jobj, "year", track->year);
-        json_object_add_int(jobj, "time_added", track->time_added);
-        json_object_add_int(jobj, "time_modified", track->time_modified);
-        json_object_add_int(jobj, "time_played", track->time_played);
-        json_object_add_int(jobj, "rating", track->rating);
-        json_object_add_int(jobj, "playcount", track->playcount);
-        json_object_add_int(jobj, "playcount2", track->playcount2);
-        json_object_add_int(jobj, "recent_playcount", track->recent_playcount);
-        json_object_add_uint(jobj, "checksum", gpod_saved_cksum(track));
+        if (sep == '|') {
+            conds = g_array_new(FALSE, FALSE, sizeof(struct ls_cond));
+            g_ptr_array_add(where, conds);
+        }
+
+        char*  term = _term_next(&p, &sep);
+        struct ls_cond  cond;
+        if ( (ret = _cond_parse(&cond, term)) ) {
+            g_array_append_val(conds, cond);
+        }
+        else {
+            g_free(cond.str);
+        }
+        g_free(term);
+    }
+
+    if (!ret) {
+        g_ptr_array_free(where, TRUE);
+        return false;
+    }
+    if (ls_query.where) {
+        g_ptr_array_free(ls_query.where, TRUE);
+    }
+    ls_query.where = where;
+    return true;
+}
+
+static bool  _cond_match(const struct ls_cond* cond_, const Itdb_Track* track_)
+{
+    int  cmp;
+    if (cond_->field->type == LS_STR)
+    {
+        const char*  s = _field_str(cond_->field, track_);
+        if (cond_->op == LS_OP_SUBSTR) {
+            if (s == NULL) {
+                return false;
+            }
+            char*  folded = g_utf8_casefold(s, -1);
+            const bool  found = strstr(folded, cond_->str) != NULL;
+            g_free(folded);
+            return found;
+        }
+        cmp = strcmp(s ? s : "", cond_->str);
     }
     else
     {
-        json_object_add_int(jobj, "id", track->id);
-        json_object_add_string(jobj, "ipod_path", track->ipod_path);
-        json_object_add_int(jobj, "mediatype", track->mediatype);
-        json_object_add_string(jobj, "title", track->title);
-        json_object_add_string(jobj, "artist", track->artist);
-        json_object_add_string(jobj, "album", track->album);
-        json_object_add_string(jobj, "genre", track->genre);
-        json_object_add_string(jobj, "albumartist", track->albumartist);
-        json_object_add_int(jobj, "rating", track->rating);
-        json_object_add_uint(jobj, "checksum", gpod_saved_cksum(track));
+        const gint64  v = _field_int(cond_->field, track_);
+        cmp = v < cond_->num ? -1 : v > cond_->num;
     }
 
-#ifdef HAVE_SQLITE3
-    if (hdl_)
+    switch (cond_->op)
     {
-        char*  err = NULL;
-        if (inscnt == 0) {
-            if (sqlite3_exec(hdl_, "BEGIN TRANSACTION", NULL, NULL, &err) != SQLITE_OK) {
-                g_printerr ("failed to start txn- %s\n", err);
-                sqlite3_free(err);
-            }
+        case LS_OP_EQ:  return cmp == 0;
+        case LS_OP_NE:  return cmp != 0;
+        case LS_OP_LE:  return cmp <= 0;
+        case LS_OP_GE:  return cmp >= 0;
+        case LS_OP_LT:  return cmp < 0;
+        case LS_OP_GT:  return cmp > 0;
+        default:        return false;
+    }
+}
+
+static bool  ls_where_match(const Itdb_Track* track_)
+{
+    if (ls_query.where == NULL) {
+        return true;
+    }
+
+    for (unsigned i=0; i<ls_query.where->len; ++i)
+    {
+        const GArray*  conds = g_ptr_array_index(ls_query.where, i);
+        bool  match = true;
+        for (unsigned j=0; match && j<conds->len; ++j) {
+            match = _cond_match(&g_array_index(conds, struct ls_cond, j), track_);
         }
+        if (match) {
+            return true;
+        }
+    }
+    return false;
+}
 
-        db_add_track(hdl_, track);
+static void  ls_query_init()
+{
+    ls_query.terse = _fields_resolve(ls_terse_fields);
+}
 
-        if (++inscnt == 500) {
-            if (sqlite3_exec(hdl_, "COMMIT TRANSACTION", NULL, NULL, &err) != SQLITE_OK) {
-                g_printerr ("failed to commit txn - %s\n", err);
-                sqlite3_free(err);
+static void  ls_query_free()
+{
+    g_free(ls_query.fields);
+    g_free(ls_query.terse);
+    if (ls_query.where) {
+        g_ptr_array_free(ls_query.where, TRUE);
+    }
+    memset(&ls_query, 0, sizeof(ls_query));
+}
+
+/* -A arrow export, the columns of the gpod-db.h tracks table
+ */
+struct ls_column {
+    struct ls_field  field;
+    bool  dict;
+};
+
+#define LS_COLUMN_STR(f)        { LS_FIELD_STR(f), false }
+#define LS_COLUMN_DICT(f)       { LS_FIELD_STR(f), true }
+#define LS_COLUMN_NUM(f)        { LS_FIELD_NUM(#f, f), false }
+
+static const struct ls_column  ls_columns[] = {
+    LS_COLUMN_NUM(id),
+    LS_COLUMN_NUM(dbid),
+    LS_COLUMN_STR(ipod_path),
+    LS_COLUMN_NUM(mediatype),
+    LS_COLUMN_STR(title),
+    LS_COLUMN_DICT(album),
+    LS_COLUMN_DICT(artist),
+    LS_COLUMN_DICT(genre),
+    LS_COLUMN_STR(filetype),
+    LS_COLUMN_STR(comment),
+    LS_COLUMN_STR(category),
+    LS_COLUMN_STR(composer),
+    LS_COLUMN_STR(grouping),
+    LS_COLUMN_STR(description),
+    LS_COLUMN_STR(podcasturl),
+    LS_COLUMN_STR(podcastrss),
+    LS_COLUMN_STR(subtitle),
+    LS_COLUMN_STR(tvshow),
+    LS_COLUMN_STR(tvepisode),
+    LS_COLUMN_STR(tvnetwork),
+    LS_COLUMN_STR(albumartist),
+    LS_COLUMN_STR(keywords),
+    LS_COLUMN_STR(sort_artist),
+    LS_COLUMN_STR(sort_title),
+    LS_COLUMN_STR(sort_album),
+    LS_COLUMN_STR(sort_albumartist),
+    LS_COLUMN_STR(sort_composer),
+    LS_COLUMN_STR(sort_tvshow),
+    LS_COLUMN_NUM(size),
+    LS_COLUMN_NUM(tracklen),
+    LS_COLUMN_NUM(cd_nr),
+    LS_COLUMN_NUM(cds),
+    LS_COLUMN_NUM(track_nr),
+    LS_COLUMN_NUM(tracks),
+    LS_COLUMN_NUM(bitrate),
+    LS_COLUMN_NUM(samplerate),
+    LS_COLUMN_NUM(samplerate_low),
+    LS_COLUMN_NUM(year),
+    LS_COLUMN_NUM(volume),
+    LS_COLUMN_NUM(soundcheck),
+    LS_COLUMN_NUM(time_added),
+    LS_COLUMN_NUM(time_modified),
+    LS_COLUMN_NUM(time_played),
+    LS_COLUMN_NUM(rating),
+    LS_COLUMN_NUM(playcount),
+    LS_COLUMN_NUM(playcount2),
+    LS_COLUMN_NUM(recent_playcount),
+    LS_COLUMN_NUM(BPM),
+    LS_COLUMN_NUM(app_rating),
+    LS_COLUMN_NUM(compilation),
+    LS_COLUMN_NUM(starttime),
+    LS_COLUMN_NUM(stoptime),
+    LS_COLUMN_NUM(checked),
+    LS_COLUMN_NUM(artwork_count),
+    LS_COLUMN_NUM(artwork_size),
+    LS_COLUMN_NUM(time_released),
+    LS_COLUMN_NUM(explicit_flag),
+    LS_COLUMN_NUM(skipcount),
+    LS_COLUMN_NUM(recent_skipcount),
+    LS_COLUMN_NUM(last_skipped),
+    LS_COLUMN_NUM(has_artwork),
+    LS_COLUMN_NUM(samplecount),
+    LS_COLUMN_NUM(season_nr),
+    LS_COLUMN_NUM(episode_nr),
+    { LS_FIELD_NUM("checksum", unk196), false },  // gpod_saved_cksum()
+    LS_COLUMN_NUM(unk126),
+    LS_COLUMN_NUM(unk132),
+    LS_COLUMN_NUM(unk144),
+    LS_COLUMN_NUM(unk148),
+    LS_COLUMN_NUM(unk152),
+    LS_COLUMN_NUM(unk179),
+    LS_COLUMN_NUM(unk180),
+    LS_COLUMN_NUM(unk196),
+    LS_COLUMN_NUM(unk204),
+    LS_COLUMN_NUM(unk220),
+    LS_COLUMN_NUM(unk224),
+    LS_COLUMN_NUM(unk228),
+    LS_COLUMN_NUM(unk232),
+    LS_COLUMN_NUM(unk236),
+    LS_COLUMN_NUM(unk240),
+    LS_COLUMN_NUM(unk244),
+    LS_COLUMN_NUM(unk252),
+
+    { { NULL, LS_STR, 0, 0 }, false }
+};
+
+// int64 and utf8 columns as the sqlite db, ipod_path is the only NOT NULL string
+static struct gpod_arrow*  arrow_create()
+{
+    struct gpod_arrow_column  cols[sizeof(ls_columns)/sizeof(ls_columns[0])];
+    unsigned  n = 0;
+    for (const struct ls_column* c = ls_columns; c->field.name; ++c, ++n) {
+        cols[n].name = c->field.name;
+        cols[n].type = c->field.type != LS_STR ? GPOD_ARROW_INT64 : c->dict ? GPOD_ARROW_UTF8_DICT : GPOD_ARROW_UTF8;
+        cols[n].nullable = c->field.type == LS_STR && strcmp(c->field.name, "ipod_path") != 0;
+    }
+    return gpod_arrow_new(cols, n);
+}
+
+static void  arrow_add_track(struct gpod_arrow* arrow_, const Itdb_Track* track_)
+{
+    unsigned  i = 0;
+    for (const struct ls_column* c = ls_columns; c->field.name; ++c, ++i) {
+        if (c->field.type == LS_STR) {
+            gpod_arrow_string(arrow_, i, _field_str(&c->field, track_));
+        }
+        else {
+            gpod_arrow_int64(arrow_, i, _field_int(&c->field, track_));
+        }
+    }
+    gpod_arrow_row_end(arrow_);
+}
+
+static bool  arrow_write(struct gpod_arrow* arrow_, const char* path_)
+{
+    FILE*  f = fopen(path_, "wb");
+    if (f == NULL) {
+        g_printerr("failed to open '%s' - %s\n", path_, strerror(errno));
+        return false;
+    }
+    const bool  ret = gpod_arrow_write(arrow_, f) == 0;
+    if (fclose(f) != 0 || !ret) {
+        g_printerr("failed to write '%s' - %s\n", path_, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+static void
+_track (struct gpod_json* w_, Itdb_Track *track, bool verbose_, sqlite3* hdl_, struct gpod_arrow* arrow_, GPtrArray* dups_)
+{
+    itdb_filename_ipod2fs(track->ipod_path);
+
+    const bool  match = ls_where_match(track);
+    if (match)
+    {
+        gpod_json_object_begin(w_, NULL);
+        if (ls_query.fields) {
+            for (const struct ls_field** f = ls_query.fields; *f; ++f) {
+                _field_json(w_, *f, track);
             }
-            inscnt = 0;
         }
+        else if (verbose_) {
+            for (const struct ls_field* f = ls_fields; f->name; ++f) {
+                _field_json(w_, f, track);
+            }
+        }
+        else {
+            for (const struct ls_field** f = ls_query.terse; *f; ++f) {
+                _field_json(w_, *f, track);
+            }
+        }
+        gpod_json_object_end(w_);
+    }
+
+#ifdef HAVE_SQLITE3
+    // the db and arrow export always represent the whole iTunesDB
+    if (hdl_) {
+        db_add_track(hdl_, track);
     }
 #endif
+    if (arrow_) {
+        arrow_add_track(arrow_, track);
+    }
 
-    if (htbl_)
-    {
-        /* generate the hash info for this track and store it with the track
-         *
-         * store corresponding items with the hash tables
-         */
-        track->userdata = hash_trk_init(track, cksum_);
-        track->userdata_destroy = hash_trk_free;
-
-        g_hash_table_insert(htbl_->high,
-                            track->userdata,
-                            g_slist_append(g_hash_table_lookup(htbl_->high, track->userdata), track));
-        g_hash_table_insert(htbl_->med,
-                            track->userdata,
-                            g_slist_append(g_hash_table_lookup(htbl_->med, track->userdata), track));
-        g_hash_table_insert(htbl_->low,
-                            track->userdata,
-                            g_slist_append(g_hash_table_lookup(htbl_->low, track->userdata), track));
-    }
-     
-    return jobj;
-}
-
-static json_object*
-_playlist (Itdb_Playlist *playlist, sqlite3* hdl_, TrkHashTbl* htbl_, bool cksum_)
+    if (dups_ && match) {
+        g_ptr_array_add(dups_, track);
+    }
+}
+
+static void
+_playlist (struct gpod_json* w_, Itdb_Playlist *playlist, sqlite3* hdl_, struct gpod_arrow* arrow_, GPtrArray* dups_)
 {
     GList *it;
     const char*  type;
@@ -396,30 +1095,34 @@ _playlist (Itdb_Playlist *playlist, sqlite3* hdl_, TrkHashTbl* htbl_, bool cksum
     else if (itdb_playlist_is_podcasts (playlist)) type = "podcasts";
     else type = "playlist";
 
-    json_object*  jobj = json_object_new_object();
+    gpod_json_object_begin(w_, NULL);
 
-    json_object_add_string(jobj, "name", playlist->name);
-    json_object_add_string(jobj, "type", type);
-    json_object_add_int(jobj, "count", g_list_length (playlist->members));
-    json_object_add_boolean(jobj, "smartpl", playlist->is_spl);
-    json_object_add_int(jobj, "timestamp", playlist->timestamp);
+    gpod_json_string(w_, "name", playlist->name);
+    gpod_json_string(w_, "type", type);
+    gpod_json_int(w_, "count", g_list_length (playlist->members));
+    gpod_json_boolean(w_, "smartpl", playlist->is_spl);
+    gpod_json_int(w_, "timestamp", playlist->timestamp);
 
-    json_object*  jtracks = json_object_new_array();
+    gpod_json_array_begin(w_, "tracks");
     for (it = playlist->members; it != NULL; it = it->next) {
 	Itdb_Track *track;
 	
 	track = (Itdb_Track *)it->data;
-	json_object_array_add(jtracks, _track(track, master, master ? hdl_ : NULL, master ? htbl_ : NULL, cksum_));
+	_track(w_, track, master, master ? hdl_ : NULL, master ? arrow_ : NULL, master ? dups_ : NULL);
     }
-    json_object_object_add(jobj, "tracks", jtracks);
+    gpod_json_array_end(w_);
 
-    return jobj;
+    gpod_json_object_end(w_);
 }
 
 
 void  _usage(char* argv0_)
 {
     char *basename = g_path_get_basename (argv0_);
+    GString*  names = g_string_new(NULL);
+    for (const struct ls_field* f = ls_fields; f->name; ++f) {
+        g_string_append_printf(names, "%s%s", f == ls_fields ? "" : ",", f->name);
+    }
     g_print ("%s\n", PACKAGE_STRING);
     g_print ("usage: %s  OPTIONS\n"
              "\n"
@@ -433,15 +1136,32 @@ void  _usage(char* argv0_)
 #ifdef HAVE_SQLITE3
              "    -Q  --db-file     <sqlite3 db>   generate sqlite3 with a 'tracks' db, representing\n"
              "                                     all tracks in iTunesDB\n"
+             "    -U  --db-sync                    update an existing -Q db with only the tracks\n"
+             "                                     added/changed/removed since it was written\n"
 #else
              "    -Q   --db-file    <sqlite3 db>   IGNORED, disabled at build time\n"
 #endif
+             "    -A  --arrow-file  <file>         write the 'tracks' db columns as an Apache Arrow IPC\n"
+             "                                     stream, artist/album/genre dictionary encoded\n"
              "    -c   --enable-checksum           generate checksum of each file in iTunesDB for \n"
              "        --disable-checksum           analysis - this can be slow if checksums not stored\n"
+             "    -T   --checksum-threads  <n>     threads generating the checksums not stored - default: 4\n"
+             "    -j   --ndjson                    one json object per line for each track, without\n"
+             "                                     playlists/analysis\n"
+             "    -f   --fields  <f1,f2,..>        only output these fields of each track\n"
+             "    -w   --where   <expr>            only output (and analyse) the tracks matching expr:\n"
+             "                                     <field> <op> <value> terms, op one of\n"
+             "                                       = (or ==) != < <= > >=  or ~ (case insensitive substring)\n"
+             "                                     joined by && and ||, && binding tighter\n"
+             "                                     -Q db is always written with all tracks\n"
              "\n"
+             "    fields: %s\n"
              "\n"
              "    Use 'jq' for basic data mining and sqlite3 for more involved work\n"
              "\n"
+             "    # ids, paths and titles of an artist's tracks since 2000\n"
+             "      %s -j -f id,ipod_path,title -w 'artist=Foo && year>=2000'\n"
+             "\n"
              "    # create a subject json object from data naming artist name \n"
              "      jq   '.ipod_data.playlists.items[] | select(.type == \"master\") |\\\n"
              "        .tracks[] | select(.artist==\"Foo\") | {id, ipod_path, title}'\\\n"
@@ -452,8 +1172,9 @@ void  _usage(char* argv0_)
              "      jq -r '.ipod_data.playlists.items[] | select(.type == \"master\") |\\\n"
              "        .tracks[] | select(.artist==\"Foo\") | .ipod_path, .id'\\\n"
              "      foo.json\n"
-             , basename);
+             , basename, names->str, basename);
     g_free (basename);
+    g_string_free(names, TRUE);
     exit(-1);
 }
 
@@ -464,18 +1185,29 @@ main (int argc, char *argv[])
     Itdb_iTunesDB*  itdb = NULL;
     Itdb_Device*  itdev = NULL;
     sqlite3*  hdl = NULL;
+    struct gpod_arrow*  arrow = NULL;
     struct {
         const char*  itdb_path;
         const char*  db_path;
+        const char*  arrow_path;
         bool cksum;
-    } opts = { NULL, NULL, true };
+        bool ndjson;
+        bool db_sync;
+        unsigned short  threads;
+    } opts = { NULL, NULL, NULL, true, false, false, 4 };
 
     const struct option  long_opts[] = {
         { "mount-point",        1, 0, 'M' },
 
         { "db-file",            1, 0, 'Q' },
+        { "db-sync",            0, 0, 'U' },
+        { "arrow-file",         1, 0, 'A' },
         { "enable-checksum",    0, 0, 'c' },
         { "disable-checksum",   0, 0, 'c'+255 },
+        { "checksum-threads",   1, 0, 'T' },
+        { "ndjson",             0, 0, 'j' },
+        { "fields",             1, 0, 'f' },
+        { "where",              1, 0, 'w' },
         { "help",               0, 0, 'h' },
         { 0, 0, 0, 0 }
     };
@@ -493,14 +1225,34 @@ main (int argc, char *argv[])
     }
 
 
+    ls_query_init();
+
     int  c;
     while ( (c=getopt_long(argc, argv, opt_args, long_opts, NULL)) != -1)
     {
         switch (c) {
             case 'M':  opts.itdb_path = optarg;  break;
             case 'Q':  opts.db_path = optarg;  break;
+            case 'U':  opts.db_sync = true;  break;
+            case 'A':  opts.arrow_path = optarg;  break;
             case 'c':  opts.cksum = true;  break;
             case 'c'+255:  opts.cksum = false;  break;
+            case 'T':
+            {
+                const int  t = atoi(optarg);
+                opts.threads = t > 0 ? t : 1;
+            } break;
+            case 'j':  opts.ndjson = true;  break;
+            case 'f':
+                if (!ls_fields_parse(optarg)) {
+                    return -1;
+                }
+                break;
+            case 'w':
+                if (!ls_where_parse(optarg)) {
+                    return -1;
+                }
+                break;
 
             case 'h':
             default:
@@ -508,6 +1260,11 @@ main (int argc, char *argv[])
         }
     }
 
+    if (opts.db_sync && opts.db_path == NULL) {
+        g_printerr("-U requires a DB file to sync (-Q)\n");
+        _usage(argv[0]);
+    }
+
     char  mountpoint[PATH_MAX] = { 0 };
     if (opts.itdb_path == NULL) {
         opts.itdb_path = gpod_default_mountpoint(mountpoint, sizeof(mountpoint));
@@ -559,7 +1316,8 @@ main (int argc, char *argv[])
 
 #ifdef HAVE_SQLITE3
     if (opts.db_path) {
-        if (g_file_test(opts.db_path, G_FILE_TEST_EXISTS)) {
+        const bool  sync = opts.db_sync && g_file_test(opts.db_path, G_FILE_TEST_EXISTS);
+        if (!opts.db_sync && g_file_test(opts.db_path, G_FILE_TEST_EXISTS)) {
             g_printerr("requested DB file exists, NOT overwritting '%s'\n", opts.db_path);
 	    return -1;
         }
@@ -569,13 +1327,21 @@ main (int argc, char *argv[])
             sqlite3_close(hdl);
             hdl = NULL;
         }
-        if (!db_create(hdl)) {
+        if (hdl && !(sync ? db_sync_begin(hdl, itdb) : db_create(hdl))) {
             sqlite3_close(hdl);
             hdl = NULL;
         }
     }
 #endif
 
+    if (opts.arrow_path) {
+        if (g_file_test(opts.arrow_path, G_FILE_TEST_EXISTS)) {
+            g_printerr("requested arrow file exists, NOT overwritting '%s'\n", opts.arrow_path);
+            return -1;
+        }
+        arrow = arrow_create();
+    }
+
 /*
     { 
      "playlists": [
@@ -597,106 +1363,89 @@ main (int argc, char *argv[])
 
 */
 
-    json_object*  jobj = NULL;
-    json_object*  jpodobj = NULL;
-    json_object*  jplylists = NULL;
-    json_object*  jplylistitems = NULL;
-
-    jobj = json_object_new_object();
-    jpodobj = json_object_new_object();
+    struct gpod_json  w;
+    gpod_json_init(&w, stdout);
 
-    jplylists = json_object_new_object();
-    jplylistitems = json_object_new_array();
-
-    TrkHashTbl  htbl;
-    hash_tbl_init(&htbl);
+    GPtrArray*  dups = g_ptr_array_new();
 
     GList *it;
-    for (it = itdb->playlists; it != NULL; it = it->next)
+    if (opts.ndjson)
     {
-        Itdb_Playlist*  playlist = (Itdb_Playlist *)it->data;
-        json_object_array_add(jplylistitems, _playlist(playlist, hdl, &htbl, opts.cksum));
+        // one line per track of the master playlist, no analysis
+        for (it = itdb_playlist_mpl(itdb)->members; it != NULL; it = it->next) {
+            _track(&w, (Itdb_Track *)it->data, true, hdl, arrow, NULL);
+        }
     }
-    json_object_object_add(jplylists, "items", jplylistitems);
-    json_object_object_add(jplylists, "count", json_object_new_int(g_list_length(itdb->playlists)));
-
+    else
     {
-        json_object*  jdevice = json_object_new_object();
+        gpod_json_object_begin(&w, NULL);
+        gpod_json_object_begin(&w, "ipod_data");
+
+        gpod_json_object_begin(&w, "device");
         if (itdev) {
             const Itdb_IpodInfo*  ipodinfo = itdb_device_get_ipod_info(itdev);
 
-            json_object_add_string(jdevice, "generation", itdb_info_get_ipod_generation_string (ipodinfo->ipod_generation));
-            json_object_add_int(jdevice, "capacity", ipodinfo->capacity);
-            json_object_add_string(jdevice, "model_name", itdb_info_get_ipod_model_name_string(ipodinfo->ipod_model));
-            json_object_add_string(jdevice, "model_number", ipodinfo->model_number);
-            json_object_add_string(jdevice, "uuid", itdb_device_get_uuid(itdev));
-            json_object_add_string(jdevice, "serial_number", itdb_device_get_sysinfo(itdev, "SerialNumber"));
-            json_object_add_string(jdevice, "format", itdb_device_get_sysinfo(itdev, "VolumeFormat"));
-            json_object_add_string(jdevice, "ram", itdb_device_get_sysinfo(itdev, "RAM"));
-            json_object_add_string(jdevice, "itunes_version", itdb_device_get_sysinfo(itdev, "MinITunesVersion"));
-            json_object_add_string(jdevice, "product_type", itdb_device_get_sysinfo(itdev, "ProductType"));
+            gpod_json_string(&w, "generation", itdb_info_get_ipod_generation_string (ipodinfo->ipod_generation));
+            gpod_json_int(&w, "capacity", ipodinfo->capacity);
+            gpod_json_string(&w, "model_name", itdb_info_get_ipod_model_name_string(ipodinfo->ipod_model));
+            gpod_json_string(&w, "model_number", ipodinfo->model_number);
+            gpod_json_string(&w, "uuid", itdb_device_get_uuid(itdev));
+            gpod_json_string(&w, "serial_number", itdb_device_get_sysinfo(itdev, "SerialNumber"));
+            gpod_json_string(&w, "format", itdb_device_get_sysinfo(itdev, "VolumeFormat"));
+            gpod_json_string(&w, "ram", itdb_device_get_sysinfo(itdev, "RAM"));
+            gpod_json_string(&w, "itunes_version", itdb_device_get_sysinfo(itdev, "MinITunesVersion"));
+            gpod_json_string(&w, "product_type", itdb_device_get_sysinfo(itdev, "ProductType"));
         }
-        json_object_object_add(jpodobj, "device", jdevice);
-    }
-    json_object_object_add(jpodobj, "playlists", jplylists);
-    json_object_object_add(jobj, "ipod_data", jpodobj);
+        gpod_json_object_end(&w);
+        fflush(stdout);
 
-    {
-        struct _HtblItems {
-            const char*  name;
-            GHashTable*  htbl;
-        } htblItem[] = {
-            { "high", htbl.high },
-            { "med", htbl.med},
-            { "low", htbl.low},
-            { NULL, NULL }
-        };
-
-        json_object*  janalysis = json_object_new_object();
-        json_object*  jduplicates = json_object_new_array();
-        json_object*  jahtbl;
-
-
-        struct _HtblItems*  hp = htblItem;
-        while (hp->name)
+        gpod_json_object_begin(&w, "playlists");
+        gpod_json_int(&w, "count", g_list_length(itdb->playlists));
+        gpod_json_array_begin(&w, "items");
+        for (it = itdb->playlists; it != NULL; it = it->next)
         {
-            jahtbl = json_object_new_object();
-            json_object*  jarray = json_object_new_array();
-            json_object_add_string(jahtbl, "match", hp->name);
-
-            GHashTableIter  hiter;
-            gpointer  key;
-            gpointer  value;
-
-            g_hash_table_iter_init (&hiter, hp->htbl);
-            while (g_hash_table_iter_next(&hiter, &key, &value)) {
-                hash_tbl_json(key, value, jarray);
-            }
+            Itdb_Playlist*  playlist = (Itdb_Playlist *)it->data;
+            _playlist(&w, playlist, hdl, arrow, dups);
+        }
+        gpod_json_array_end(&w);
+        gpod_json_object_end(&w);
 
-            json_object_object_add(jahtbl, "tracks", jarray);
-            json_object_array_add(jduplicates, jahtbl);
+        gpod_json_object_end(&w);
 
-            ++hp;
-        }
+        gpod_json_object_begin(&w, "ipod_analysis");
+        dup_analysis_json(&w, dups, opts.cksum, opts.threads);
+        gpod_json_object_end(&w);
 
-        json_object_object_add(janalysis, "duplicates", jduplicates);
-        json_object_object_add(jobj, "ipod_analysis", janalysis);
+        gpod_json_object_end(&w);
     }
-
-    g_print("%s\n", json_object_to_json_string(jobj)); 
-    json_object_put(jobj);
+    fflush(stdout);
 
     if (itdev) {
         itdb_device_free(itdev);
     }
     itdb_free (itdb);
+
+    int  ret = 0;
+    if (arrow) {
+        if (!arrow_write(arrow, opts.arrow_path)) {
+            ret = -1;
+        }
+        gpod_arrow_free(arrow);
+    }
 #ifdef HAVE_SQLITE3
     if (hdl) {
-        sqlite3_exec(hdl, "COMMIT TRANSACTION", NULL, NULL, NULL);
+        db_finalise(hdl);
         sqlite3_close(hdl);
+
+        if (opts.db_sync) {
+            g_printerr("DB sync: %u rows touched - %u inserted, %u updated, %u deleted, %u unchanged\n",
+                       db_sync.inserted + db_sync.updated + db_sync.deleted,
+                       db_sync.inserted, db_sync.updated, db_sync.deleted, db_sync.unchanged);
+        }
     }
 #endif
-    hash_tbl_free(&htbl);
+    g_ptr_array_free(dups, TRUE);
+    ls_query_free();
 
-    return 0;
+    return ret;
 }
@@ -38,6 +38,7 @@
 
 #include "gpod-utils.h"
 #include "gpod-ffmpeg.h"
+#include "gpod-cache.h"
 
 
 #define GPOD_MODE_LS  1<<0
@@ -45,6 +46,7 @@
 #define GPOD_MODE_FS  1<<2
 #define GPOD_MODE_CKSUM  1<<3
 #define GPOD_MODE_CKSUM_REGEN  1<<4
+#define GPOD_MODE_SOUNDCHECK  1<<5
 
 
 static gint  _track_path_cmp(gconstpointer x_, gconstpointer y_)
@@ -52,12 +54,36 @@ static gint  _track_path_cmp(gconstpointer x_, gconstpointer y_)
     return strcmp((const char*)x_, (const char*)y_);
 }
 
-static Itdb_Track*  _track(const char* file_, char** err_, Itdb_IpodGeneration idevice_, bool sanitize_)
+struct Stats {
+    unsigned  ttl;
+    size_t  rm_bytes;
+    size_t  add_bytes;
+    size_t  orphan_bytes;
+    guint   cksum_time;
+    gint64  soundcheck_time;
+    guint64  probe_time;
+    unsigned  probes;
+    unsigned  probe_fallbacks;
+} stats = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+// probe/cksum results of the device's files from previous runs
+static struct gpod_cache*  gpod_verify_cache = NULL;
+
+static Itdb_Track*  _track(const char* file_, char** err_, Itdb_IpodGeneration idevice_, bool sanitize_, gint64* probe_usecs_)
 {
     struct gpod_ff_media_info  mi;
     gpod_ff_media_info_init(&mi);
 
-    if (gpod_ff_scan(&mi, file_, idevice_, err_) < 0) {
+    // only the headers are needed to identify files on the device
+    const int  scanned = gpod_cache_scan(gpod_verify_cache, &mi, file_, idevice_, true, err_);
+    *probe_usecs_ = mi.probe_usecs;
+    stats.probe_time += mi.probe_usecs;
+    ++stats.probes;
+    if (mi.probe_fallback) {
+        ++stats.probe_fallbacks;
+    }
+
+    if (scanned < 0) {
 	if (!mi.has_audio) {
             if (*err_) {
                 const char*  err = "no audio - ";
@@ -78,19 +104,11 @@ static Itdb_Track*  _track(const char* file_, char** err_, Itdb_IpodGeneration i
 
     gpod_ff_media_info_free(&mi);
 
-    gpod_store_cksum(track, file_);
+    track->unk196 = gpod_cache_hash_file(gpod_verify_cache, file_);
     return track;
 }
 
 
-struct Stats {
-    unsigned  ttl;
-    size_t  rm_bytes;
-    size_t  add_bytes;
-    size_t  orphan_bytes;
-    guint   cksum_time;
-} stats = { 0, 0, 0, 0, 0 };
-
 
 struct _cksum_args {
     const char*  resolved_path;
@@ -102,39 +120,93 @@ struct _cksum_pool_args {
     Itdb_iTunesDB*  itdb;
 
     unsigned short  sync_limit;
+    unsigned  mode;
 
     struct Stats*  stats;
     uint32_t*  checksumed;
+    uint32_t*  soundchecked;
+    uint32_t  updated;
     guint  ttl;
     GMutex  lck;
 };
 
 
+static bool  _cksum_needed(const Itdb_Track* track_, const unsigned mode_)
+{
+    return (mode_ & GPOD_MODE_CKSUM && gpod_saved_cksum(track_) == 0) || mode_ & GPOD_MODE_CKSUM_REGEN;
+}
+
+static bool  _soundcheck_needed(const Itdb_Track* track_, const unsigned mode_)
+{
+    return mode_ & GPOD_MODE_SOUNDCHECK && track_->soundcheck == 0;
+}
+
 static void  _cksum_thread(gpointer args_, gpointer pool_args_)
 {
     Itdb_Track*  track = args_;
     struct _cksum_pool_args*  pool_args = pool_args_;
+    const bool  cksum = _cksum_needed(track, pool_args->mode);
+    const bool  soundcheck = _soundcheck_needed(track, pool_args->mode);
 
     char resolved_path[PATH_MAX] = { 0 };
     sprintf(resolved_path, "%s%s", pool_args->mountpoint, track->ipod_path);
 
-    const guint  existing = gpod_saved_cksum(track);
+    gint64  then = g_get_monotonic_time();
+    gint64  now = then;
+    if (cksum) {
+	const guint  existing = gpod_saved_cksum(track);
 
-    const guint  then = g_get_monotonic_time();
-    gpod_store_cksum(track, resolved_path);
-    const guint  now = g_get_monotonic_time();
-    if (existing > 0 && existing != gpod_saved_cksum(track)) {
-	g_print("checksumed id=%5ld path=%s -> %lld (updating from %lld)\n", track->id, resolved_path, gpod_saved_cksum(track), existing);
+	if (pool_args->mode & GPOD_MODE_CKSUM_REGEN) {
+	    gpod_store_cksum(track, resolved_path);
+	}
+	else {
+	    track->unk196 = gpod_cache_hash_file(gpod_verify_cache, resolved_path);
+	}
+	now = g_get_monotonic_time();
+	if (existing > 0 && existing != gpod_saved_cksum(track)) {
+	    g_print("checksumed id=%5ld path=%s -> %lld (updating from %lld)\n", track->id, resolved_path, gpod_saved_cksum(track), existing);
+	}
+	g_debug("checksumed %s -> %ld  %lld\n", resolved_path, track->id, gpod_saved_cksum(track));
     }
-    g_debug("checksumed %s -> %ld  %lld\n", resolved_path, track->id, gpod_saved_cksum(track));
+    const guint  cksum_time = now - then;
+
+    /* decode only pass of the file on the device, the backfill for tracks
+     * copied before gpod-cp measured loudness
+     */
+    bool  measured = false;
+    if (soundcheck) {
+	double  lufs;
+	char*  err = NULL;
+
+	then = g_get_monotonic_time();
+	const int  scanned = gpod_ff_loudness_scan(&lufs, resolved_path, 1, &err);
+	now = g_get_monotonic_time();
+	if (scanned == 0) {
+	    track->soundcheck = gpod_ff_soundcheck(lufs);
+	    measured = true;
+	    g_debug("soundchecked %s -> %ld  %.1f LUFS  %u\n", resolved_path, track->id, lufs, track->soundcheck);
+	}
+	else if (scanned < 0) {
+	    g_printerr("failed to measure loudness id=%5ld path=%s - %s\n", track->id, resolved_path, err ? err : "<unknown error>");
+	}
+	free(err);
+    }
+    const gint64  soundcheck_time = soundcheck ? now - then : 0;
 
     g_mutex_lock(&pool_args->lck);
     {
-	pool_args->stats->cksum_time += now - then;
+	pool_args->stats->cksum_time += cksum_time;
+	pool_args->stats->soundcheck_time += soundcheck_time;
+	if (cksum) {
+	    ++*(pool_args->checksumed);
+	}
+	if (measured) {
+	    ++*(pool_args->soundchecked);
+	}
 
-	if ((++*(pool_args->checksumed))%pool_args->sync_limit == 0) {
+	if ((++pool_args->updated)%pool_args->sync_limit == 0) {
 	    GError *error = NULL;
-	    g_print("checksumed %d / %d (possible)\n", *(pool_args->checksumed), pool_args->ttl);
+	    g_print("checksumed/soundchecked %d / %d (possible)\n", pool_args->updated, pool_args->ttl);
 	    itdb_write(pool_args->itdb, &error);
 
 	    if (error) {
@@ -148,7 +220,7 @@ static void  _cksum_thread(gpointer args_, gpointer pool_args_)
 
 static void  _cksum_q(Itdb_Track* track_, GThreadPool* cksum_tp_, const unsigned mode_)
 {
-    if ( (mode_ & GPOD_MODE_CKSUM && gpod_saved_cksum(track_) == 0) || mode_ & GPOD_MODE_CKSUM_REGEN) {
+    if (_cksum_needed(track_, mode_) || _soundcheck_needed(track_, mode_)) {
 	g_thread_pool_push(cksum_tp_, (void*)track_, NULL);
     }
 }
@@ -175,7 +247,10 @@ void  _usage(char* argv0_)
 	     "    -C  --checksum-regen       regenerate cksums for all files on device\n"
 	     "    -T  --checksum-threads     max threads used for generating cksums\n"
 	     "    -n  --checksum-snyc  <n>   sync after N cksums\n"
+	     "    -L  --soundcheck-missing   measure loudness (EBU R128) for files on device without\n"
+	     "                               Sound Check values, using the checksum threads\n"
 	     "    -S  --sanitize             disable text sanitization; chars like ’ to '\n"
+	     "    -P  --disable-probe-cache  disable the cache of probe/cksum results ($XDG_CACHE_HOME/gpod-utils)\n"
              , basename);
     g_free (basename);
     exit(-1);
@@ -194,7 +269,8 @@ int main (int argc, char *argv[])
 	bool  sanitize;
 	unsigned short  threads;
 	unsigned short  sync_limit;
-    } opts = { NULL, 0, true, 4, 100 };
+	bool  cache;
+    } opts = { NULL, 0, true, 4, 100, true };
 
 
     const struct option  long_opts[] = {
@@ -206,7 +282,9 @@ int main (int argc, char *argv[])
 	{ "checksum-regen",	0, 0, 'C' },
 	{ "checksum-threads",	1, 0, 'T' },
 	{ "checksum-sync",	1, 0, 'n' },
+	{ "soundcheck-missing",	0, 0, 'L' },
 	{ "santize", 		2, 0, 'S' },
+	{ "disable-probe-cache",	0, 0, 'P' },
 	{ "help", 		0, 0, 'h' },
 	{ 0, 0, 0, 0 }
     };
@@ -233,6 +311,8 @@ int main (int argc, char *argv[])
             case 'd':  opts.mode |= GPOD_MODE_DB;  break;
 	    case 'c':  opts.mode |= GPOD_MODE_CKSUM; break;
 	    case 'C':  opts.mode |= GPOD_MODE_CKSUM_REGEN; break;
+	    case 'L':  opts.mode |= GPOD_MODE_SOUNDCHECK; break;
+	    case 'P':  opts.cache = false; break;
 	    case 'n':  opts.sync_limit = atol(optarg); break;
 	    case 'T': 
 	    {
@@ -293,6 +373,14 @@ int main (int argc, char *argv[])
         strcat(mountpoint, "/");
     }
 
+    if (opts.cache) {
+        char*  err = NULL;
+        if ( (gpod_verify_cache = gpod_cache_open(NULL, &err)) == NULL) {
+            g_printerr("probe cache unavailable, continuing without - %s\n", err ? err : "unknown error");
+            free(err);
+        }
+    }
+
     Itdb_Playlist*  mpl = itdb_playlist_mpl(itdb);
     const uint32_t  dbcount = g_list_length(mpl->members);
 
@@ -321,6 +409,7 @@ int main (int argc, char *argv[])
     uint32_t  added = 0;
     uint32_t  orphaned = 0;
     uint32_t  checksumed = 0;
+    uint32_t  soundchecked = 0;
     char  path[PATH_MAX] = { 0 };
     strcpy(path, mountpoint);
     char*  pbase = path+strlen(mountpoint)-1;
@@ -390,7 +479,8 @@ int main (int argc, char *argv[])
         /* not in db, on fs .. what to do
          */
         char*  err = NULL;
-        track = _track(resolved_path, &err, ipodinfo->ipod_generation, opts.sanitize);
+        gint64  probe_usecs = 0;
+        track = _track(resolved_path, &err, ipodinfo->ipod_generation, opts.sanitize, &probe_usecs);
         if (!track) {
             free(err);
             ret = -1;
@@ -403,8 +493,8 @@ int main (int argc, char *argv[])
             // no xcode, if its a supported file, add it back to db
             track->ipod_path = g_strdup(resolved_path+strlen(mountpoint)-1);
 
-            g_print("ADD   %s -> { title='%s' artist='%s' album='%s' }\n", 
-                    track->ipod_path, track->title ? track->title : "", track->artist ? track->artist : "", track->album ? track->album : "");
+            g_print("ADD   %s -> { title='%s' artist='%s' album='%s' } probe=%.1fms\n", 
+                    track->ipod_path, track->title ? track->title : "", track->artist ? track->artist : "", track->album ? track->album : "", probe_usecs/1000.0);
             stats.add_bytes += track->size;
 
             if (!supported) {
@@ -420,16 +510,17 @@ int main (int argc, char *argv[])
             if (opts.mode & GPOD_MODE_DB)
             {
                 // trust the db, remove from fs
-                g_print("REMVE  %s -> { title='%s' artist='%s' album='%s' }\n", 
-                        ++removed, resolved_path, track->title ? track->title : "", track->artist ? track->artist : "", track->album ? track->album : "");
+                ++removed;
+                g_print("REMVE  %s -> { title='%s' artist='%s' album='%s' } probe=%.1fms\n", 
+                        resolved_path, track->title ? track->title : "", track->artist ? track->artist : "", track->album ? track->album : "", probe_usecs/1000.0);
 
                 g_unlink(resolved_path);
                 stats.rm_bytes += track->size;
             }
             else
             {
-                g_print("ORPHN  %s -> { title='%s' artist='%s' album='%s' }\n", 
-                        resolved_path, track->title ? track->title : "", track->artist ? track->artist : "", track->album ? track->album : "");
+                g_print("ORPHN  %s -> { title='%s' artist='%s' album='%s' } probe=%.1fms\n", 
+                        resolved_path, track->title ? track->title : "", track->artist ? track->artist : "", track->album ? track->album : "", probe_usecs/1000.0);
                 ++orphaned;
                 stats.orphan_bytes += track->size;
             }
@@ -457,8 +548,8 @@ int main (int argc, char *argv[])
 
 
     // work on tracks that are now in master playlist in case of re-adds above
-    const guint  cksum_then = g_get_monotonic_time();
-    if ( supported && (opts.mode & GPOD_MODE_CKSUM | opts.mode & GPOD_MODE_CKSUM_REGEN) )
+    const gint64  cksum_then = g_get_monotonic_time();
+    if ( supported && (opts.mode & GPOD_MODE_CKSUM | opts.mode & GPOD_MODE_CKSUM_REGEN | opts.mode & GPOD_MODE_SOUNDCHECK) )
     {
 	// reset everything
 	mpl = itdb_playlist_mpl(itdb);
@@ -468,8 +559,11 @@ int main (int argc, char *argv[])
 	    .mountpoint = mountpoint,
 	    .itdb = itdb,
 	    .sync_limit = opts.sync_limit,
+	    .mode = opts.mode,
 	    .stats = &stats,
 	    .checksumed = &checksumed,
+	    .soundchecked = &soundchecked,
+	    .updated = 0,
 	    .ttl = -1
 	};
 	g_mutex_init(&pool_args.lck);
@@ -501,7 +595,7 @@ int main (int argc, char *argv[])
 	g_thread_pool_free(cksum_tp, FALSE, TRUE);
 	g_mutex_clear(&pool_args.lck);
 
-	if (checksumed) {
+	if (checksumed || soundchecked) {
 	    g_print("sync'ing iPod ...\n");
 	    itdb_write(itdb, &error);
 
@@ -512,7 +606,7 @@ int main (int argc, char *argv[])
 	    }
 	}
     }
-    const guint  cksum_now = g_get_monotonic_time();
+    const gint64  cksum_now = g_get_monotonic_time();
 
 
     char  add_size[32] = { 0 };
@@ -528,13 +622,28 @@ int main (int argc, char *argv[])
     char cksum_elapsed[32] = { 0 };
     gpod_duration(cksum_elapsed, cksum_then, cksum_now);
 
+    char soundcheck_duration[32] = { 0 };
+    gpod_duration(soundcheck_duration, 0, stats.soundcheck_time);
+
+    if (stats.probes) {
+        char probe_duration[32] = { 0 };
+        gpod_duration(probe_duration, 0, stats.probe_time);
+        g_print("probed %u files (total %s, %.0f us/file), %u needed the full probe\n", stats.probes, probe_duration, stats.probe_time/(double)stats.probes, stats.probe_fallbacks);
+    }
+    if (gpod_verify_cache) {
+        struct gpod_cache_stats  cstats;
+        gpod_cache_stats(gpod_verify_cache, &cstats);
+        g_print("probe cache: %u hits, %u misses\n", cstats.hits, cstats.misses);
+    }
+
 
-    g_print("iPod total tracks=%u  orphaned %u %s, removed %u %s, added %u %s, checksumed %u (total %s, elapsed %s)\n", g_list_length(itdb_playlist_mpl(itdb)->members), orphaned, orphan_size, removed, rm_size, added, add_size, checksumed, cksum_duration, cksum_elapsed);
+    g_print("iPod total tracks=%u  orphaned %u %s, removed %u %s, added %u %s, checksumed %u (total %s), soundchecked %u (total %s), elapsed %s\n", g_list_length(itdb_playlist_mpl(itdb)->members), orphaned, orphan_size, removed, rm_size, added, add_size, checksumed, cksum_duration, soundchecked, soundcheck_duration, cksum_elapsed);
 
     if (itdev) {
         itdb_device_free(itdev);
     }
     itdb_free(itdb);
+    gpod_cache_close(gpod_verify_cache);
 
     return ret;
 }
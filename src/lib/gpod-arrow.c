@@ -0,0 +1,605 @@
+/*
+ *  Copyright (C) 2022 Ray <whatdoineed2do @ gmail com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "gpod-arrow.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/* the Arrow format, Schema.fbs and Message.fbs, only as much as needed;
+ * union members take 2 vtable slots, the type and the value
+ */
+#define ARROW_METADATA_V5        4
+
+#define ARROW_MSG_SCHEMA         1
+#define ARROW_MSG_DICTIONARY     2
+#define ARROW_MSG_RECORD_BATCH   3
+
+#define ARROW_TYPE_INT           2
+#define ARROW_TYPE_UTF8          5
+
+#define ARROW_ALIGN  64
+
+struct _buf {
+    uint8_t*  p;
+    size_t  len;
+    size_t  sz;
+};
+
+struct _col {
+    struct gpod_arrow_column  desc;
+    bool  set;  // in the current row
+
+    uint32_t  null_count;
+    struct _buf  validity;
+    struct _buf  data;     // int64 values, utf8 bytes or int32 dictionary indices
+    struct _buf  offsets;  // utf8 int32 offsets into data
+
+    // dictionary values, as a utf8 column, and open addressed index+1 of each
+    uint32_t  dict_len;
+    struct _buf  dict_data;
+    struct _buf  dict_offsets;
+    uint32_t*  dict_slots;
+    uint32_t  dict_cap;
+};
+
+struct gpod_arrow {
+    struct _col*  cols;
+    unsigned  ncols;
+    uint32_t  rows;
+};
+
+
+static void  _buf_reserve(struct _buf* b_, size_t n_)
+{
+    if (b_->len + n_ <= b_->sz) {
+        return;
+    }
+    size_t  sz = b_->sz ? b_->sz : 256;
+    while (sz < b_->len + n_) {
+        sz *= 2;
+    }
+    if ( (b_->p = realloc(b_->p, sz)) == NULL) {
+        fprintf(stderr, "arrow: failed to alloc %zu bytes\n", sz);
+        abort();
+    }
+    b_->sz = sz;
+}
+
+static uint32_t  _buf_put(struct _buf* b_, const void* data_, size_t n_)
+{
+    const uint32_t  at = b_->len;
+    _buf_reserve(b_, n_);
+    if (data_) {
+        memcpy(b_->p + b_->len, data_, n_);
+    }
+    else {
+        memset(b_->p + b_->len, 0, n_);
+    }
+    b_->len += n_;
+    return at;
+}
+
+static void  _le(uint8_t* dst_, uint64_t v_, unsigned size_)
+{
+    for (unsigned i=0; i<size_; ++i) {
+        dst_[i] = (v_ >> (8*i)) & 0xff;
+    }
+}
+
+static uint32_t  _le32(const uint8_t* src_)
+{
+    return src_[0] | src_[1] << 8 | src_[2] << 16 | (uint32_t)src_[3] << 24;
+}
+
+static uint32_t  _buf_put_le(struct _buf* b_, uint64_t v_, unsigned size_)
+{
+    const uint32_t  at = _buf_put(b_, NULL, size_);
+    _le(b_->p + at, v_, size_);
+    return at;
+}
+
+// zero fill so that extra_ bytes on, the buffer is aligned
+static void  _buf_pad(struct _buf* b_, size_t align_, size_t extra_)
+{
+    const size_t  n = (align_ - (b_->len + extra_) % align_) % align_;
+    if (n) {
+        _buf_put(b_, NULL, n);
+    }
+}
+
+static void  _buf_free(struct _buf* b_)
+{
+    free(b_->p);
+    memset(b_, 0, sizeof(struct _buf));
+}
+
+
+/* flatbuffer builder, written front to back: a parent is written before its
+ * children with its (forward pointing) offsets to them patched by _fb_ref()
+ */
+struct _fb_field {
+    uint8_t  size;  // 0 when absent
+    bool  ref;      // offset to an object written later
+    uint64_t  value;
+};
+
+static void  _fb_ref(struct _buf* fb_, uint32_t at_, uint32_t target_)
+{
+    _le(fb_->p + at_, target_ - at_, 4);
+}
+
+// the root offset, patched with the root table
+static uint32_t  _fb_root(struct _buf* fb_)
+{
+    return _buf_put_le(fb_, 0, 4);
+}
+
+// fields_ indexed by field id, refs_ receives the location of each ref field
+static uint32_t  _fb_table(struct _buf* fb_, const struct _fb_field* fields_, unsigned n_, uint32_t* refs_)
+{
+    uint16_t  offs[8] = { 0 };
+    uint16_t  size = 4;  // soffset to the vtable
+
+    // largest first, each naturally aligned as the table is 8 byte aligned
+    for (unsigned sz=8; sz; sz/=2) {
+        for (unsigned i=0; i<n_; ++i) {
+            if (fields_[i].size == sz) {
+                size = (size + sz-1) & ~(sz-1);
+                offs[i] = size;
+                size += sz;
+            }
+        }
+    }
+
+    _buf_pad(fb_, 2, 0);
+    const uint32_t  vtable = _buf_put_le(fb_, 4 + 2*n_, 2);
+    _buf_put_le(fb_, size, 2);
+    for (unsigned i=0; i<n_; ++i) {
+        _buf_put_le(fb_, offs[i], 2);
+    }
+
+    _buf_pad(fb_, 8, 0);
+    const uint32_t  table = _buf_put(fb_, NULL, size);
+    _le(fb_->p + table, table - vtable, 4);
+
+    for (unsigned i=0; i<n_; ++i)
+    {
+        if (fields_[i].size == 0) {
+            continue;
+        }
+        if (fields_[i].ref) {
+            refs_[i] = table + offs[i];
+        }
+        else {
+            _le(fb_->p + table + offs[i], fields_[i].value, fields_[i].size);
+        }
+    }
+    return table;
+}
+
+// NULL data_ for a vector of offsets, elements patched by _fb_ref()
+static uint32_t  _fb_vector(struct _buf* fb_, uint32_t n_, size_t elem_, size_t align_, const void* data_)
+{
+    _buf_pad(fb_, align_ < 4 ? 4 : align_, 4);
+    const uint32_t  at = _buf_put_le(fb_, n_, 4);
+    _buf_put(fb_, data_, n_*elem_);
+    return at;
+}
+
+static uint32_t  _fb_string(struct _buf* fb_, const char* s_)
+{
+    const size_t  len = strlen(s_);
+
+    _buf_pad(fb_, 4, 0);
+    const uint32_t  at = _buf_put_le(fb_, len, 4);
+    _buf_put(fb_, s_, len+1);
+    return at;
+}
+
+// Int { bitWidth, is_signed }
+static uint32_t  _fb_int_type(struct _buf* fb_, unsigned bits_)
+{
+    const struct _fb_field  f[] = { { 4, false, bits_ }, { 1, false, 1 } };
+    return _fb_table(fb_, f, 2, NULL);
+}
+
+// Message { version, header_type, header, bodyLength }, returns the header ref
+static uint32_t  _fb_message(struct _buf* fb_, unsigned type_, uint64_t body_len_)
+{
+    const uint32_t  root = _fb_root(fb_);
+    const struct _fb_field  f[] = {
+        { 2, false, ARROW_METADATA_V5 },
+        { 1, false, type_ },
+        { 4, true,  0 },
+        { 8, false, body_len_ }
+    };
+    uint32_t  refs[4];
+    _fb_ref(fb_, root, _fb_table(fb_, f, 4, refs));
+    return refs[2];
+}
+
+// RecordBatch { length, nodes, buffers }
+static uint32_t  _fb_record_batch(struct _buf* fb_, uint32_t length_, const struct _buf* nodes_, const struct _buf* buffers_)
+{
+    const struct _fb_field  f[] = {
+        { 8, false, length_ },
+        { 4, true,  0 },
+        { 4, true,  0 }
+    };
+    uint32_t  refs[3];
+    const uint32_t  at = _fb_table(fb_, f, 3, refs);
+    _fb_ref(fb_, refs[1], _fb_vector(fb_, nodes_->len/16, 16, 8, nodes_->p));
+    _fb_ref(fb_, refs[2], _fb_vector(fb_, buffers_->len/16, 16, 8, buffers_->p));
+    return at;
+}
+
+
+/* message body, its FieldNodes and Buffers
+ */
+struct _body {
+    struct _buf  data;
+    struct _buf  nodes;
+    struct _buf  buffers;
+};
+
+static void  _body_node(struct _body* body_, uint32_t length_, uint32_t null_count_)
+{
+    _buf_put_le(&body_->nodes, length_, 8);
+    _buf_put_le(&body_->nodes, null_count_, 8);
+}
+
+static void  _body_buffer(struct _body* body_, const void* data_, size_t len_)
+{
+    _buf_put_le(&body_->buffers, body_->data.len, 8);
+    _buf_put_le(&body_->buffers, len_, 8);
+    if (len_) {
+        _buf_put(&body_->data, data_, len_);
+        _buf_pad(&body_->data, ARROW_ALIGN, 0);
+    }
+}
+
+static void  _body_free(struct _body* body_)
+{
+    _buf_free(&body_->data);
+    _buf_free(&body_->nodes);
+    _buf_free(&body_->buffers);
+}
+
+
+/* encapsulated message: continuation, metadata size, metadata, body
+ */
+struct _out {
+    FILE*  f;
+    uint64_t  pos;
+};
+
+static int  _message(struct _out* out_, struct _buf* meta_, const struct _buf* body_)
+{
+    // body starts on a 64 byte boundary as the stream position always is
+    _buf_pad(meta_, ARROW_ALIGN, out_->pos + 8);
+
+    uint8_t  prefix[8];
+    _le(prefix, 0xffffffff, 4);
+    _le(prefix+4, meta_->len, 4);
+
+    if (fwrite(prefix, sizeof(prefix), 1, out_->f) != 1 ||
+        fwrite(meta_->p, meta_->len, 1, out_->f) != 1 ||
+        (body_ && body_->len && fwrite(body_->p, body_->len, 1, out_->f) != 1)) {
+        return -1;
+    }
+    out_->pos += sizeof(prefix) + meta_->len + (body_ ? body_->len : 0);
+    return 0;
+}
+
+static int  _schema(struct _out* out_, const struct gpod_arrow* obj_)
+{
+    struct _buf  fb = { 0 };
+
+    const uint32_t  hdr = _fb_message(&fb, ARROW_MSG_SCHEMA, 0);
+
+    // Schema { endianness, fields }
+    const struct _fb_field  schema[] = { { 2, false, 0 }, { 4, true, 0 } };
+    uint32_t  refs[2];
+    _fb_ref(&fb, hdr, _fb_table(&fb, schema, 2, refs));
+
+    const uint32_t  fields = _fb_vector(&fb, obj_->ncols, 4, 4, NULL);
+    _fb_ref(&fb, refs[1], fields);
+
+    for (unsigned i=0; i<obj_->ncols; ++i)
+    {
+        const struct gpod_arrow_column*  col = &obj_->cols[i].desc;
+        const bool  dict = col->type == GPOD_ARROW_UTF8_DICT;
+
+        // Field { name, nullable, type_type, type, dictionary, children }
+        const struct _fb_field  field[] = {
+            { 4, true,  0 },
+            { 1, false, col->nullable },
+            { 1, false, col->type == GPOD_ARROW_INT64 ? ARROW_TYPE_INT : ARROW_TYPE_UTF8 },
+            { 4, true,  0 },
+            { dict ? 4 : 0, true, 0 },
+            { 4, true,  0 }
+        };
+        uint32_t  frefs[6];
+        _fb_ref(&fb, fields + 4 + 4*i, _fb_table(&fb, field, 6, frefs));
+        _fb_ref(&fb, frefs[0], _fb_string(&fb, col->name));
+        _fb_ref(&fb, frefs[3], col->type == GPOD_ARROW_INT64 ? _fb_int_type(&fb, 64) : _fb_table(&fb, NULL, 0, NULL));
+
+        if (dict) {
+            // DictionaryEncoding { id, indexType, isOrdered }, the column is its id
+            const struct _fb_field  enc[] = { { 8, false, i }, { 4, true, 0 }, { 1, false, 0 } };
+            uint32_t  erefs[3];
+            _fb_ref(&fb, frefs[4], _fb_table(&fb, enc, 3, erefs));
+            _fb_ref(&fb, erefs[1], _fb_int_type(&fb, 32));
+        }
+        _fb_ref(&fb, frefs[5], _fb_vector(&fb, 0, 4, 4, NULL));
+    }
+
+    const int  ret = _message(out_, &fb, NULL);
+    _buf_free(&fb);
+    return ret;
+}
+
+static int  _dictionary(struct _out* out_, const struct _col* col_, unsigned id_)
+{
+    struct _body  body = { 0 };
+    _body_node(&body, col_->dict_len, 0);
+    _body_buffer(&body, NULL, 0);
+    _body_buffer(&body, col_->dict_offsets.p, col_->dict_offsets.len);
+    _body_buffer(&body, col_->dict_data.p, col_->dict_data.len);
+
+    struct _buf  fb = { 0 };
+    const uint32_t  hdr = _fb_message(&fb, ARROW_MSG_DICTIONARY, body.data.len);
+
+    // DictionaryBatch { id, data, isDelta }
+    const struct _fb_field  f[] = { { 8, false, id_ }, { 4, true, 0 }, { 1, false, 0 } };
+    uint32_t  refs[3];
+    _fb_ref(&fb, hdr, _fb_table(&fb, f, 3, refs));
+    _fb_ref(&fb, refs[1], _fb_record_batch(&fb, col_->dict_len, &body.nodes, &body.buffers));
+
+    const int  ret = _message(out_, &fb, &body.data);
+    _buf_free(&fb);
+    _body_free(&body);
+    return ret;
+}
+
+static int  _record_batch(struct _out* out_, const struct gpod_arrow* obj_)
+{
+    struct _body  body = { 0 };
+    for (unsigned i=0; i<obj_->ncols; ++i)
+    {
+        const struct _col*  col = &obj_->cols[i];
+
+        _body_node(&body, obj_->rows, col->null_count);
+        _body_buffer(&body, col->validity.p, col->null_count ? col->validity.len : 0);
+        if (col->desc.type == GPOD_ARROW_UTF8) {
+            _body_buffer(&body, col->offsets.p, col->offsets.len);
+        }
+        _body_buffer(&body, col->data.p, col->data.len);
+    }
+
+    struct _buf  fb = { 0 };
+    const uint32_t  hdr = _fb_message(&fb, ARROW_MSG_RECORD_BATCH, body.data.len);
+    _fb_ref(&fb, hdr, _fb_record_batch(&fb, obj_->rows, &body.nodes, &body.buffers));
+
+    const int  ret = _message(out_, &fb, &body.data);
+    _buf_free(&fb);
+    _body_free(&body);
+    return ret;
+}
+
+
+struct gpod_arrow*  gpod_arrow_new(const struct gpod_arrow_column* cols_, unsigned ncols_)
+{
+    struct gpod_arrow*  obj = calloc(1, sizeof(struct gpod_arrow));
+    obj->cols = calloc(ncols_, sizeof(struct _col));
+    obj->ncols = ncols_;
+
+    for (unsigned i=0; i<ncols_; ++i)
+    {
+        struct _col*  col = &obj->cols[i];
+        col->desc = cols_[i];
+        if (col->desc.type == GPOD_ARROW_UTF8) {
+            _buf_put_le(&col->offsets, 0, 4);
+        }
+        if (col->desc.type == GPOD_ARROW_UTF8_DICT) {
+            _buf_put_le(&col->dict_offsets, 0, 4);
+        }
+    }
+    return obj;
+}
+
+void  gpod_arrow_free(struct gpod_arrow* obj_)
+{
+    if (obj_ == NULL) {
+        return;
+    }
+    for (unsigned i=0; i<obj_->ncols; ++i)
+    {
+        struct _col*  col = &obj_->cols[i];
+        _buf_free(&col->validity);
+        _buf_free(&col->data);
+        _buf_free(&col->offsets);
+        _buf_free(&col->dict_data);
+        _buf_free(&col->dict_offsets);
+        free(col->dict_slots);
+    }
+    free(obj_->cols);
+    free(obj_);
+}
+
+static void  _valid(struct _col* col_, uint32_t row_, bool valid_)
+{
+    if (row_ % 8 == 0) {
+        _buf_put(&col_->validity, NULL, 1);
+    }
+    if (valid_) {
+        col_->validity.p[row_ / 8] |= 1 << (row_ % 8);
+    }
+    else {
+        ++col_->null_count;
+    }
+    col_->set = true;
+}
+
+static uint32_t  _dict_hash(const char* s_, size_t len_)
+{
+    uint32_t  h = 2166136261u;  // fnv-1a
+    for (size_t i=0; i<len_; ++i) {
+        h = (h ^ (uint8_t)s_[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void  _dict_insert(struct _col* col_, uint32_t idx_, uint32_t hash_)
+{
+    uint32_t  slot = hash_ & (col_->dict_cap-1);
+    while (col_->dict_slots[slot]) {
+        slot = (slot+1) & (col_->dict_cap-1);
+    }
+    col_->dict_slots[slot] = idx_+1;
+}
+
+static const char*  _dict_value(const struct _col* col_, uint32_t idx_, uint32_t* len_)
+{
+    const uint32_t  beg = _le32(col_->dict_offsets.p + 4*idx_);
+    *len_ = _le32(col_->dict_offsets.p + 4*(idx_+1)) - beg;
+    return (const char*)col_->dict_data.p + beg;
+}
+
+static uint32_t  _dict_index(struct _col* col_, const char* s_)
+{
+    const size_t  len = strlen(s_);
+    const uint32_t  hash = _dict_hash(s_, len);
+
+    if (col_->dict_cap)
+    {
+        uint32_t  slot = hash & (col_->dict_cap-1);
+        while (col_->dict_slots[slot])
+        {
+            const uint32_t  idx = col_->dict_slots[slot]-1;
+            uint32_t  vlen;
+            const char*  v = _dict_value(col_, idx, &vlen);
+            if (vlen == len && memcmp(v, s_, len) == 0) {
+                return idx;
+            }
+            slot = (slot+1) & (col_->dict_cap-1);
+        }
+    }
+
+    // keep the table at most half full
+    if (2*(col_->dict_len+1) > col_->dict_cap)
+    {
+        free(col_->dict_slots);
+        col_->dict_cap = col_->dict_cap ? 2*col_->dict_cap : 64;
+        if ( (col_->dict_slots = calloc(col_->dict_cap, sizeof(uint32_t))) == NULL) {
+            fprintf(stderr, "arrow: failed to alloc dictionary\n");
+            abort();
+        }
+        for (uint32_t i=0; i<col_->dict_len; ++i) {
+            uint32_t  vlen;
+            const char*  v = _dict_value(col_, i, &vlen);
+            _dict_insert(col_, i, _dict_hash(v, vlen));
+        }
+    }
+
+    _buf_put(&col_->dict_data, s_, len);
+    _buf_put_le(&col_->dict_offsets, col_->dict_data.len, 4);
+    _dict_insert(col_, col_->dict_len, hash);
+    return col_->dict_len++;
+}
+
+void  gpod_arrow_int64(struct gpod_arrow* obj_, unsigned col_, int64_t data_)
+{
+    struct _col*  col = &obj_->cols[col_];
+    if (col->set || col->desc.type != GPOD_ARROW_INT64) {
+        return;
+    }
+    _buf_put_le(&col->data, (uint64_t)data_, 8);
+    _valid(col, obj_->rows, true);
+}
+
+void  gpod_arrow_string(struct gpod_arrow* obj_, unsigned col_, const char* data_)
+{
+    struct _col*  col = &obj_->cols[col_];
+    if (col->set || col->desc.type == GPOD_ARROW_INT64) {
+        return;
+    }
+    if (data_ == NULL && !col->desc.nullable) {
+        data_ = "";
+    }
+
+    if (col->desc.type == GPOD_ARROW_UTF8) {
+        if (data_) {
+            _buf_put(&col->data, data_, strlen(data_));
+        }
+        _buf_put_le(&col->offsets, col->data.len, 4);
+    }
+    else {
+        _buf_put_le(&col->data, data_ ? _dict_index(col, data_) : 0, 4);
+    }
+    _valid(col, obj_->rows, data_ != NULL);
+}
+
+int  gpod_arrow_row_end(struct gpod_arrow* obj_)
+{
+    int  ret = 0;
+    for (unsigned i=0; i<obj_->ncols; ++i)
+    {
+        struct _col*  col = &obj_->cols[i];
+        if (!col->set) {
+            // keep the columns the same length
+            if (col->desc.type == GPOD_ARROW_INT64) {
+                gpod_arrow_int64(obj_, i, 0);
+            }
+            else {
+                gpod_arrow_string(obj_, i, NULL);
+            }
+            ret = -1;
+        }
+        col->set = false;
+    }
+    ++obj_->rows;
+    return ret;
+}
+
+int  gpod_arrow_write(struct gpod_arrow* obj_, FILE* f_)
+{
+    struct _out  out = { f_, 0 };
+
+    if (_schema(&out, obj_) < 0) {
+        return -1;
+    }
+    for (unsigned i=0; i<obj_->ncols; ++i) {
+        if (obj_->cols[i].desc.type == GPOD_ARROW_UTF8_DICT && _dictionary(&out, &obj_->cols[i], i) < 0) {
+            return -1;
+        }
+    }
+    if (_record_batch(&out, obj_) < 0) {
+        return -1;
+    }
+
+    // end of stream
+    const uint8_t  eos[8] = { 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0 };
+    if (fwrite(eos, sizeof(eos), 1, f_) != 1 || fflush(f_) != 0) {
+        return -1;
+    }
+    return 0;
+}
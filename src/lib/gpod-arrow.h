@@ -0,0 +1,71 @@
+/*
+ *  Copyright (C) 2022 Ray <whatdoineed2do @ gmail com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef GPOD_ARROW_H
+#define GPOD_ARROW_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* minimal Apache Arrow IPC stream writer: int64, utf8 and dictionary
+ * encoded utf8 (int32 indices) columns
+ *
+ * rows are accumulated in memory and written as the schema, one dictionary
+ * batch per dictionary column and a single record batch; every buffer starts
+ * on a 64 byte boundary of the output so a mmap'd file can be read without
+ * copying (pyarrow.ipc.open_stream(pyarrow.memory_map(...)))
+ *
+ * each row sets every column once, in any order, before gpod_arrow_row_end()
+ */
+enum gpod_arrow_type {
+    GPOD_ARROW_INT64 = 0,
+    GPOD_ARROW_UTF8,
+    GPOD_ARROW_UTF8_DICT
+};
+
+struct gpod_arrow_column {
+    const char*  name;  // must outlive the writer
+    enum gpod_arrow_type  type;
+    bool  nullable;     // otherwise NULL strings are written as ""
+};
+
+struct gpod_arrow;
+
+struct gpod_arrow*  gpod_arrow_new(const struct gpod_arrow_column* cols_, unsigned ncols_);
+void  gpod_arrow_free(struct gpod_arrow* obj_);
+
+void  gpod_arrow_int64(struct gpod_arrow* obj_, unsigned col_, int64_t data_);
+// NULL data_ is null
+void  gpod_arrow_string(struct gpod_arrow* obj_, unsigned col_, const char* data_);
+// -1 if any column was not set
+int  gpod_arrow_row_end(struct gpod_arrow* obj_);
+
+// writes the stream, including its end of stream marker
+int  gpod_arrow_write(struct gpod_arrow* obj_, FILE* f_);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,644 @@
+/*
+ *  Copyright (C) 2022 Ray <whatdoineed2do @ gmail com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "gpod-cache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
+
+
+#ifdef HAVE_SQLITE3
+
+// bump when the serialized media info changes, older rows are then ignored
+#define GPOD_CACHE_VERSION  2
+
+static const char*  gpod_cache_schema[] = {
+    /* each put commits on its own, cheap with the WAL and no syncs, so the
+     * write lock is never held between puts and other tools sharing the
+     * cache aren't blocked; nothing is lost if interrupted */
+    "PRAGMA journal_mode = WAL",
+    "PRAGMA synchronous = OFF",  // its a cache, can always be rebuilt
+    "CREATE TABLE IF NOT EXISTS scan ("
+    "  path  TEXT PRIMARY KEY NOT NULL,"
+    "  dev  INTEGER, ino  INTEGER, size  INTEGER, mtime  INTEGER,"
+    "  version  INTEGER,"
+    "  target  INTEGER,"
+    "  fast  INTEGER,"  // header only probe, not good enough for a full scan
+    "  ret  INTEGER,"
+    "  err  TEXT,"
+    "  info  BLOB,"
+    "  artwork  BLOB"
+    ")",
+    "CREATE TABLE IF NOT EXISTS audio_hash ("
+    "  path  TEXT PRIMARY KEY NOT NULL,"
+    "  dev  INTEGER, ino  INTEGER, size  INTEGER, mtime  INTEGER,"
+    "  hash  TEXT"
+    ")",
+    "CREATE TABLE IF NOT EXISTS digest ("
+    "  path  TEXT PRIMARY KEY NOT NULL,"
+    "  dev  INTEGER, ino  INTEGER, size  INTEGER, mtime  INTEGER,"
+    "  hash  INTEGER,"
+    "  digest  TEXT"
+    ")",
+    NULL
+};
+
+enum gpod_cache_stmt {
+    GPOD_CACHE_SCAN_GET = 0,
+    GPOD_CACHE_SCAN_PUT,
+    GPOD_CACHE_AUDIO_HASH_GET,
+    GPOD_CACHE_AUDIO_HASH_PUT,
+    GPOD_CACHE_DIGEST_GET,
+    GPOD_CACHE_DIGEST_PUT,
+    GPOD_CACHE_STMT_MAX
+};
+
+static const char*  gpod_cache_sql[GPOD_CACHE_STMT_MAX] = {
+    "SELECT dev,ino,size,mtime,version,target,fast,ret,err,info,artwork FROM scan WHERE path=?",
+    "INSERT OR REPLACE INTO scan (path,dev,ino,size,mtime,version,target,fast,ret,err,info,artwork) VALUES (?,?,?,?,?,?,?,?,?,?,?,?)",
+    "SELECT dev,ino,size,mtime,hash FROM audio_hash WHERE path=?",
+    "INSERT OR REPLACE INTO audio_hash (path,dev,ino,size,mtime,hash) VALUES (?,?,?,?,?,?)",
+    "SELECT dev,ino,size,mtime,hash,digest FROM digest WHERE path=?",
+    "INSERT OR REPLACE INTO digest (path,dev,ino,size,mtime,hash,digest) VALUES (?,?,?,?,?,?,?)",
+};
+
+struct gpod_cache {
+    GMutex  lck;
+    sqlite3*  hdl;
+    sqlite3_stmt*  stmt[GPOD_CACHE_STMT_MAX];
+
+    struct gpod_cache_stats  stats;
+};
+
+// the file's identity, any change invalidates what's cached
+struct _key {
+    sqlite3_int64  dev;
+    sqlite3_int64  ino;
+    sqlite3_int64  size;
+    sqlite3_int64  mtime;  // ns, a same sized retag within the second must still miss
+};
+
+static bool  _key(struct _key* key_, const char* file_)
+{
+    GStatBuf  st;
+    if (g_stat(file_, &st) < 0) {
+        return false;
+    }
+    key_->dev = st.st_dev;
+    key_->ino = st.st_ino;
+    key_->size = st.st_size;
+    key_->mtime = (sqlite3_int64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+static void  _key_bind(sqlite3_stmt* stmt_, const char* file_, const struct _key* key_)
+{
+    sqlite3_bind_text(stmt_, 1, file_, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt_, 2, key_->dev);
+    sqlite3_bind_int64(stmt_, 3, key_->ino);
+    sqlite3_bind_int64(stmt_, 4, key_->size);
+    sqlite3_bind_int64(stmt_, 5, key_->mtime);
+}
+
+/* lookup the row for the file, SQLITE_ROW only if it is still valid, stmt
+ * must be reset by caller
+ */
+static int  _get(struct gpod_cache* obj_, sqlite3_stmt* stmt_, const char* file_, const struct _key* key_)
+{
+    int  ret;
+
+    sqlite3_bind_text(stmt_, 1, file_, -1, SQLITE_STATIC);
+    if ( (ret = sqlite3_step(stmt_)) != SQLITE_ROW) {
+        return ret;
+    }
+
+    if (sqlite3_column_int64(stmt_, 0) != key_->dev ||
+        sqlite3_column_int64(stmt_, 1) != key_->ino ||
+        sqlite3_column_int64(stmt_, 2) != key_->size ||
+        sqlite3_column_int64(stmt_, 3) != key_->mtime) {
+        return SQLITE_DONE;
+    }
+    return SQLITE_ROW;
+}
+
+static void  _put(struct gpod_cache* obj_, sqlite3_stmt* stmt_)
+{
+    if (sqlite3_step(stmt_) != SQLITE_DONE) {
+        g_printerr("failed to update cache - %s\n", sqlite3_errmsg(obj_->hdl));
+    }
+    sqlite3_reset(stmt_);
+    sqlite3_clear_bindings(stmt_);
+}
+
+
+/* media info serialization - explicit field by field so the layout of the
+ * structs can change without breaking what's already cached
+ */
+static const size_t  gpod_cache_meta_strs[] = {
+    offsetof(struct gpod_ff_meta, title),
+    offsetof(struct gpod_ff_meta, artist),
+    offsetof(struct gpod_ff_meta, album),
+    offsetof(struct gpod_ff_meta, album_artist),
+    offsetof(struct gpod_ff_meta, genre),
+    offsetof(struct gpod_ff_meta, comment),
+    offsetof(struct gpod_ff_meta, composer),
+    offsetof(struct gpod_ff_meta, grouping),
+    offsetof(struct gpod_ff_meta, title_sort),
+    offsetof(struct gpod_ff_meta, artist_sort),
+    offsetof(struct gpod_ff_meta, album_sort),
+    offsetof(struct gpod_ff_meta, album_artist_sort),
+    offsetof(struct gpod_ff_meta, composer_sort),
+};
+
+static const size_t  gpod_cache_meta_ints[] = {
+    offsetof(struct gpod_ff_meta, year),
+    offsetof(struct gpod_ff_meta, date_released),
+    offsetof(struct gpod_ff_meta, track),
+    offsetof(struct gpod_ff_meta, total_tracks),
+    offsetof(struct gpod_ff_meta, disc),
+    offsetof(struct gpod_ff_meta, total_discs),
+    offsetof(struct gpod_ff_meta, compilation),
+};
+
+#define GPOD_CACHE_NULL_STR  0xffffffff
+
+static void  _ser_u32(GByteArray* buf_, uint32_t v_)
+{
+    g_byte_array_append(buf_, (const guint8*)&v_, sizeof(v_));
+}
+
+static void  _ser_i64(GByteArray* buf_, int64_t v_)
+{
+    g_byte_array_append(buf_, (const guint8*)&v_, sizeof(v_));
+}
+
+static void  _ser_str(GByteArray* buf_, const char* s_)
+{
+    if (s_ == NULL) {
+        _ser_u32(buf_, GPOD_CACHE_NULL_STR);
+        return;
+    }
+    const uint32_t  n = strlen(s_);
+    _ser_u32(buf_, n);
+    g_byte_array_append(buf_, (const guint8*)s_, n);
+}
+
+static GByteArray*  _ser(const struct gpod_ff_media_info* info_)
+{
+    GByteArray*  buf = g_byte_array_sized_new(512);
+    float  fps = info_->video.fps;
+    uint32_t  fpsbits;
+    memcpy(&fpsbits, &fps, sizeof(fpsbits));
+
+    _ser_i64(buf, info_->file_size);
+    _ser_str(buf, info_->type);
+    _ser_str(buf, info_->description);
+    _ser_u32(buf, info_->has_video);
+    _ser_u32(buf, info_->has_audio);
+    _ser_u32(buf, info_->supported_ipod_fmt);
+    _ser_str(buf, info_->remux);
+
+    _ser_u32(buf, info_->audio.codec_id);
+    _ser_u32(buf, info_->audio.bitrate);
+    _ser_u32(buf, info_->audio.samplerate);
+    _ser_u32(buf, info_->audio.channels);
+    _ser_u32(buf, info_->audio.song_length);
+    _ser_u32(buf, info_->audio.bits_per_sample);
+
+    _ser_u32(buf, info_->video.codec_id);
+    _ser_u32(buf, info_->video.width);
+    _ser_u32(buf, info_->video.height);
+    _ser_u32(buf, (uint32_t)info_->video.profile);
+    _ser_u32(buf, info_->video.length);
+    _ser_u32(buf, info_->video.bitrate);
+    _ser_u32(buf, fpsbits);
+
+    _ser_u32(buf, info_->meta.has_meta);
+    for (unsigned i=0; i<G_N_ELEMENTS(gpod_cache_meta_strs); ++i) {
+        _ser_str(buf, *(char**)((const char*)&info_->meta + gpod_cache_meta_strs[i]));
+    }
+    for (unsigned i=0; i<G_N_ELEMENTS(gpod_cache_meta_ints); ++i) {
+        _ser_u32(buf, *(uint32_t*)((const char*)&info_->meta + gpod_cache_meta_ints[i]));
+    }
+
+    _ser_u32(buf, info_->artwork.codec_id);
+
+    return buf;
+}
+
+struct _cursor {
+    const guint8*  p;
+    const guint8*  end;
+    bool  ok;
+};
+
+static uint32_t  _deser_u32(struct _cursor* c_)
+{
+    uint32_t  v = 0;
+    if (c_->ok && c_->end - c_->p >= sizeof(v)) {
+        memcpy(&v, c_->p, sizeof(v));
+        c_->p += sizeof(v);
+    }
+    else {
+        c_->ok = false;
+    }
+    return v;
+}
+
+static int64_t  _deser_i64(struct _cursor* c_)
+{
+    int64_t  v = 0;
+    if (c_->ok && c_->end - c_->p >= sizeof(v)) {
+        memcpy(&v, c_->p, sizeof(v));
+        c_->p += sizeof(v);
+    }
+    else {
+        c_->ok = false;
+    }
+    return v;
+}
+
+static char*  _deser_str(struct _cursor* c_)
+{
+    const uint32_t  n = _deser_u32(c_);
+    if (!c_->ok || n == GPOD_CACHE_NULL_STR) {
+        return NULL;
+    }
+    if (c_->end - c_->p < n) {
+        c_->ok = false;
+        return NULL;
+    }
+    char*  s = g_strndup((const char*)c_->p, n);
+    c_->p += n;
+    return s;
+}
+
+// static strings from ffmpeg's descriptors, kept for the life of the process
+static const char*  _deser_istr(struct _cursor* c_)
+{
+    char*  s = _deser_str(c_);
+    const char*  is = s ? g_intern_string(s) : NULL;
+    g_free(s);
+    return is;
+}
+
+static bool  _deser(struct gpod_ff_media_info* info_, const void* blob_, int n_)
+{
+    struct _cursor  c = { (const guint8*)blob_, (const guint8*)blob_ + n_, true };
+    uint32_t  fpsbits;
+
+    info_->file_size = _deser_i64(&c);
+    info_->type = _deser_istr(&c);
+    info_->description = _deser_istr(&c);
+    info_->has_video = _deser_u32(&c);
+    info_->has_audio = _deser_u32(&c);
+    info_->supported_ipod_fmt = _deser_u32(&c);
+    info_->remux = _deser_istr(&c);
+
+    info_->audio.codec_id = _deser_u32(&c);
+    info_->audio.bitrate = _deser_u32(&c);
+    info_->audio.samplerate = _deser_u32(&c);
+    info_->audio.channels = _deser_u32(&c);
+    info_->audio.song_length = _deser_u32(&c);
+    info_->audio.bits_per_sample = _deser_u32(&c);
+
+    info_->video.codec_id = _deser_u32(&c);
+    info_->video.width = _deser_u32(&c);
+    info_->video.height = _deser_u32(&c);
+    info_->video.profile = (int)_deser_u32(&c);
+    info_->video.length = _deser_u32(&c);
+    info_->video.bitrate = _deser_u32(&c);
+    fpsbits = _deser_u32(&c);
+    memcpy(&info_->video.fps, &fpsbits, sizeof(fpsbits));
+
+    info_->meta.has_meta = _deser_u32(&c);
+    for (unsigned i=0; i<G_N_ELEMENTS(gpod_cache_meta_strs); ++i) {
+        // meta strings are free()'d
+        char*  s = _deser_str(&c);
+        *(char**)((char*)&info_->meta + gpod_cache_meta_strs[i]) = s ? strdup(s) : NULL;
+        g_free(s);
+    }
+    for (unsigned i=0; i<G_N_ELEMENTS(gpod_cache_meta_ints); ++i) {
+        *(uint32_t*)((char*)&info_->meta + gpod_cache_meta_ints[i]) = _deser_u32(&c);
+    }
+
+    info_->artwork.codec_id = _deser_u32(&c);
+
+    if (!c.ok) {
+        gpod_ff_media_info_free(info_);
+        gpod_ff_media_info_init(info_);
+    }
+    return c.ok;
+}
+
+
+struct gpod_cache*  gpod_cache_open(const char* path_, char** err_)
+{
+    char*  path = path_ ? g_strdup(path_) : g_build_filename(g_get_user_cache_dir(), "gpod-utils", "probe.db", NULL);
+    char*  dir = g_path_get_dirname(path);
+    struct gpod_cache*  obj = NULL;
+
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+
+    obj = (struct gpod_cache*)calloc(1, sizeof(struct gpod_cache));
+    g_mutex_init(&obj->lck);
+
+    if (sqlite3_open_v2(path, &obj->hdl, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        goto fail;
+    }
+    sqlite3_busy_timeout(obj->hdl, 2000);
+
+    for (const char** q=gpod_cache_schema; *q; ++q) {
+        if (sqlite3_exec(obj->hdl, *q, NULL, NULL, NULL) != SQLITE_OK) {
+            goto fail;
+        }
+    }
+    for (unsigned i=0; i<GPOD_CACHE_STMT_MAX; ++i) {
+        if (sqlite3_prepare_v2(obj->hdl, gpod_cache_sql[i], -1, &obj->stmt[i], NULL) != SQLITE_OK) {
+            goto fail;
+        }
+    }
+    g_free(path);
+    return obj;
+
+fail:
+    {
+        char  err[1024];
+        snprintf(err, sizeof(err), "failed to open cache %s - %s", path, obj->hdl ? sqlite3_errmsg(obj->hdl) : "<unknown error>");
+        *err_ = strdup(err);
+    }
+    g_free(path);
+    gpod_cache_close(obj);
+    return NULL;
+}
+
+void  gpod_cache_close(struct gpod_cache* obj_)
+{
+    if (obj_ == NULL) {
+        return;
+    }
+
+    for (unsigned i=0; i<GPOD_CACHE_STMT_MAX; ++i) {
+        sqlite3_finalize(obj_->stmt[i]);
+    }
+    if (obj_->hdl) {
+        sqlite3_close(obj_->hdl);
+    }
+    g_mutex_clear(&obj_->lck);
+    free(obj_);
+}
+
+int  gpod_cache_scan(struct gpod_cache* obj_, struct gpod_ff_media_info *info_, const char *file_,
+                     Itdb_IpodGeneration target_, bool fast_, char** err_)
+{
+    struct _key  key;
+    const gint64  then = g_get_monotonic_time();
+    int  ret;
+
+    if (obj_ == NULL || !_key(&key, file_)) {
+        return fast_ ? gpod_ff_scan_fast(info_, file_, target_, err_) : gpod_ff_scan(info_, file_, target_, err_);
+    }
+
+    bool  hit = false;
+    g_mutex_lock(&obj_->lck);
+    {
+        sqlite3_stmt*  stmt = obj_->stmt[GPOD_CACHE_SCAN_GET];
+        if (_get(obj_, stmt, file_, &key) == SQLITE_ROW &&
+            sqlite3_column_int(stmt, 4) == GPOD_CACHE_VERSION &&
+            sqlite3_column_int(stmt, 5) == target_ &&
+            (fast_ || sqlite3_column_int(stmt, 6) == 0) &&
+            _deser(info_, sqlite3_column_blob(stmt, 9), sqlite3_column_bytes(stmt, 9)))
+        {
+            hit = true;
+            ret = sqlite3_column_int(stmt, 7);
+            if (sqlite3_column_type(stmt, 8) != SQLITE_NULL) {
+                *err_ = strdup((const char*)sqlite3_column_text(stmt, 8));
+            }
+
+            const int  n = sqlite3_column_bytes(stmt, 10);
+            if (n > 0 && (info_->artwork.data = (uint8_t*)malloc(n)) ) {
+                memcpy(info_->artwork.data, sqlite3_column_blob(stmt, 10), n);
+                info_->artwork.size = n;
+            }
+            ++obj_->stats.hits;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    g_mutex_unlock(&obj_->lck);
+
+    if (hit) {
+        g_strlcpy(info_->path, file_, sizeof(info_->path));
+        info_->probe_usecs = g_get_monotonic_time() - then;
+        info_->probe_fallback = false;
+        return ret;
+    }
+
+    ret = fast_ ? gpod_ff_scan_fast(info_, file_, target_, err_) : gpod_ff_scan(info_, file_, target_, err_);
+
+    // failures are kept too, non media files are otherwise rescanned every time
+    GByteArray*  buf = _ser(info_);
+    g_mutex_lock(&obj_->lck);
+    {
+        sqlite3_stmt*  stmt = obj_->stmt[GPOD_CACHE_SCAN_PUT];
+        _key_bind(stmt, file_, &key);
+        sqlite3_bind_int(stmt, 6, GPOD_CACHE_VERSION);
+        sqlite3_bind_int(stmt, 7, target_);
+        sqlite3_bind_int(stmt, 8, fast_);
+        sqlite3_bind_int(stmt, 9, ret);
+        if (*err_) {
+            sqlite3_bind_text(stmt, 10, *err_, -1, SQLITE_STATIC);
+        }
+        sqlite3_bind_blob(stmt, 11, buf->data, buf->len, SQLITE_STATIC);
+        if (info_->artwork.data) {
+            sqlite3_bind_blob(stmt, 12, info_->artwork.data, info_->artwork.size, SQLITE_STATIC);
+        }
+        _put(obj_, stmt);
+        ++obj_->stats.misses;
+    }
+    g_mutex_unlock(&obj_->lck);
+    g_byte_array_free(buf, TRUE);
+
+    return ret;
+}
+
+int  gpod_cache_audio_hash(struct gpod_cache* obj_, char** hash_, const char* file_, char** err_)
+{
+    struct _key  key;
+    int  ret;
+
+    if (obj_ == NULL || !_key(&key, file_)) {
+        return gpod_ff_audio_hash(hash_, file_, err_);
+    }
+
+    *hash_ = NULL;
+    g_mutex_lock(&obj_->lck);
+    {
+        sqlite3_stmt*  stmt = obj_->stmt[GPOD_CACHE_AUDIO_HASH_GET];
+        if (_get(obj_, stmt, file_, &key) == SQLITE_ROW && sqlite3_column_type(stmt, 4) != SQLITE_NULL) {
+            *hash_ = strdup((const char*)sqlite3_column_text(stmt, 4));
+            ++obj_->stats.hits;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    g_mutex_unlock(&obj_->lck);
+
+    if (*hash_) {
+        return 0;
+    }
+
+    if ( (ret = gpod_ff_audio_hash(hash_, file_, err_)) != 0 || *hash_ == NULL) {
+        return ret;
+    }
+
+    g_mutex_lock(&obj_->lck);
+    {
+        sqlite3_stmt*  stmt = obj_->stmt[GPOD_CACHE_AUDIO_HASH_PUT];
+        _key_bind(stmt, file_, &key);
+        sqlite3_bind_text(stmt, 6, *hash_, -1, SQLITE_STATIC);
+        _put(obj_, stmt);
+        ++obj_->stats.misses;
+    }
+    g_mutex_unlock(&obj_->lck);
+
+    return ret;
+}
+
+guint  gpod_cache_hash_file(struct gpod_cache* obj_, const char* file_)
+{
+    char*  err = NULL;
+    char*  streamhash = NULL;
+    guint  ret;
+    if ((ret = gpod_cache_audio_hash(obj_, &streamhash, file_, &err)) == 0) {
+        ret = gpod_djbhash(streamhash);
+    }
+    free(streamhash);
+    free(err);
+
+    return ret;
+}
+
+int  gpod_cache_digest_file(struct gpod_cache* obj_, struct gpod_hash_digest* res_, const char* file_)
+{
+    struct _key  key;
+    bool  hit = false;
+    int  ret;
+
+    if (obj_ == NULL || !_key(&key, file_)) {
+        return gpod_hash_digest_file(res_, file_);
+    }
+
+    g_mutex_lock(&obj_->lck);
+    {
+        sqlite3_stmt*  stmt = obj_->stmt[GPOD_CACHE_DIGEST_GET];
+        if (_get(obj_, stmt, file_, &key) == SQLITE_ROW && sqlite3_column_bytes(stmt, 5) == sizeof(res_->digest)-1) {
+            res_->hash = (guint)sqlite3_column_int64(stmt, 4);
+            memcpy(res_->digest, sqlite3_column_text(stmt, 5), sizeof(res_->digest));
+            hit = true;
+            ++obj_->stats.hits;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    g_mutex_unlock(&obj_->lck);
+
+    if (hit) {
+        return 0;
+    }
+
+    if ( (ret = gpod_hash_digest_file(res_, file_)) != 0) {
+        return ret;
+    }
+
+    g_mutex_lock(&obj_->lck);
+    {
+        sqlite3_stmt*  stmt = obj_->stmt[GPOD_CACHE_DIGEST_PUT];
+        _key_bind(stmt, file_, &key);
+        sqlite3_bind_int64(stmt, 6, res_->hash);
+        sqlite3_bind_text(stmt, 7, res_->digest, -1, SQLITE_STATIC);
+        _put(obj_, stmt);
+        ++obj_->stats.misses;
+    }
+    g_mutex_unlock(&obj_->lck);
+
+    return ret;
+}
+
+void  gpod_cache_stats(const struct gpod_cache* obj_, struct gpod_cache_stats* stats_)
+{
+    memset(stats_, 0, sizeof(struct gpod_cache_stats));
+    if (obj_) {
+        *stats_ = obj_->stats;
+    }
+}
+
+#else
+
+struct gpod_cache*  gpod_cache_open(const char* path_, char** err_)
+{
+    *err_ = strdup("cache not available, built without sqlite3");
+    return NULL;
+}
+
+void  gpod_cache_close(struct gpod_cache* obj_)
+{ }
+
+int  gpod_cache_scan(struct gpod_cache* obj_, struct gpod_ff_media_info *info_, const char *file_,
+                     Itdb_IpodGeneration target_, bool fast_, char** err_)
+{
+    return fast_ ? gpod_ff_scan_fast(info_, file_, target_, err_) : gpod_ff_scan(info_, file_, target_, err_);
+}
+
+int  gpod_cache_audio_hash(struct gpod_cache* obj_, char** hash_, const char* file_, char** err_)
+{
+    return gpod_ff_audio_hash(hash_, file_, err_);
+}
+
+guint  gpod_cache_hash_file(struct gpod_cache* obj_, const char* file_)
+{
+    return gpod_hash_file(file_);
+}
+
+int  gpod_cache_digest_file(struct gpod_cache* obj_, struct gpod_hash_digest* res_, const char* file_)
+{
+    return gpod_hash_digest_file(res_, file_);
+}
+
+void  gpod_cache_stats(const struct gpod_cache* obj_, struct gpod_cache_stats* stats_)
+{
+    memset(stats_, 0, sizeof(struct gpod_cache_stats));
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ *  Copyright (C) 2022 Ray <whatdoineed2do @ gmail com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef GPOD_CACHE_H
+#define GPOD_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "gpod-utils.h"
+#include "gpod-ffmpeg.h"
+
+/* persistent cache of the per file probe/hash results, keyed by path and
+ * only valid whilst the file's (device, inode, size, mtime) are unchanged so
+ * repeat runs over the same files only need to stat them
+ *
+ * requires sqlite3, otherwise opening the cache fails; all the functions
+ * accept a NULL cache and go directly to the file
+ *
+ * thread safe, one cache can be shared by all threads
+ */
+struct gpod_cache;
+
+// NULL path_ for the default, $XDG_CACHE_HOME/gpod-utils/probe.db
+struct gpod_cache*  gpod_cache_open(const char* path_, char** err_);
+void  gpod_cache_close(struct gpod_cache* obj_);
+
+// gpod_ff_scan()/gpod_ff_scan_fast() via the cache; a cached full scan also
+// serves a fast request but not the other way round
+int  gpod_cache_scan(struct gpod_cache* obj_, struct gpod_ff_media_info *info_, const char *file_,
+                     Itdb_IpodGeneration target_, bool fast_, char** err_);
+
+// gpod_ff_audio_hash() via the cache
+int  gpod_cache_audio_hash(struct gpod_cache* obj_, char** hash_, const char* file_, char** err_);
+
+// gpod_hash_file() via the cache
+guint  gpod_cache_hash_file(struct gpod_cache* obj_, const char* file_);
+
+// gpod_hash_digest_file() via the cache
+int  gpod_cache_digest_file(struct gpod_cache* obj_, struct gpod_hash_digest* res_, const char* file_);
+
+struct gpod_cache_stats {
+    unsigned  hits;
+    unsigned  misses;
+};
+void  gpod_cache_stats(const struct gpod_cache* obj_, struct gpod_cache_stats* stats_);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ *  Copyright (C) 2022 Ray <whatdoineed2do @ gmail com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+/* EBU R128 / ITU-R BS.1770 integrated loudness: K-weighted mean square over
+ * 400ms blocks (75% overlap) with the absolute -70 LUFS and relative -10 LU
+ * gates.  Fed with decoded frames so it can ride along any decode loop.
+ */
+
+#include "gpod-ffmpeg.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <glib.h>
+
+#define GPOD_FF_LOUDNESS_ABS_GATE  -70.0
+#define GPOD_FF_LOUDNESS_REL_GATE  -10.0
+
+// ReplayGain 2.0 reference level that soundcheck adjusts towards
+#define GPOD_FF_LOUDNESS_REFERENCE  -18.0
+
+struct _biquad {
+    double  b[3];
+    double  a[3];
+};
+
+struct gpod_ff_loudness {
+    unsigned  rate;
+    unsigned  channels;
+
+    struct _biquad  pre;  // high shelf, head effects
+    struct _biquad  rlb;  // high pass
+    double*  state;       // per channel, 2 per biquad
+    double*  weight;      // per channel
+
+    unsigned  sub_len;    // samples in a 100ms sub block
+    unsigned  sub_n;      // samples in the current sub block
+    double  sub_sum;
+    double  subs[4];      // last 4 sub blocks make a 400ms block
+    unsigned  nsubs;
+
+    GArray*  blocks;      // mean square of each block
+};
+
+
+static void  _filters(struct gpod_ff_loudness* obj_)
+{
+    const double  rate = obj_->rate;
+
+    /* coefficients derived for the sample rate as per libebur128, the
+     * BS.1770 tables only cover 48kHz */
+    double  f0 = 1681.974450955533;
+    double  G  = 3.999843853973347;
+    double  Q  = 0.7071752369554196;
+
+    double  K  = tan(M_PI * f0 / rate);
+    double  Vh = pow(10.0, G / 20.0);
+    double  Vb = pow(Vh, 0.4996667741545416);
+    double  a0 = 1.0 + K / Q + K * K;
+
+    obj_->pre.b[0] = (Vh + Vb * K / Q + K * K) / a0;
+    obj_->pre.b[1] =  2.0 * (K * K -  Vh) / a0;
+    obj_->pre.b[2] = (Vh - Vb * K / Q + K * K) / a0;
+    obj_->pre.a[0] = 1.0;
+    obj_->pre.a[1] =  2.0 * (K * K - 1.0) / a0;
+    obj_->pre.a[2] = (1.0 - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444;
+    Q  = 0.5003270373238773;
+    K  = tan(M_PI * f0 / rate);
+
+    obj_->rlb.b[0] =  1.0;
+    obj_->rlb.b[1] = -2.0;
+    obj_->rlb.b[2] =  1.0;
+    obj_->rlb.a[0] = 1.0;
+    obj_->rlb.a[1] = 2.0 * (K * K - 1.0) / (1.0 + K / Q + K * K);
+    obj_->rlb.a[2] = (1.0 - K / Q + K * K) / (1.0 + K / Q + K * K);
+}
+
+/* LFE is ignored and the surrounds (side, back or top back) boosted, anything
+ * unidentified in the layout is weighted as a front channel */
+#define GPOD_FF_LOUDNESS_SURROUNDS  (AV_CH_BACK_LEFT | AV_CH_BACK_CENTER | AV_CH_BACK_RIGHT | \
+                                     AV_CH_TOP_BACK_LEFT | AV_CH_TOP_BACK_CENTER | AV_CH_TOP_BACK_RIGHT | \
+                                     AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT | \
+                                     AV_CH_SURROUND_DIRECT_LEFT | AV_CH_SURROUND_DIRECT_RIGHT)
+
+static double  _weight(const AVCodecContext* ctx_, unsigned c_)
+{
+#ifdef HAVE_FF5_CH_LAYOUT
+    const enum AVChannel  ch = av_channel_layout_channel_from_index(&ctx_->ch_layout, c_);
+    const uint64_t  mask = ch >= 0 && ch < 64 ? 1ULL << ch : 0;
+#else
+    const uint64_t  mask = ctx_->channel_layout ? av_channel_layout_extract_channel(ctx_->channel_layout, c_) : 0;
+#endif
+
+    if (mask & (AV_CH_LOW_FREQUENCY | AV_CH_LOW_FREQUENCY_2))
+        return 0.0;
+    if (mask & GPOD_FF_LOUDNESS_SURROUNDS)
+        return 1.41;
+    return 1.0;
+}
+
+struct gpod_ff_loudness*  gpod_ff_loudness_new(const AVCodecContext* ctx_)
+{
+#ifdef HAVE_FF5_CH_LAYOUT
+    const unsigned  channels = ctx_->ch_layout.nb_channels;
+#else
+    const unsigned  channels = ctx_->channels;
+#endif
+    const unsigned  rate = ctx_->sample_rate;
+
+    if (rate == 0 || channels == 0) {
+        return NULL;
+    }
+
+    struct gpod_ff_loudness*  obj = (struct gpod_ff_loudness*)calloc(1, sizeof(struct gpod_ff_loudness));
+    if (obj == NULL) {
+        return NULL;
+    }
+    obj->rate = rate;
+    obj->channels = channels;
+    obj->sub_len = rate / 10;
+    obj->state = (double*)calloc(4*channels, sizeof(double));
+    obj->weight = (double*)calloc(channels, sizeof(double));
+    obj->blocks = g_array_new(FALSE, FALSE, sizeof(double));
+
+    if (obj->state == NULL || obj->weight == NULL) {
+        gpod_ff_loudness_free(obj);
+        return NULL;
+    }
+
+    for (unsigned c=0; c<channels; ++c) {
+        obj->weight[c] = _weight(ctx_, c);
+    }
+
+    _filters(obj);
+    return obj;
+}
+
+void  gpod_ff_loudness_free(struct gpod_ff_loudness* obj_)
+{
+    if (obj_ == NULL) {
+        return;
+    }
+    free(obj_->state);
+    free(obj_->weight);
+    if (obj_->blocks) {
+        g_array_free(obj_->blocks, TRUE);
+    }
+    free(obj_);
+}
+
+static inline double  _biquad(const struct _biquad* f_, double* s_, double x_)
+{
+    // direct form II transposed
+    const double  y = f_->b[0]*x_ + s_[0];
+    s_[0] = f_->b[1]*x_ - f_->a[1]*y + s_[1];
+    s_[1] = f_->b[2]*x_ - f_->a[2]*y;
+    return y;
+}
+
+static inline double  _sample(const AVFrame* frame_, enum AVSampleFormat fmt_, bool planar_,
+                              unsigned channels_, unsigned c_, int i_)
+{
+    const uint8_t*  p = planar_ ? frame_->extended_data[c_] : frame_->extended_data[0];
+    const int  j = planar_ ? i_ : i_*channels_ + c_;
+
+    switch (fmt_)
+    {
+        case AV_SAMPLE_FMT_U8:   return (((const uint8_t*)p)[j] - 128) / 128.0;
+        case AV_SAMPLE_FMT_S16:  return ((const int16_t*)p)[j] / 32768.0;
+        case AV_SAMPLE_FMT_S32:  return ((const int32_t*)p)[j] / 2147483648.0;
+        case AV_SAMPLE_FMT_S64:  return ((const int64_t*)p)[j] / 9223372036854775808.0;
+        case AV_SAMPLE_FMT_FLT:  return ((const float*)p)[j];
+        case AV_SAMPLE_FMT_DBL:  return ((const double*)p)[j];
+        default:                 return 0;
+    }
+}
+
+void  gpod_ff_loudness_add(struct gpod_ff_loudness* obj_, const AVFrame* frame_, int offset_, int nb_samples_)
+{
+    if (obj_ == NULL || frame_ == NULL || nb_samples_ <= 0) {
+        return;
+    }
+
+    const bool  planar = av_sample_fmt_is_planar(frame_->format);
+    const enum AVSampleFormat  fmt = av_get_packed_sample_fmt(frame_->format);
+
+    for (int i=offset_; i<offset_+nb_samples_; ++i)
+    {
+        double  e = 0;
+        for (unsigned c=0; c<obj_->channels; ++c)
+        {
+            double*  s = obj_->state + 4*c;
+            double  y = _sample(frame_, fmt, planar, obj_->channels, c, i);
+
+            y = _biquad(&obj_->pre, s, y);
+            y = _biquad(&obj_->rlb, s+2, y);
+            e += obj_->weight[c] * y*y;
+        }
+        obj_->sub_sum += e;
+
+        if (++obj_->sub_n < obj_->sub_len)
+            continue;
+
+        memmove(obj_->subs, obj_->subs+1, 3*sizeof(double));
+        obj_->subs[3] = obj_->sub_sum;
+        obj_->sub_sum = 0;
+        obj_->sub_n = 0;
+
+        if (++obj_->nsubs >= 4) {
+            const double  z = (obj_->subs[0] + obj_->subs[1] + obj_->subs[2] + obj_->subs[3]) / (4.0*obj_->sub_len);
+            g_array_append_val(obj_->blocks, z);
+        }
+    }
+}
+
+/* the parts' blocks are simply concatenated: the up to 3 overlapping blocks
+ * that would straddle each boundary are never formed, an approximation that
+ * is immaterial for parts that are minutes long
+ */
+void  gpod_ff_loudness_merge(struct gpod_ff_loudness* obj_, const struct gpod_ff_loudness* from_)
+{
+    if (obj_ == NULL || from_ == NULL) {
+        return;
+    }
+    g_array_append_vals(obj_->blocks, from_->blocks->data, from_->blocks->len);
+}
+
+static double  _lufs(double z_)
+{
+    return -0.691 + 10.0*log10(z_);
+}
+
+bool  gpod_ff_loudness_lufs(const struct gpod_ff_loudness* obj_, double* lufs_)
+{
+    if (obj_ == NULL || obj_->blocks->len == 0) {
+        return false;
+    }
+
+    const double*  z = (const double*)obj_->blocks->data;
+    const double  abs_gate = pow(10.0, (GPOD_FF_LOUDNESS_ABS_GATE + 0.691)/10.0);
+    double  sum = 0;
+    unsigned  n = 0;
+
+    for (unsigned i=0; i<obj_->blocks->len; ++i) {
+        if (z[i] > abs_gate) {
+            sum += z[i];
+            ++n;
+        }
+    }
+    if (n == 0) {
+        return false;
+    }
+
+    const double  rel_gate = pow(10.0, (_lufs(sum/n) + GPOD_FF_LOUDNESS_REL_GATE + 0.691)/10.0);
+    const double  gate = FFMAX(abs_gate, rel_gate);
+    sum = 0;
+    n = 0;
+    for (unsigned i=0; i<obj_->blocks->len; ++i) {
+        if (z[i] > gate) {
+            sum += z[i];
+            ++n;
+        }
+    }
+    if (n == 0) {
+        return false;
+    }
+
+    *lufs_ = _lufs(sum/n);
+    return true;
+}
+
+uint32_t  gpod_ff_soundcheck(double lufs_)
+{
+    // X = 1000 * 10^(-gain/10), gain being the dB adjustment to the reference
+    const double  x = 1000.0 * pow(10.0, (lufs_ - GPOD_FF_LOUDNESS_REFERENCE)/10.0);
+    if (x < 1.0)
+        return 1;
+    if (x > (double)UINT32_MAX)
+        return UINT32_MAX;
+    return (uint32_t)lround(x);
+}
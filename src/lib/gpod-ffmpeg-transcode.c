@@ -53,6 +53,9 @@
 #include <libavutil/dict.h>
 
 #include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+
+#include <glib.h>
 
 #define GPOD_MAX_SAMPLERATE  48000
 #define GPOD_PREF_SAMPLERATE 44100
@@ -63,11 +66,14 @@
  * @param      filename             File to be opened
  * @param[out] input_format_context Format context of opened file
  * @param[out] input_codec_context  Codec context of opened file
+ * @param      threads_             Decoder threads, no-op for decoders without
+ *                                  thread support
  * @return Error code (0 if successful)
  */
 static int open_input_file(const char *filename,
                            AVFormatContext **input_format_context,
-                           AVCodecContext **input_codec_context, int* audio_stream_idx, char** err_)
+                           AVCodecContext **input_codec_context, int* audio_stream_idx,
+                           unsigned threads_, char** err_)
 {
     AVCodecContext *avctx;
 #if LIBAVFORMAT_VERSION_MAJOR > 58
@@ -130,6 +136,10 @@ static int open_input_file(const char *filename,
         return error;
     }
 
+    /* flac/ape/wavpack/hi-res pcm can decode frames concurrently */
+    avctx->thread_count = FFMAX(threads_, 1);
+    avctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
     /* Open the decoder for the audio stream to use it later. */
     if ((error = avcodec_open2(avctx, input_codec, NULL)) < 0) {
         char  err[1024];
@@ -194,118 +204,183 @@ static unsigned  _select_samplerate(const struct AVCodec* output_codec_, unsigne
     return sr;
 }
 
-/**
- * Open an output file and the required encoder.
- * Also set some basic encoder parameters.
- * Some of these parameters are based on the input file's parameters.
- * @param      filename              File to be opened
- * @param      input_codec_context   Codec context of input file
- * @param[out] output_format_context Format context of output file
- * @param[out] output_codec_context  Codec context of output file
- * @return Error code (0 if successful)
+/* prefer the decoder's sample format if the encoder accepts it, saving a
+ * conversion
  */
-static int open_output_file(struct gpod_ff_transcode_ctx* target_,
-                            AVCodecContext *input_codec_context,
-                            AVFormatContext **output_format_context,
-                            AVCodecContext **output_codec_context, char** err_)
+static enum AVSampleFormat _select_samplefmt(const struct AVCodec* output_codec_, enum AVSampleFormat input_samplefmt_)
 {
-    AVCodecContext *avctx          = NULL;
-    AVIOContext *output_io_context = NULL;
-    AVStream *stream               = NULL;
-    const AVCodec *output_codec    = NULL;
-    int error;
-    const char*  filename = target_->path;
-
-    /* Find the encoder to be used by its name. */
-    if (target_->audio_opts.enc_name == NULL) {
-	*err_ = strdup("encoder not specified");
-	return AVERROR_ENCODER_NOT_FOUND;
+    const enum AVSampleFormat*  p = output_codec_->sample_fmts;
+    while (p && *p != AV_SAMPLE_FMT_NONE) {
+	if (*p == input_samplefmt_) {
+	    return input_samplefmt_;
+	}
+	++p;
     }
+    return output_codec_->sample_fmts[0];
+}
 
-    if ( (output_codec = avcodec_find_encoder_by_name(target_->audio_opts.enc_name)) == NULL) {
-	char  err[256];
-	snprintf(err, 256,"Could not find encoder %s.", target_->audio_opts.enc_name);
-	*err_ = strdup(err);
-	return AVERROR_ENCODER_NOT_FOUND;
-    }
+#ifdef HAVE_FF5_CH_LAYOUT
+#define GPOD_FF_CTX_CHANNELS(ctx_)  ((ctx_)->ch_layout.nb_channels)
+#define GPOD_FF_CTX_LAYOUT(ctx_)    ((ctx_)->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? (ctx_)->ch_layout.u.mask : 0)
+#else
+#define GPOD_FF_CTX_CHANNELS(ctx_)  ((ctx_)->channels)
+#define GPOD_FF_CTX_LAYOUT(ctx_)    ((ctx_)->channel_layout)
+#endif
 
-    /* Open the output file to write to it. */
-    if ((error = avio_open(&output_io_context, filename,
-                           AVIO_FLAG_WRITE)) < 0) {
-        char  err[1024];
-        snprintf(err, 1024,"Could not open output file '%s' (error '%s')",
-                filename, av_err2str(error));
-            *err_ = strdup(err);
-        return error;
-    }
+/* the params an encoder/resampler/fifo were opened with - these are memcmp'd
+ * to determine if the session's instance can be reused so always memset
+ */
+struct _enc_cfg {
+    const AVCodec*  codec;
+    int  channels;
+    int  sample_rate;
+    enum AVSampleFormat  sample_fmt;
+    int  quality;
+    float  quality_scale_factor;
+    bool  global_header;
+    bool  segmented;  // output packets will be stitched with other encoders'
+    unsigned  threads;
+};
+
+struct _swr_cfg {
+    int  in_rate;
+    int  out_rate;
+    enum AVSampleFormat  in_fmt;
+    enum AVSampleFormat  out_fmt;
+    int  in_channels;
+    int  out_channels;
+    uint64_t  in_layout;
+    uint64_t  out_layout;
+    enum gpod_ff_resampler  engine;
+    enum gpod_ff_resample_precision  precision;
+};
+
+struct _fifo_cfg {
+    enum AVSampleFormat  fmt;
+    int  channels;
+};
+
+/* samples staged between fifo/resampler, kept at the largest size needed so
+ * far rather than allocated for each frame
+ */
+struct _scratch {
+    uint8_t**  data;
+    int  capacity;
+    struct _fifo_cfg  cfg;
+};
 
-    /* Create a new format context for the output container format. */
-    if (!(*output_format_context = avformat_alloc_context())) {
-        char  err[1024];
-        snprintf(err, 1024,"Could not allocate output format context");
-            *err_ = strdup(err);
-        return AVERROR(ENOMEM);
-    }
+// initial fifo/scratch size in samples, enough for most codecs' frames
+#define GPOD_FF_XCODE_MIN_SAMPLES  8192
 
-    /* Associate the output file (pointer) with the container format context. */
-    (*output_format_context)->pb = output_io_context;
+struct gpod_ff_transcode_session {
+    const AVCodec*  codec;
+    const char*  codec_name;
 
-    /* Guess the desired container format based on the file extension. */
-    if (!((*output_format_context)->oformat = av_guess_format(NULL, filename,
-                                                              NULL))) {
-        char  err[1024];
-        snprintf(err, 1024,"Could not find output file format");
-            *err_ = strdup(err);
-        goto cleanup;
+    AVCodecContext*  enc;
+    struct _enc_cfg  enc_cfg;
+    bool  enc_used;  // needs flush/reopen before next file
+
+    SwrContext*  swr;
+    struct _swr_cfg  swr_cfg;
+
+    AVAudioFifo*  fifo;
+    struct _fifo_cfg  fifo_cfg;
+
+    struct _scratch  out_scratch;  // output fmt, resampler output
+    AVFrame*  resampled_frame;     // output fmt, sample rate converted
+
+    unsigned  allocs;  // sample buffer (re)allocations for the current file
+    struct gpod_ff_loudness*  loudness;  // current file's meter, not owned
+
+    AVFrame*  input_frame;
+    AVFrame*  output_frame;
+    AVPacket*  input_packet;
+    AVPacket*  output_packet;
+};
+
+/**
+ * Reset a used encoder so it can accept a new stream.
+ * @param enc Encoder context that has previously been drained
+ * @return true if the encoder could be reset, false if it must be reopened
+ */
+static bool  _session_enc_reset(AVCodecContext* enc)
+{
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+    if (enc->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH) {
+        avcodec_flush_buffers(enc);
+        return true;
     }
+#endif
+    return false;
+}
 
-    if (!((*output_format_context)->url = av_strdup(filename))) {
-        char  err[1024];
-        snprintf(err, 1024,"Could not allocate url.");
-            *err_ = strdup(err);
-        error = AVERROR(ENOMEM);
-        goto cleanup;
+/**
+ * Drop the session's encoder at the end of a file unless it can be flushed:
+ * the others (libmp3lame, libfdk_aac) are reopened for every file regardless
+ * so there's no point holding them between files.
+ * @param session Session owning the encoder
+ */
+static void  _session_enc_release(struct gpod_ff_transcode_session* session)
+{
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+    if (session->enc && (session->enc->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)) {
+        return;
     }
+#endif
+    avcodec_free_context(&session->enc);
+}
 
-    /* Create a new audio stream in the output file container. */
-    if (!(stream = avformat_new_stream(*output_format_context, NULL))) {
-        char  err[1024];
-        snprintf(err, 1024,"Could not create new stream");
-            *err_ = strdup(err);
-        error = AVERROR(ENOMEM);
-        goto cleanup;
+/**
+ * Provide an opened encoder for the requested config, reusing the session's
+ * encoder if the config is unchanged.
+ * @param session Session owning the encoder
+ * @param cfg     Required encoder parameters
+ * @return Error code (0 if successful)
+ */
+static int _session_encoder(struct gpod_ff_transcode_session* session,
+                            const struct _enc_cfg* cfg, char** err_)
+{
+    AVCodecContext *avctx;
+    AVDictionary*  opts = NULL;
+    int error;
+
+    if (session->enc) {
+        if (memcmp(cfg, &session->enc_cfg, sizeof(struct _enc_cfg)) == 0 &&
+            (!session->enc_used || _session_enc_reset(session->enc)) ) {
+            session->enc_used = true;
+            return 0;
+        }
+        avcodec_free_context(&session->enc);
     }
 
-    avctx = avcodec_alloc_context3(output_codec);
+    avctx = avcodec_alloc_context3(cfg->codec);
     if (!avctx) {
         char  err[1024];
         snprintf(err, 1024,"Could not allocate an encoding context");
             *err_ = strdup(err);
-        error = AVERROR(ENOMEM);
-        goto cleanup;
+        return AVERROR(ENOMEM);
     }
 
     /* Set the basic encoder parameters.
      * validate the sample rate is not higher than max supported / setup for resample
      */
 #ifdef HAVE_FF5_CH_LAYOUT
-    av_channel_layout_default(&avctx->ch_layout, target_->audio_opts.channels);
+    av_channel_layout_default(&avctx->ch_layout, cfg->channels);
 #else
-    avctx->channels       = target_->audio_opts.channels;
+    avctx->channels       = cfg->channels;
     avctx->channel_layout = av_get_default_channel_layout(avctx->channels);
 #endif
-    avctx->sample_rate    = _select_samplerate(output_codec, target_->audio_opts.samplerate ? target_->audio_opts.samplerate : input_codec_context->sample_rate);
-    avctx->sample_fmt     = target_->audio_opts.samplefmt == AV_SAMPLE_FMT_NONE ? output_codec->sample_fmts[0] : target_->audio_opts.samplefmt;
-    const int  quality = (int)(target_->audio_opts.quality);
-    if (quality != GPOD_FF_XCODE_MAX)
+    avctx->sample_rate    = cfg->sample_rate;
+    avctx->sample_fmt     = cfg->sample_fmt;
+    if (cfg->quality != GPOD_FF_XCODE_MAX)
     {
-	if (quality > GPOD_FF_XCODE_VBR_MAX) {
-	    avctx->bit_rate = quality;
+	if (cfg->quality > GPOD_FF_XCODE_VBR_MAX) {
+	    avctx->bit_rate = cfg->quality;
 	}
 	else {
 	    // vbr
 	    avctx->flags         |= AV_CODEC_FLAG_QSCALE;
-	    avctx->global_quality = quality * target_->audio_opts.quality_scale_factor;
+	    avctx->global_quality = cfg->quality * cfg->quality_scale_factor;
 	}
     }
 
@@ -314,13 +389,9 @@ static int open_output_file(struct gpod_ff_transcode_ctx* target_,
     avctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
 #endif
 
-    /* Set the sample rate for the container. */
-    stream->time_base.den = avctx->sample_rate;
-    stream->time_base.num = 1;
-
     /* Some container formats (like MP4) require global headers to be present.
      * Mark the encoder so that it behaves accordingly. */
-    if ((*output_format_context)->oformat->flags & AVFMT_GLOBALHEADER)
+    if (cfg->global_header)
         avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
 #ifdef GPOD_XCODE_DEBUG
@@ -329,16 +400,192 @@ static int open_output_file(struct gpod_ff_transcode_ctx* target_,
 	   avctx->channels, avctx->channel_layout, avctx->bit_rate, avctx->flags, avctx->global_quality, avctx->compression_level, avctx->codec_tag, avctx->sample_rate, avctx->qcompress, avctx->request_channel_layout, avctx->request_sample_fmt);
 #endif
 
+    avctx->thread_count = FFMAX(cfg->threads, 1);
+    avctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    /* mp3 frames can borrow bits from previous frames which would not be
+     * there once packets from different encoders are stitched together */
+    if (cfg->segmented) {
+        av_dict_set(&opts, "reservoir", "0", 0);
+    }
+
     /* Open the encoder for the audio stream to use it later. */
-    if ((error = avcodec_open2(avctx, output_codec, NULL)) < 0) {
+    error = avcodec_open2(avctx, cfg->codec, &opts);
+    av_dict_free(&opts);
+    if (error < 0) {
         char  err[1024];
         snprintf(err, 1024,"Could not open output codec (error '%s')",
                 av_err2str(error));
             *err_ = strdup(err);
+        avcodec_free_context(&avctx);
+        return error;
+    }
+
+    session->enc = avctx;
+    session->enc_cfg = *cfg;
+    session->enc_used = true;
+    return 0;
+}
+
+/**
+ * Find the target's encoder, caching the lookup in the session.
+ * @return Error code (0 if successful)
+ */
+static int _session_codec(const struct gpod_ff_transcode_ctx* target_,
+                          struct gpod_ff_transcode_session* session, char** err_)
+{
+    /* Find the encoder to be used by its name. */
+    if (target_->audio_opts.enc_name == NULL) {
+	*err_ = strdup("encoder not specified");
+	return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    if (session->codec == NULL || strcmp(session->codec_name, target_->audio_opts.enc_name) != 0) {
+	if ( (session->codec = avcodec_find_encoder_by_name(target_->audio_opts.enc_name)) == NULL) {
+	    char  err[256];
+	    snprintf(err, 256,"Could not find encoder %s.", target_->audio_opts.enc_name);
+	    *err_ = strdup(err);
+	    return AVERROR_ENCODER_NOT_FOUND;
+	}
+	session->codec_name = target_->audio_opts.enc_name;
+    }
+    return 0;
+}
+
+/* share of the thread budget for the encoder - half if it threads internally
+ * (few audio encoders do), the remainder going to the decoder
+ */
+static unsigned _enc_threads(const AVCodec* codec_, unsigned threads_)
+{
+    return codec_->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS) ?
+               FFMAX(threads_/2, 1) : 1;
+}
+
+static unsigned _dec_threads(const AVCodec* codec_, unsigned threads_)
+{
+    const unsigned  enc = _enc_threads(codec_, threads_);
+    return enc > 1 ? FFMAX(threads_ - enc, 1) : FFMAX(threads_, 1);
+}
+
+// input duration (usecs) over the time taken to transcode it
+static double _realtime(int64_t duration_, gint64 then_)
+{
+    const gint64  elapsed = g_get_monotonic_time() - then_;
+    return duration_ > 0 && elapsed > 0 ? duration_/(double)elapsed : 0;
+}
+
+/**
+ * Determine the encoder parameters for the target, caching the encoder
+ * lookup in the session.
+ * @param      target_             Output file and encoding options
+ * @param      session             Session caching the encoder lookup
+ * @param      input_codec_context Codec context of input file
+ * @param      output_format       Container format of the output file
+ * @param[out] cfg_                Encoder parameters
+ * @return Error code (0 if successful)
+ */
+static int _output_enc_cfg(const struct gpod_ff_transcode_ctx* target_,
+                           struct gpod_ff_transcode_session* session,
+                           AVCodecContext *input_codec_context,
+#if LIBAVFORMAT_VERSION_MAJOR > 58
+                           const
+#endif
+                           AVOutputFormat *output_format,
+                           struct _enc_cfg* cfg_, char** err_)
+{
+    int  error;
+
+    if ((error = _session_codec(target_, session, err_)) < 0) {
+        return error;
+    }
+
+    memset(cfg_, 0, sizeof(struct _enc_cfg));
+    cfg_->codec = session->codec;
+    cfg_->channels = target_->audio_opts.channels;
+    cfg_->sample_rate = _select_samplerate(session->codec, target_->audio_opts.samplerate ? target_->audio_opts.samplerate : input_codec_context->sample_rate);
+    cfg_->sample_fmt = target_->audio_opts.samplefmt == AV_SAMPLE_FMT_NONE ?
+                           _select_samplefmt(session->codec, input_codec_context->sample_fmt) : target_->audio_opts.samplefmt;
+    cfg_->quality = (int)(target_->audio_opts.quality);
+    cfg_->quality_scale_factor = target_->audio_opts.quality_scale_factor;
+    cfg_->global_header = output_format->flags & AVFMT_GLOBALHEADER;
+    cfg_->threads = _enc_threads(session->codec, target_->threads);
+
+    return 0;
+}
+
+/**
+ * Open an output file with a single audio stream, described either by the
+ * encoder or, when stream copying, the input stream's parameters.
+ * @param      filename              File to be opened
+ * @param      output_format         Container format of the output file
+ * @param      enc                   Opened encoder for the audio stream or NULL
+ * @param      par                   Input stream parameters if enc is NULL
+ * @param[out] output_format_context Format context of output file
+ * @return Error code (0 if successful)
+ */
+static int _output_open(const char* filename,
+#if LIBAVFORMAT_VERSION_MAJOR > 58
+                        const
+#endif
+                        AVOutputFormat *output_format,
+                        AVCodecContext* enc, const AVCodecParameters* par,
+                        AVFormatContext **output_format_context, char** err_)
+{
+    AVIOContext *output_io_context = NULL;
+    AVStream *stream               = NULL;
+    int error;
+
+    /* Open the output file to write to it. */
+    if ((error = avio_open(&output_io_context, filename,
+                           AVIO_FLAG_WRITE)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not open output file '%s' (error '%s')",
+                filename, av_err2str(error));
+            *err_ = strdup(err);
+        return error;
+    }
+
+    /* Create a new format context for the output container format. */
+    if (!(*output_format_context = avformat_alloc_context())) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not allocate output format context");
+            *err_ = strdup(err);
+        avio_closep(&output_io_context);
+        return AVERROR(ENOMEM);
+    }
+
+    /* Associate the output file (pointer) with the container format context. */
+    (*output_format_context)->pb = output_io_context;
+    (*output_format_context)->oformat = output_format;
+
+    if (!((*output_format_context)->url = av_strdup(filename))) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not allocate url.");
+            *err_ = strdup(err);
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    /* Create a new audio stream in the output file container. */
+    if (!(stream = avformat_new_stream(*output_format_context, NULL))) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not create new stream");
+            *err_ = strdup(err);
+        error = AVERROR(ENOMEM);
         goto cleanup;
     }
 
-    error = avcodec_parameters_from_context(stream->codecpar, avctx);
+    /* Set the sample rate for the container. */
+    stream->time_base.den = enc ? enc->sample_rate : par->sample_rate;
+    stream->time_base.num = 1;
+
+    if (enc) {
+        error = avcodec_parameters_from_context(stream->codecpar, enc);
+    }
+    else if ( (error = avcodec_parameters_copy(stream->codecpar, par)) >= 0) {
+        // let the muxer pick the tag valid for its container
+        stream->codecpar->codec_tag = 0;
+    }
     if (error < 0) {
         char  err[1024];
         snprintf(err, 1024,"Could not initialize stream parameters");
@@ -346,13 +593,9 @@ static int open_output_file(struct gpod_ff_transcode_ctx* target_,
         goto cleanup;
     }
 
-    /* Save the encoder context for easier access later. */
-    *output_codec_context = avctx;
-
     return 0;
 
 cleanup:
-    avcodec_free_context(&avctx);
     avio_closep(&(*output_format_context)->pb);
     avformat_free_context(*output_format_context);
     *output_format_context = NULL;
@@ -360,35 +603,86 @@ cleanup:
 }
 
 /**
- * Initialize one data packet for reading or writing.
- * @param[out] packet Packet to be initialized
+ * Open an output file and obtain the required encoder from the session.
+ * Also set some basic encoder parameters.
+ * Some of these parameters are based on the input file's parameters.
+ * @param      target_               Output file and encoding options
+ * @param      session               Session providing the (reusable) encoder
+ * @param      input_codec_context   Codec context of input file
+ * @param[out] output_format_context Format context of output file
+ * @param[out] output_codec_context  Codec context of output file, owned by the session
  * @return Error code (0 if successful)
  */
-static int init_packet(AVPacket **packet, char** err_)
+static int open_output_file(struct gpod_ff_transcode_ctx* target_,
+                            struct gpod_ff_transcode_session* session,
+                            AVCodecContext *input_codec_context,
+                            AVFormatContext **output_format_context,
+                            AVCodecContext **output_codec_context, char** err_)
 {
-    if (!(*packet = av_packet_alloc())) {
+#if LIBAVFORMAT_VERSION_MAJOR > 58
+    const
+#endif
+    AVOutputFormat *output_format  = NULL;
+    struct _enc_cfg  cfg;
+    int error;
+
+    /* Guess the desired container format based on the file extension. */
+    if (!(output_format = av_guess_format(NULL, target_->path, NULL))) {
         char  err[1024];
-        snprintf(err, 1024,"Could not allocate packet");
+        snprintf(err, 1024,"Could not find output file format");
             *err_ = strdup(err);
-        return AVERROR(ENOMEM);
+        return AVERROR_EXIT;
+    }
+
+    if ((error = _output_enc_cfg(target_, session, input_codec_context, output_format, &cfg, err_)) < 0) {
+        return error;
+    }
+
+    if ((error = _session_encoder(session, &cfg, err_)) < 0) {
+        return error;
+    }
+
+    if ((error = _output_open(target_->path, output_format, session->enc, NULL, output_format_context, err_)) < 0) {
+        return error;
     }
+
+    /* Save the encoder context for easier access later. */
+    *output_codec_context = session->enc;
+
     return 0;
 }
 
 /**
- * Initialize one audio frame for reading from the input file.
- * @param[out] frame Frame to be initialized
- * @return Error code (0 if successful)
+ * Select the resampling engine and its filter precision.  The swr presets
+ * trade filter length/phase count, soxr its precision in bits (default 20).
  */
-static int init_input_frame(AVFrame **frame, char** err_)
+static void _resampler_opts(SwrContext* swr_, enum gpod_ff_resampler engine_, enum gpod_ff_resample_precision precision_)
 {
-    if (!(*frame = av_frame_alloc())) {
-        char  err[1024];
-        snprintf(err, 1024,"Could not allocate input frame");
-            *err_ = strdup(err);
-        return AVERROR(ENOMEM);
+    if (engine_ == GPOD_FF_RESAMPLE_SOXR) {
+        av_opt_set_int(swr_, "resampler", SWR_ENGINE_SOXR, 0);
+        switch (precision_) {
+            case GPOD_FF_RESAMPLE_FAST:  av_opt_set_double(swr_, "precision", 16, 0);  break;
+            case GPOD_FF_RESAMPLE_HIGH:  av_opt_set_double(swr_, "precision", 28, 0);  break;
+            default:  break;
+        }
+        return;
+    }
+
+    switch (precision_) {
+        case GPOD_FF_RESAMPLE_FAST:
+            av_opt_set_int(swr_, "filter_size", 16, 0);
+            av_opt_set_int(swr_, "phase_shift", 8, 0);
+            break;
+
+        case GPOD_FF_RESAMPLE_HIGH:
+            av_opt_set_int(swr_, "filter_size", 64, 0);
+            av_opt_set_int(swr_, "phase_shift", 14, 0);
+            av_opt_set_int(swr_, "linear_interp", 1, 0);
+            break;
+
+        default:
+            break;
     }
-    return 0;
 }
 
 /**
@@ -397,11 +691,14 @@ static int init_input_frame(AVFrame **frame, char** err_)
  * libswresample takes care of this, but requires initialization.
  * @param      input_codec_context  Codec context of the input file
  * @param      output_codec_context Codec context of the output file
+ * @param      engine_              Resampling engine
+ * @param      precision_           Resampling filter precision preset
  * @param[out] resample_context     Resample context for the required conversion
  * @return Error code (0 if successful)
  */
 static int init_resampler(AVCodecContext *input_codec_context,
                           AVCodecContext *output_codec_context,
+                          enum gpod_ff_resampler engine_, enum gpod_ff_resample_precision precision_,
                           SwrContext **resample_context, char** err_)
 {
         int error;
@@ -446,10 +743,13 @@ static int init_resampler(AVCodecContext *input_codec_context,
         }
 #endif
 
+        _resampler_opts(*resample_context, engine_, precision_);
+
         /* Open the resampler with the specified parameters. */
         if ((error = swr_init(*resample_context)) < 0) {
             char  err[1024];
-            snprintf(err, 1024,"Could not open resample context\n");
+            snprintf(err, 1024,"Could not open %s resample context (error '%s')",
+                     engine_ == GPOD_FF_RESAMPLE_SOXR ? "soxr" : "swr", av_err2str(error));
             *err_ = strdup(err);
 
             swr_free(resample_context);
@@ -466,14 +766,15 @@ static int init_resampler(AVCodecContext *input_codec_context,
  */
 static int init_fifo(AVAudioFifo **fifo, AVCodecContext *output_codec_context, char** err_)
 {
-    /* Create the FIFO buffer based on the specified output sample format. */
+    /* Create the FIFO buffer based on the specified output sample format,
+     * presized so that it rarely needs to grow. */
     if (!(*fifo = av_audio_fifo_alloc(output_codec_context->sample_fmt,
 #ifdef HAVE_FF5_CH_LAYOUT
 				      output_codec_context->ch_layout.nb_channels,
 #else
                                       output_codec_context->channels,
 #endif
-				      1))) {
+				      FFMAX(output_codec_context->frame_size, GPOD_FF_XCODE_MIN_SAMPLES)))) {
         char  err[1024];
         snprintf(err, 1024, "Could not allocate FIFO");
         *err_ = strdup(err);
@@ -483,24 +784,104 @@ static int init_fifo(AVAudioFifo **fifo, AVCodecContext *output_codec_context, c
 }
 
 /**
- * Write the header of the output file container.
- * @param output_format_context Format context of the output file
+ * Provide an initialised resampler, reusing the session's resampler if the
+ * conversion is unchanged - re-init'ing drops any state from the previous
+ * file but keeps the (possibly expensive) filter setup.
  * @return Error code (0 if successful)
  */
-static int write_output_file_header(AVFormatContext *output_format_context, char** err_)
+static int _session_resampler(struct gpod_ff_transcode_session* session,
+                              AVCodecContext *input_codec_context,
+                              AVCodecContext *output_codec_context,
+                              const struct gpod_ff_transcode_ctx* target_, char** err_)
 {
     int error;
-    if ((error = avformat_write_header(output_format_context, NULL)) < 0) {
-        char  err[1024];
-        snprintf(err, 1024, "Could not write output file header (error '%s')",
-                av_err2str(error));
+    struct _swr_cfg  cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.in_rate = input_codec_context->sample_rate;
+    cfg.out_rate = output_codec_context->sample_rate;
+    cfg.in_fmt = input_codec_context->sample_fmt;
+    cfg.out_fmt = output_codec_context->sample_fmt;
+    cfg.in_channels = GPOD_FF_CTX_CHANNELS(input_codec_context);
+    cfg.out_channels = GPOD_FF_CTX_CHANNELS(output_codec_context);
+    cfg.in_layout = GPOD_FF_CTX_LAYOUT(input_codec_context);
+    cfg.out_layout = GPOD_FF_CTX_LAYOUT(output_codec_context);
+    cfg.engine = target_->audio_opts.resampler;
+    cfg.precision = target_->audio_opts.resample_precision;
+
+    if (session->swr && memcmp(&cfg, &session->swr_cfg, sizeof(cfg)) == 0) {
+        if ((error = swr_init(session->swr)) == 0) {
+            return 0;
+        }
+    }
+    swr_free(&session->swr);
+
+    if ((error = init_resampler(input_codec_context, output_codec_context, cfg.engine, cfg.precision, &session->swr, err_)) < 0) {
         return error;
     }
+    session->swr_cfg = cfg;
     return 0;
 }
 
 /**
- * Decode one audio frame from the input file.
+ * Provide an empty FIFO for the codec's sample format, reusing the existing
+ * FIFO (and its allocation) if the format is unchanged.
+ * @return Error code (0 if successful)
+ */
+static int _session_fifo(AVAudioFifo **fifo, struct _fifo_cfg* fifo_cfg,
+                         AVCodecContext *codec_context, unsigned* allocs_, char** err_)
+{
+    struct _fifo_cfg  cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.fmt = codec_context->sample_fmt;
+    cfg.channels = GPOD_FF_CTX_CHANNELS(codec_context);
+
+    if (*fifo && memcmp(&cfg, fifo_cfg, sizeof(cfg)) == 0) {
+        av_audio_fifo_reset(*fifo);
+        return 0;
+    }
+
+    if (*fifo) {
+        av_audio_fifo_free(*fifo);
+        *fifo = NULL;
+    }
+
+    int  error;
+    if ((error = init_fifo(fifo, codec_context, err_)) < 0) {
+        return error;
+    }
+    ++*allocs_;
+    *fifo_cfg = cfg;
+    return 0;
+}
+
+static void _scratch_free(struct _scratch* scratch_)
+{
+    if (scratch_->data) {
+        av_freep(&scratch_->data[0]);
+    }
+    av_freep(&scratch_->data);
+    scratch_->capacity = 0;
+}
+
+/**
+ * Write the header of the output file container.
+ * @param output_format_context Format context of the output file
+ * @return Error code (0 if successful)
+ */
+static int write_output_file_header(AVFormatContext *output_format_context, char** err_)
+{
+    int error;
+    if ((error = avformat_write_header(output_format_context, NULL)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not write output file header (error '%s')",
+                av_err2str(error));
+        return error;
+    }
+    return 0;
+}
+
+/**
+ * Decode one audio frame from the input file.
  * @param      frame                Audio frame to be decoded
  * @param      input_format_context Format context of the input file
  * @param      input_codec_context  Codec context of the input file
@@ -581,43 +962,56 @@ cleanup:
 }
 
 /**
- * Initialize a temporary storage for the specified number of audio samples.
- * The conversion requires temporary storage due to the different format.
- * The number of audio samples to be allocated is specified in frame_size.
- * @param[out] converted_input_samples Array of converted samples. The
- *                                     dimensions are reference, channel
- *                                     (for multi-channel audio), sample.
- * @param      output_codec_context    Codec context of the output file
- * @param      frame_size              Number of samples to be converted in
- *                                     each round
+ * Ensure the temporary storage can hold the specified number of audio samples
+ * in the codec's format. Storage is only (re)allocated when it is too small
+ * or the format changes, growing geometrically so that it settles at the
+ * largest frame seen.
+ * @param      scratch_      Storage to be reused. The dimensions of data
+ *                           are channel (for multi-channel audio), sample.
+ * @param      codec_context Codec context providing the sample format
+ * @param      nb_samples    Number of samples required
+ * @param[out] allocs_       Incremented if an allocation was made
  * @return Error code (0 if successful)
  */
-static int init_converted_samples(uint8_t ***converted_input_samples,
-                                  AVCodecContext *output_codec_context,
-                                  int frame_size, char** err_)
+static int _scratch_reserve(struct _scratch* scratch_,
+                            AVCodecContext *codec_context,
+                            int nb_samples, unsigned* allocs_, char** err_)
 {
     int error;
+    struct _fifo_cfg  cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.fmt = codec_context->sample_fmt;
+    cfg.channels = GPOD_FF_CTX_CHANNELS(codec_context);
+
+    const bool  same = scratch_->data && memcmp(&cfg, &scratch_->cfg, sizeof(cfg)) == 0;
+    if (same && nb_samples <= scratch_->capacity) {
+        return 0;
+    }
+
+    int  capacity = FFMAX(nb_samples, GPOD_FF_XCODE_MIN_SAMPLES);
+    if (same) {
+        capacity = FFMAX(capacity, scratch_->capacity*2);
+    }
+    _scratch_free(scratch_);
 
     /* Allocate as many pointers as there are audio channels.
      * Each pointer will point to the audio samples of the corresponding
      * channels (although it may be NULL for interleaved formats).
      * Allocate memory for the samples of all channels in one consecutive
      * block for convenience. */
-    if ((error = av_samples_alloc_array_and_samples(converted_input_samples, NULL,
-#ifdef HAVE_FF5_CH_LAYOUT
-				  output_codec_context->ch_layout.nb_channels,
-#else
-                                  output_codec_context->channels,
-#endif
-                                  frame_size,
-                                  output_codec_context->sample_fmt, 0)) < 0) {
+    if ((error = av_samples_alloc_array_and_samples(&scratch_->data, NULL,
+                                  cfg.channels, capacity, cfg.fmt, 0)) < 0) {
         char  err[1024];
         snprintf(err, 1024,
                 "Could not allocate converted input samples (error '%s')",
                 av_err2str(error));
         *err_ = strdup(err);
+        scratch_->data = NULL;
         return error;
     }
+    ++*allocs_;
+    scratch_->capacity = capacity;
+    scratch_->cfg = cfg;
     return 0;
 }
 
@@ -679,15 +1073,19 @@ static int convert_samples(const uint8_t **input_data, const int in_samples,
  */
 static int add_samples_to_fifo(AVAudioFifo *fifo,
                                uint8_t **converted_input_samples,
-                               const int frame_size, char** err_)
+                               const int frame_size, unsigned* allocs_, char** err_)
 {
     int error;
 
-    /* Make the FIFO as large as it needs to be to hold both,
-     * the old and the new samples. */
-    if ((error = av_audio_fifo_realloc(fifo, av_audio_fifo_size(fifo) + frame_size)) < 0) {
-        *err_ = strdup("Could not write data to FIFO");
-        return error;
+    /* Make the FIFO as large as it needs to be to hold both, the old and the
+     * new samples - doubling so the FIFO quickly reaches its working size. */
+    if (av_audio_fifo_space(fifo) < frame_size) {
+        const int  size = av_audio_fifo_size(fifo);
+        if ((error = av_audio_fifo_realloc(fifo, FFMAX(size + frame_size, 2*(size + av_audio_fifo_space(fifo))))) < 0) {
+            *err_ = strdup("Could not write data to FIFO");
+            return error;
+        }
+        ++*allocs_;
     }
 
     /* Store the new samples in the FIFO buffer. */
@@ -699,6 +1097,83 @@ static int add_samples_to_fifo(AVAudioFifo *fifo,
     return 0;
 }
 
+// samples a frame's buffer can hold
+static int _frame_capacity(const AVFrame* frame_)
+{
+    return frame_->linesize[0] /
+               (av_get_bytes_per_sample(frame_->format) * (av_sample_fmt_is_planar(frame_->format) ? 1 : GPOD_FF_CTX_CHANNELS(frame_)));
+}
+
+/**
+ * Rate convert a decoded frame straight into the FIFO buffer.  The
+ * session's output frame keeps its buffer across calls and files, only
+ * grown when the resampler could return more samples than it holds.
+ * @param      fifo                 Buffer used for temporary storage
+ * @param      input_frame          Decoded samples, NULL to drain the resampler
+ * @param      input_codec_context  Codec context of the input file
+ * @param      output_codec_context Codec context of the output file
+ * @param      resample_context     Resample context for the conversion
+ * @return Error code (0 if successful)
+ */
+static int resample_and_store(AVAudioFifo *fifo,
+                              AVFrame *input_frame,
+                              AVCodecContext *input_codec_context,
+                              AVCodecContext *output_codec_context,
+                              SwrContext *resample_context,
+                              struct gpod_ff_transcode_session* session, char** err_)
+{
+    AVFrame*  out = session->resampled_frame;
+    const int  nb_samples = swr_get_out_samples(resample_context, input_frame ? input_frame->nb_samples : 0);
+    int error;
+
+    if (nb_samples <= 0) {
+        return 0;
+    }
+
+    /* the resampler was set up with the codecs' (default) layouts and
+     * rejects frames that differ, such as an unset layout from wav */
+    if (input_frame) {
+#ifdef HAVE_FF5_CH_LAYOUT
+        if (av_channel_layout_compare(&input_frame->ch_layout, &input_codec_context->ch_layout) != 0)
+            av_channel_layout_copy(&input_frame->ch_layout, &input_codec_context->ch_layout);
+#else
+        input_frame->channel_layout = av_get_default_channel_layout(input_codec_context->channels);
+#endif
+    }
+
+    if (!out->buf[0] || out->format != output_codec_context->sample_fmt ||
+        GPOD_FF_CTX_CHANNELS(out) != GPOD_FF_CTX_CHANNELS(output_codec_context) ||
+        _frame_capacity(out) < nb_samples)
+    {
+        av_frame_unref(out);
+#ifdef HAVE_FF5_CH_LAYOUT
+        av_channel_layout_copy(&out->ch_layout, &output_codec_context->ch_layout);
+#else
+        out->channel_layout = output_codec_context->channel_layout;
+#endif
+        out->format = output_codec_context->sample_fmt;
+        out->nb_samples = FFMAX(nb_samples, GPOD_FF_XCODE_MIN_SAMPLES);
+        if ((error = av_frame_get_buffer(out, 0)) < 0) {
+            char  err[1024];
+            snprintf(err, 1024, "Could not allocate resampled frame (error '%s')", av_err2str(error));
+            *err_ = strdup(err);
+            return error;
+        }
+        ++session->allocs;
+    }
+    out->sample_rate = output_codec_context->sample_rate;
+    out->nb_samples = 0;  // convert upto the buffer's capacity
+
+    if ((error = swr_convert_frame(resample_context, out, input_frame)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not convert input samples (error '%s')", av_err2str(error));
+        *err_ = strdup(err);
+        return error;
+    }
+
+    return add_samples_to_fifo(fifo, out->extended_data, out->nb_samples, &session->allocs, err_);
+}
+
 /**
  * Read one audio frame from the input file, decode, convert and store
  * it in the FIFO buffer.
@@ -706,7 +1181,8 @@ static int add_samples_to_fifo(AVAudioFifo *fifo,
  * @param      input_format_context Format context of the input file
  * @param      input_codec_context  Codec context of the input file
  * @param      output_codec_context Codec context of the output file
- * @param      resampler_context    Resample context for the conversion
+ * @param      resample_context     Resample context for the conversion, NULL
+ *                                  if the decoder output needs none
  * @param[out] finished             Indicates whether the end of file has
  *                                  been reached and all data has been
  *                                  decoded. If this flag is false,
@@ -722,11 +1198,12 @@ static int read_decode_convert_and_store(AVAudioFifo *fifo,
                                          AVCodecContext *input_codec_context,
 					 const int audio_stream_idx,
                                          AVCodecContext *output_codec_context,
-                                         SwrContext *resampler_context,
+                                         SwrContext *resample_context,
+                                         struct gpod_ff_transcode_session* session,
                                          int *finished, char** err_)
 {
-    /* Temporary storage for the converted input samples. */
-    uint8_t **converted_input_samples = NULL;
+    struct _scratch*  converted = &session->out_scratch;
+    int nb_samples;
     int data_present;
     int ret = AVERROR_EXIT;
 
@@ -740,84 +1217,67 @@ static int read_decode_convert_and_store(AVAudioFifo *fifo,
      * in the decoder which are delayed, we are actually finished.
      * This must not be treated as an error. */
     if (*finished) {
+        /* the rate converter holds back samples for its filter */
+        if (resample_context && input_codec_context->sample_rate != output_codec_context->sample_rate &&
+            resample_and_store(fifo, NULL, input_codec_context, output_codec_context, resample_context, session, err_))
+            goto cleanup;
+
         ret = 0;
         goto cleanup;
     }
-    /* If there is decoded data, convert and store it. */
-    if (data_present) {
-        /* Initialize the temporary storage for the converted input samples. */
-        if (init_converted_samples(&converted_input_samples, output_codec_context,
-                                   input_frame->nb_samples, err_))
-            goto cleanup;
+    /* the decoded samples are metered before any conversion */
+    if (data_present)
+        gpod_ff_loudness_add(session->loudness, input_frame, 0, input_frame->nb_samples);
 
-        /* Convert the input samples to the desired output sample format.
-         * This requires a temporary storage provided by converted_input_samples. */
-        if (convert_samples((const uint8_t**)input_frame->extended_data, input_frame->nb_samples,
-		            converted_input_samples,
-		            input_frame->nb_samples, resampler_context, err_) < 0)
+    /* If there is decoded data, convert and store it. */
+    if (data_present && resample_context == NULL) {
+        /* decoder output is already what the encoder takes */
+        if (add_samples_to_fifo(fifo, (uint8_t**)input_frame->extended_data,
+                                input_frame->nb_samples, &session->allocs, err_))
             goto cleanup;
-
-        /* Add the converted input samples to the FIFO buffer for later processing. */
-        if (add_samples_to_fifo(fifo, converted_input_samples,
-                                input_frame->nb_samples, err_))
+    }
+    else if (data_present && input_codec_context->sample_rate != output_codec_context->sample_rate) {
+        if (resample_and_store(fifo, input_frame, input_codec_context, output_codec_context, resample_context, session, err_))
             goto cleanup;
-        ret = 0;
     }
-    ret = 0;
-
-cleanup:
-    if (converted_input_samples)
-        av_freep(&converted_input_samples[0]);
-    av_freep(&converted_input_samples);
-
-    return ret;
-}
-
-static int read_decode_and_store(AVAudioFifo *fifo,
-                                 AVFrame *input_frame,
-                                 AVPacket *input_packet,
-				 AVFormatContext *input_format_context,
-				 AVCodecContext *input_codec_context,
-				 const int audio_stream_idx,
-				 int *finished, char** err_)
-{
-    int data_present;
-    int ret = AVERROR_EXIT;
-
-    av_frame_unref(input_frame);
-
-    if (decode_audio_frame(input_frame, input_packet, input_format_context,
-                           input_codec_context, audio_stream_idx, &data_present, finished, err_))
-        goto cleanup;
+    else if (data_present) {
+        /* Ensure the temporary storage for the converted input samples. */
+        if (_scratch_reserve(converted, output_codec_context,
+                             input_frame->nb_samples, &session->allocs, err_))
+            goto cleanup;
 
-    if (*finished) {
-        ret = 0;
-        goto cleanup;
-    }
+        /* Convert the input samples to the desired output sample format.
+         * This requires a temporary storage provided by converted. */
+        if ( (nb_samples = convert_samples((const uint8_t**)input_frame->extended_data, input_frame->nb_samples,
+		            converted->data,
+		            input_frame->nb_samples, resample_context, err_)) < 0)
+            goto cleanup;
 
-    if (data_present) {
         /* Add the converted input samples to the FIFO buffer for later processing. */
-        if (add_samples_to_fifo(fifo, (uint8_t**)input_frame->extended_data, input_frame->nb_samples, err_))
+        if (add_samples_to_fifo(fifo, converted->data,
+                                nb_samples, &session->allocs, err_))
             goto cleanup;
     }
     ret = 0;
 
 cleanup:
-
     return ret;
 }
 
 /**
  * Initialize one input frame for writing to the output file.
- * The frame will be exactly frame_size samples large.
+ * The frame will be exactly frame_size samples large. The frame's existing
+ * sample buffer is reused if it is large enough and no longer referenced
+ * by the encoder.
  * @param[out] frame                Frame to be initialized
  * @param      output_codec_context Codec context of the output file
  * @param      frame_size           Size of the frame
+ * @param[out] allocs_              Incremented if a buffer was allocated
  * @return Error code (0 if successful)
  */
 static int init_output_frame(AVFrame **frame,
                              AVCodecContext *output_codec_context,
-                             int frame_size, char** err_)
+                             int frame_size, unsigned* allocs_, char** err_)
 {
     int error;
 
@@ -827,6 +1287,30 @@ static int init_output_frame(AVFrame **frame,
         return AVERROR_EXIT;
     }
 
+    AVFrame*  f = *frame;
+    if (f->buf[0] && f->format == output_codec_context->sample_fmt &&
+        GPOD_FF_CTX_CHANNELS(f) == GPOD_FF_CTX_CHANNELS(output_codec_context) &&
+        f->sample_rate == output_codec_context->sample_rate)
+    {
+        if (frame_size <= _frame_capacity(f)) {
+            f->nb_samples = frame_size;
+            if (av_frame_is_writable(f)) {
+                return 0;
+            }
+
+            // still held by encoder, copied into new buffer
+            if ((error = av_frame_make_writable(f)) < 0) {
+                char  err[1024];
+                snprintf(err, 1024, "Could not make output frame writable (error '%s')", av_err2str(error));
+                *err_ = strdup(err);
+                return error;
+            }
+            ++*allocs_;
+            return 0;
+        }
+    }
+    av_frame_unref(f);
+
     /* Set the frame's parameters, especially its size and format.
      * av_frame_get_buffer needs this to allocate memory for the
      * audio samples of the frame.
@@ -850,6 +1334,7 @@ static int init_output_frame(AVFrame **frame,
         av_frame_free(frame);
         return error;
     }
+    ++*allocs_;
 
     return 0;
 }
@@ -928,66 +1413,6 @@ cleanup:
     return error;
 }
 
-static int  load_convert_and_store(AVAudioFifo* output_samples_fifo, AVFrame** frame, const AVFormatContext* output_context, AVCodecContext* output_codec_context, int output_frame_size,
-	                           AVAudioFifo* input_samples_fifo,  const AVFormatContext* input_context, AVCodecContext* input_codec_context,
-				   SwrContext* resample_context, char** err_)
-{
-    uint8_t **converted_input_samples = NULL;
-    int  ret = AVERROR_EXIT;
-
-    const int frame_size = FFMIN(av_audio_fifo_size(input_samples_fifo),
-                                 output_frame_size);
-
-    // yes this is init_output_frame
-    if (init_output_frame(frame, input_codec_context, frame_size, err_))
-        return AVERROR_EXIT;
-
-    AVFrame *output_frame = *frame;
-
-    /* Read as many samples from the FIFO buffer as required to fill the frame.
-     * The samples are stored in the frame temporarily. */
-    if (av_audio_fifo_read(input_samples_fifo, (void **)output_frame->data, frame_size) < frame_size) {
-        *err_ = strdup("Could not read data from input samples FIFO");
-        return AVERROR_EXIT;
-    }
-
-    int  nb_samples = (output_codec_context->sample_rate == input_codec_context->sample_rate) ?
-	output_frame->nb_samples :
-	av_rescale_rnd(swr_get_delay(resample_context, input_codec_context->sample_rate) + output_frame->nb_samples, output_codec_context->sample_rate, input_codec_context->sample_rate, AV_ROUND_DOWN);
-
-#ifdef GPOD_XCODE_SWR_DEBUG
-    printf("load/convert  frame size=%d  -> nb_samples=%d   out ctx frame=%d\n", frame_size, output_frame->nb_samples, output_codec_context->frame_size);
-#endif
-
-    /* Initialize the temporary storage for the converted input samples. */
-    if (init_converted_samples(&converted_input_samples, output_codec_context,
-		nb_samples, err_))
-	goto cleanup;
-
-    /* Convert the input samples to the desired output sample format.
-     * This requires a temporary storage provided by converted_input_samples. */
-    if ( (nb_samples = convert_samples((const uint8_t**)output_frame->extended_data, output_frame->nb_samples,
-		converted_input_samples, output_codec_context->frame_size,
-		resample_context, err_)) < 0)
-	goto cleanup;
-
-    /* Add the converted input samples to the FIFO buffer for later processing. */
-    if (add_samples_to_fifo(output_samples_fifo, converted_input_samples,
-		nb_samples, err_))
-	goto cleanup;
-
-    ret = 0;
-
-cleanup:
-    if (converted_input_samples) {
-        av_freep(&converted_input_samples[0]);
-        free(converted_input_samples);
-    }
-    av_frame_unref(output_frame);
-
-    return ret;
-}
-
 /**
  * Load one audio frame from the FIFO buffer, encode and write it to the
  * output file.
@@ -1000,7 +1425,8 @@ static int load_encode_and_write(AVAudioFifo *fifo,
                                  AVFrame **frame,
                                  AVPacket *output_packet,
                                  AVFormatContext *output_format_context,
-                                 AVCodecContext *output_codec_context, int64_t* pts, char** err_)
+                                 AVCodecContext *output_codec_context, int64_t* pts,
+                                 unsigned* allocs_, char** err_)
 {
     /* Temporary storage of the output samples of the frame written to the file. */ 
 
@@ -1012,7 +1438,7 @@ static int load_encode_and_write(AVAudioFifo *fifo,
     int data_written;
 
     /* Initialize temporary storage for one output frame. */
-    if (init_output_frame(frame, output_codec_context, frame_size, err_))
+    if (init_output_frame(frame, output_codec_context, frame_size, allocs_, err_))
         return AVERROR_EXIT;
 
     AVFrame *output_frame = *frame;
@@ -1024,12 +1450,12 @@ static int load_encode_and_write(AVAudioFifo *fifo,
         return AVERROR_EXIT;
     }
 
-    /* Encode one frame worth of audio samples. */
+    /* Encode one frame worth of audio samples, the frame keeps its buffer
+     * for the next call. */
     if (encode_audio_frame(output_frame, output_packet, output_format_context,
                            output_codec_context, pts, &data_written, err_)) {
         return AVERROR_EXIT;
     }
-    av_frame_unref(output_frame);
     return 0;
 }
 
@@ -1052,191 +1478,759 @@ static int write_output_file_trailer(AVFormatContext *output_format_context, cha
 }
 
 
-int  gpod_ff_transcode(struct gpod_ff_media_info *info_, struct gpod_ff_transcode_ctx* target_, char** err_)
+struct gpod_ff_transcode_session*  gpod_ff_transcode_session_new()
 {
-    AVFormatContext  *input_format_context = NULL, *output_format_context = NULL;
-    AVCodecContext  *input_codec_context = NULL, *output_codec_context = NULL;
-    SwrContext  *resample_context = NULL;
-    AVAudioFifo  *fifo = NULL;
-    AVAudioFifo  *input_samples_fifo = NULL;
-    /* Temporary storage of the input samples of the frame read from the file. */
-    AVFrame *input_frame = NULL;
-    AVFrame *output_frame = NULL;
-    AVPacket *input_packet = NULL;
-    AVPacket *output_packet = NULL;
-    int ret = AVERROR_EXIT;
-    int audio_stream_idx;
-
-    /* timestamp for the audio frames. */
-    int64_t pts = 0;
-
+    struct gpod_ff_transcode_session*  obj = (struct gpod_ff_transcode_session*)calloc(1, sizeof(struct gpod_ff_transcode_session));
+    if (obj == NULL) {
+        return NULL;
+    }
 
-    /* Open the input file for reading. */
-    if (open_input_file(info_->path, &input_format_context,
-                        &input_codec_context, &audio_stream_idx, err_))
-        goto cleanup;
+    obj->input_frame = av_frame_alloc();
+    obj->output_frame = av_frame_alloc();
+    obj->resampled_frame = av_frame_alloc();
+    obj->input_packet = av_packet_alloc();
+    obj->output_packet = av_packet_alloc();
 
-    /* Open the output file for writing. */
-    if (open_output_file(target_, input_codec_context,
-                         &output_format_context, &output_codec_context, err_))
-        goto cleanup;
+    if (!obj->input_frame || !obj->output_frame || !obj->resampled_frame || !obj->input_packet || !obj->output_packet) {
+        gpod_ff_transcode_session_free(obj);
+        return NULL;
+    }
+    return obj;
+}
 
-    if (target_->sync_meta) {
-	av_dict_copy(&output_format_context->metadata, input_format_context->metadata, 0);
+void  gpod_ff_transcode_session_free(struct gpod_ff_transcode_session* obj_)
+{
+    if (obj_ == NULL) {
+        return;
     }
 
-#ifdef GPOD_XCODE_SWR_DEBUG
-    printf("input: file=%s  channels=%d  layout=%d  format=%s  sample_rate=%d  output: channels=%d  layout=%d  format=%s  sample_rate=%d\n",
-	    info_->path, input_codec_context->channels, input_codec_context->channel_layout, av_get_sample_fmt_name(input_codec_context->sample_fmt), input_codec_context->sample_rate,
-	    output_codec_context->channels, output_codec_context->channel_layout, av_get_sample_fmt_name(output_codec_context->sample_fmt), output_codec_context->sample_rate
-	    );
-#endif
+    if (obj_->fifo)
+        av_audio_fifo_free(obj_->fifo);
+    _scratch_free(&obj_->out_scratch);
+    swr_free(&obj_->swr);
+    avcodec_free_context(&obj_->enc);
+    av_frame_free(&obj_->input_frame);
+    av_frame_free(&obj_->output_frame);
+    av_frame_free(&obj_->resampled_frame);
+    av_packet_free(&obj_->input_packet);
+    av_packet_free(&obj_->output_packet);
+
+    free(obj_);
+}
 
-    /* Initialize the resampler to be able to convert audio sample formats. */
-    if (init_resampler(input_codec_context, output_codec_context,
-                       &resample_context, err_))
-        goto cleanup;
-    /* Initialize the FIFO buffer to store audio samples to be encoded. */
-    if (init_fifo(&fifo, output_codec_context, err_))
-        goto cleanup;
+/* Long inputs are split into time segments that are decoded, resampled and
+ * encoded on their own threads, with the packets then stitched in order into
+ * the single output.  Every segment but the first starts its encoder on audio
+ * ahead of its boundary and discards the packets covering this preroll, so
+ * the encoder's priming and frame overlap have settled by the boundary.
+ * Boundaries fall on encoder frames and on output samples that map exactly
+ * to input samples so no audio is dropped or repeated between segments.
+ *
+ * The first segment's packets are written to the output as they are
+ * encoded; later segments spool theirs to temporary files that are copied
+ * into the output in order once the preceding segments have been written.
+ */
+#define GPOD_FF_XCODE_SEGMENT_MIN      600  // secs, shortest segment worth splitting off
+#define GPOD_FF_XCODE_SEGMENT_PREROLL  2    // secs, encoded ahead of each segment and discarded
+
+struct _segment {
+    const char*  path;
+    const struct _enc_cfg*  cfg;
+    const struct gpod_ff_transcode_ctx*  target;
+    struct gpod_ff_transcode_session*  session;
+
+    int64_t  from;    // output sample the segment's encoder starts on
+    unsigned  skip;   // packets covering the preroll
+    int64_t  keep;    // packets belonging to the segment, -1 for until EOF
+    unsigned  npkts;  // packets encoded so far, including skipped
+
+    /* output samples the segment owns, metered so the segments together
+     * cover the input once; to is -1 for until EOF */
+    int64_t  measure_from;
+    int64_t  measure_to;
+    struct gpod_ff_loudness*  loudness;  // NULL if not measuring
+
+    struct _segment_out*  out;  // the first segment writes to the output
+    FILE*  spool;               // later segments' packets
+    int  ret;
+    char*  err;
+};
+
+struct _segment_out {
+    AVFormatContext*  ofc;
+    // of the first segment's encoder, the output's stream params
+    AVRational  time_base;
+    int  initial_padding;
+    int  frame_size;
+    int64_t  t;  // samples written
+};
 
-    if (init_fifo(&input_samples_fifo, input_codec_context, err_))
-        goto cleanup;
+/**
+ * Restamp the packet as if from a single encoder and write it to the output.
+ * @return Error code (0 if successful)
+ */
+static int _segment_out_write(struct _segment_out* out_, AVPacket* pkt_, char** err_)
+{
+    int  error;
 
-    /* Write the header of the output file container. */
-    if (write_output_file_header(output_format_context, err_))
-        goto cleanup;
+    pkt_->stream_index = 0;
+    pkt_->pts = pkt_->dts = out_->t - out_->initial_padding;
+    out_->t += pkt_->duration > 0 ? pkt_->duration : out_->frame_size;
+    av_packet_rescale_ts(pkt_, out_->time_base, out_->ofc->streams[0]->time_base);
 
-    /* Initialize temporary storage for one input frame. */
-    if (init_input_frame(&input_frame, err_))
-        goto cleanup;
+    if ((error = av_write_frame(out_->ofc, pkt_)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not write frame (error '%s')", av_err2str(error));
+        *err_ = strdup(err);
+    }
+    av_packet_unref(pkt_);
+    return error;
+}
 
-    if (init_packet(&input_packet, err_) < 0)
-        goto cleanup;
-    if (init_packet(&output_packet, err_) < 0)
-        goto cleanup;
+/* spooled packet: header, data then each side data's type, size and data;
+ * timestamps are not kept as the packets are restamped on output */
+struct _segment_spool_hdr {
+    int64_t  duration;
+    int32_t  size;
+    int32_t  flags;
+    int32_t  side_data_elems;
+};
 
-    /* Loop as long as we have input samples to read or output samples
-     * to write; abort as soon as we have neither. */
-    while (1) {
-        /* Use the encoder's desired frame size for processing. */
-        const int output_frame_size = output_codec_context->frame_size;
-        int finished                = 0;
+static int _segment_spool_write(FILE* f_, const AVPacket* pkt_)
+{
+    const struct _segment_spool_hdr  hdr = { pkt_->duration, pkt_->size, pkt_->flags, pkt_->side_data_elems };
 
-        /* Make sure that there is one frame worth of samples in the FIFO
-         * buffer so that the encoder can do its work.
-         * Since the decoder's and the encoder's frame size may differ, we
-         * need to FIFO buffer to store as many frames worth of input samples
-         * that they make up at least one frame worth of output samples. */
-	if (output_codec_context->sample_rate == input_codec_context->sample_rate)
-	{
-	    while (av_audio_fifo_size(fifo) < output_frame_size) {
-		/* Decode one frame worth of audio samples, convert it to the
-		 * output sample format and put it into the FIFO buffer. */
-		if (read_decode_convert_and_store(fifo, input_frame, input_packet, input_format_context,
-			    input_codec_context,
-			    audio_stream_idx,
-			    output_codec_context,
-			    resample_context, &finished, err_))
-		    goto cleanup;
-
-		/* If we are at the end of the input file, we continue
-		 * encoding the remaining audio samples to the output file. */
-		if (finished)
-		    break;
-	    }
-	}
-	else
-	{
-	    // sample rate conversion case
-	    /* Re: Resample frame to specified number of samples
-	     * https://ffmpeg.org/pipermail/libav-user/2017-July/010496.html
-	     * Yes, you need to buffer sufficient audio frames to feed to the encoder.
-	     *
-	     * Calculate the number of in samples:
-		    in_nb_samples = av_rescale_rnd(swr_get_delay(swr_ctx, c->sample_rate) +
-		out_nb_samples,
-				    in_sample_rate, c->sample_rate, AV_ROUND_DOWN);
-
-		then allocate buffers to concatenate the in samples until you have enough
-		to pass to swr_ctx.
-	     */
-	    while (av_audio_fifo_size(input_samples_fifo) < output_frame_size) {
-		if (read_decode_and_store(input_samples_fifo,
-                            input_frame,
-                            input_packet,
-			    input_format_context, input_codec_context,
-			    audio_stream_idx,
-			    &finished, err_))
-		    goto cleanup;
-
-		if (finished)
-		    break;
-	    }
-#ifdef GPOD_XCODE_SWR_DEBUG
-	    printf("fifo buf can convert:  input samples=%d  frame size=%d  input frame size=%d  channels=%d  channel_layout=%d sample fmt=%s  sample rate=%d  -> output codec frame size=%d  channels=%d  layout=%d  sample format=%s  sample rate=%d  swr delay=%d  finished=%d\n", av_audio_fifo_size(input_samples_fifo),
-		    output_frame_size,
-		    input_codec_context->frame_size, input_codec_context->channels, input_codec_context->channel_layout, av_get_sample_fmt_name(input_codec_context->sample_fmt), input_codec_context->sample_rate, 
-		    output_codec_context->frame_size, output_codec_context->channels, output_codec_context->channel_layout, av_get_sample_fmt_name(output_codec_context->sample_fmt), output_codec_context->sample_rate, 
-		    swr_get_delay(resample_context, input_codec_context->sample_rate), finished);
-#endif
+    if (fwrite(&hdr, sizeof(hdr), 1, f_) != 1 ||
+        (pkt_->size && fwrite(pkt_->data, pkt_->size, 1, f_) != 1))
+        return AVERROR(EIO);
 
-	    while (av_audio_fifo_size(input_samples_fifo) >= output_frame_size ||
-		    (finished && av_audio_fifo_size(input_samples_fifo) > 0)) {
-		/* take all input samples and convert them before handing off to encoder
-		*/
-		if (load_convert_and_store(fifo, &output_frame,
-			    output_format_context, output_codec_context, output_frame_size,
-			    input_samples_fifo, input_format_context, input_codec_context,
-			    resample_context, err_))
-		    goto cleanup;
-	    }
-	}
+    for (int i=0; i<pkt_->side_data_elems; ++i) {
+        const AVPacketSideData*  sd = &pkt_->side_data[i];
+        const int32_t  sdhdr[2] = { sd->type, (int32_t)sd->size };
 
+        if (fwrite(sdhdr, sizeof(sdhdr), 1, f_) != 1 ||
+            (sd->size && fwrite(sd->data, sd->size, 1, f_) != 1))
+            return AVERROR(EIO);
+    }
+    return 0;
+}
 
-        /* If we have enough samples for the encoder, we encode them.
-         * At the end of the file, we pass the remaining samples to
-         * the encoder. */
-        while (av_audio_fifo_size(fifo) >= output_frame_size ||
-               (finished && av_audio_fifo_size(fifo) > 0))
-            /* Take one frame worth of audio samples from the FIFO buffer,
-             * encode it and write it to the output file. */
-            if (load_encode_and_write(fifo, &output_frame, output_packet, output_format_context,
-                                      output_codec_context, &pts, err_))
-                goto cleanup;
+/**
+ * @return 1 if a packet was read, 0 at the end of the spool, otherwise an
+ *         error code
+ */
+static int _segment_spool_read(FILE* f_, AVPacket* pkt_)
+{
+    struct _segment_spool_hdr  hdr;
+    int  error;
 
-        /* If we are at the end of the input file and have encoded
-         * all remaining samples, we can exit this loop and finish. */
-        if (finished) {
-            int data_written;
-            /* Flush the encoder as it may have delayed frames. */
-            do {
-                if (encode_audio_frame(NULL, output_packet, output_format_context,
-                                       output_codec_context, &pts, &data_written, err_))
-                    goto cleanup;
-            } while (data_written);
-            break;
-        }
+    if (fread(&hdr, sizeof(hdr), 1, f_) != 1)
+        return feof(f_) ? 0 : AVERROR(EIO);
+
+    if ((error = av_new_packet(pkt_, hdr.size)) < 0)
+        return error;
+    pkt_->duration = hdr.duration;
+    pkt_->flags = hdr.flags;
+    if (hdr.size && fread(pkt_->data, hdr.size, 1, f_) != 1)
+        return AVERROR(EIO);
+
+    for (int i=0; i<hdr.side_data_elems; ++i) {
+        int32_t  sdhdr[2];
+        uint8_t*  sd;
+
+        if (fread(sdhdr, sizeof(sdhdr), 1, f_) != 1)
+            return AVERROR(EIO);
+        if ((sd = av_packet_new_side_data(pkt_, (enum AVPacketSideDataType)sdhdr[0], sdhdr[1])) == NULL)
+            return AVERROR(ENOMEM);
+        if (sdhdr[1] && fread(sd, sdhdr[1], 1, f_) != 1)
+            return AVERROR(EIO);
+    }
+    return 1;
+}
+
+static bool  _segment_complete(const struct _segment* seg_)
+{
+    return seg_->keep >= 0 && seg_->npkts >= seg_->skip + seg_->keep;
+}
+
+/**
+ * Send one frame (or NULL to flush) to the segment's encoder and write or
+ * spool the packets that belong to the segment.
+ * @return Error code (0 if successful)
+ */
+static int _segment_encode(struct _segment* seg_, AVFrame* frame_)
+{
+    AVCodecContext*  enc = seg_->session->enc;
+    AVPacket*  pkt = seg_->session->output_packet;
+    int  error;
+
+    if ((error = avcodec_send_frame(enc, frame_)) < 0 && error != AVERROR_EOF) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not send packet for encoding (error '%s')", av_err2str(error));
+        seg_->err = strdup(err);
+        return error;
+    }
+
+    while ((error = avcodec_receive_packet(enc, pkt)) == 0) {
+        if (seg_->npkts++ < seg_->skip || _segment_complete(seg_)) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        if (seg_->out) {
+            if ((error = _segment_out_write(seg_->out, pkt, &seg_->err)) < 0)
+                return error;
+            continue;
+        }
+
+        error = _segment_spool_write(seg_->spool, pkt);
+        av_packet_unref(pkt);
+        if (error < 0) {
+            seg_->err = strdup("Could not spool packet");
+            return error;
+        }
+    }
+
+    if (error == AVERROR(EAGAIN) || error == AVERROR_EOF) {
+        return 0;
+    }
+
+    char  err[1024];
+    snprintf(err, 1024, "Could not encode frame (error '%s')", av_err2str(error));
+    seg_->err = strdup(err);
+    return error;
+}
+
+/**
+ * Encode encoder sized frames from the segment's FIFO, or everything that
+ * remains when flushing.
+ * @return Error code (0 if successful)
+ */
+static int _segment_encode_fifo(struct _segment* seg_, int64_t* pts_, bool flush_)
+{
+    struct gpod_ff_transcode_session*  session = seg_->session;
+    const int  frame_size = session->enc->frame_size;
+    int  error;
+
+    while (!_segment_complete(seg_) &&
+           (av_audio_fifo_size(session->fifo) >= frame_size ||
+            (flush_ && av_audio_fifo_size(session->fifo) > 0)) )
+    {
+        const int  n = FFMIN(av_audio_fifo_size(session->fifo), frame_size);
+
+        if ((error = init_output_frame(&session->output_frame, session->enc, n, &session->allocs, &seg_->err)) < 0) {
+            return error;
+        }
+        if (av_audio_fifo_read(session->fifo, (void **)session->output_frame->data, n) < n) {
+            seg_->err = strdup("Could not read data from FIFO");
+            return AVERROR_EXIT;
+        }
+        session->output_frame->pts = *pts_;
+        *pts_ += n;
+
+        if ((error = _segment_encode(seg_, session->output_frame)) < 0) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Resample the decoded frame, less the leading trim_ samples that fall
+ * before the segment, into the segment's FIFO.  A NULL frame flushes the
+ * resampler.
+ * @return Error code (0 if successful)
+ */
+static int _segment_convert(struct _segment* seg_, AVCodecContext* input_codec_context,
+                            const AVFrame* frame_, int trim_)
+{
+    struct gpod_ff_transcode_session*  session = seg_->session;
+    const uint8_t*  in[AV_NUM_DATA_POINTERS] = { NULL };
+    int  n = 0;
+    int  error;
+
+    if (frame_) {
+        const int  channels = GPOD_FF_CTX_CHANNELS(input_codec_context);
+        const bool  planar = av_sample_fmt_is_planar(frame_->format);
+        const int  planes = planar ? channels : 1;
+        const int  bps = av_get_bytes_per_sample(frame_->format) * (planar ? 1 : channels);
+
+        if (planes > AV_NUM_DATA_POINTERS) {
+            seg_->err = strdup("Too many channels to segment");
+            return AVERROR_EXIT;
+        }
+        for (int i=0; i<planes; ++i) {
+            in[i] = frame_->extended_data[i] + trim_*bps;
+        }
+        n = frame_->nb_samples - trim_;
+    }
+
+    if ((error = _scratch_reserve(&session->out_scratch, session->enc,
+                                  swr_get_out_samples(session->swr, n), &session->allocs, &seg_->err)) < 0) {
+        return error;
+    }
+
+    if ((error = convert_samples(frame_ ? in : NULL, n,
+                                 session->out_scratch.data, session->out_scratch.capacity,
+                                 session->swr, &seg_->err)) < 0) {
+        return error;
+    }
+
+    return add_samples_to_fifo(session->fifo, session->out_scratch.data, error, &session->allocs, &seg_->err);
+}
+
+/**
+ * Decode, resample and encode one segment of the input.  Runs on its own
+ * thread, using only the segment's session.
+ */
+static gpointer  _segment_xcode(gpointer seg_)
+{
+    struct _segment*  seg = (struct _segment*)seg_;
+    struct gpod_ff_transcode_session*  session = seg->session;
+    AVFormatContext*  ifc = NULL;
+    AVCodecContext*  icc = NULL;
+    AVFrame*  frame = session->input_frame;
+    int  idx;
+    int  finished = 0;
+    int  data_present;
+    int64_t  pts = 0;
+    int  error;
+
+    seg->ret = AVERROR_EXIT;
+
+    if (open_input_file(seg->path, &ifc, &icc, &idx, 1, &seg->err) ||
+        _session_encoder(session, seg->cfg, &seg->err) ||
+        _session_resampler(session, icc, session->enc, seg->target, &seg->err) ||
+        _session_fifo(&session->fifo, &session->fifo_cfg, session->enc, &session->allocs, &seg->err))
+    {
+        goto cleanup;
+    }
+
+    const AVStream*  st = ifc->streams[idx];
+    const AVRational  in_tb = { 1, icc->sample_rate };
+    const int64_t  start_time = st->start_time == AV_NOPTS_VALUE ? 0 : st->start_time;
+    // boundaries are chosen so this is exact
+    const int64_t  from = av_rescale(seg->from, icc->sample_rate, session->enc->sample_rate);
+    const int64_t  measure_from = av_rescale(seg->measure_from, icc->sample_rate, session->enc->sample_rate);
+    const int64_t  measure_to = seg->measure_to < 0 ? INT64_MAX : av_rescale(seg->measure_to, icc->sample_rate, session->enc->sample_rate);
+    int64_t  pos = -1;
+
+    if (seg->target->loudness &&
+        (seg->loudness = gpod_ff_loudness_new(icc)) == NULL) {
+        seg->err = strdup("Could not allocate loudness meter");
+        goto cleanup;
+    }
+
+    if (from > 0) {
+        // land early to allow the decoder to settle, samples are trimmed by pts
+        const int64_t  ts = start_time + av_rescale_q(FFMAX(from - icc->sample_rate, 0), in_tb, st->time_base);
+        if ((error = av_seek_frame(ifc, idx, ts, AVSEEK_FLAG_BACKWARD)) < 0) {
+            char  err[1024];
+            snprintf(err, 1024, "Could not seek to segment (error '%s')", av_err2str(error));
+            seg->err = strdup(err);
+            goto cleanup;
+        }
+    }
+
+    while (!finished && !_segment_complete(seg))
+    {
+        av_frame_unref(frame);
+        if (decode_audio_frame(frame, session->input_packet, ifc, icc, idx, &data_present, &finished, &seg->err))
+            goto cleanup;
+
+        if (!data_present)
+            continue;
+
+        if (pos < 0) {
+            if (frame->pts == AV_NOPTS_VALUE) {
+                seg->err = strdup("No timestamps to segment input");
+                goto cleanup;
+            }
+            if ( (pos = av_rescale_q(frame->pts - start_time, st->time_base, in_tb)) > from) {
+                seg->err = strdup("Could not seek ahead of segment");
+                goto cleanup;
+            }
+        }
+
+        if (seg->loudness) {
+            const int64_t  m0 = FFMAX(pos, measure_from);
+            const int64_t  m1 = FFMIN(pos + frame->nb_samples, measure_to);
+            if (m1 > m0)
+                gpod_ff_loudness_add(seg->loudness, frame, (int)(m0 - pos), (int)(m1 - m0));
+        }
+
+        const int  trim = (int)FFMIN(FFMAX(from - pos, 0), frame->nb_samples);
+        pos += frame->nb_samples;
+        if (trim == frame->nb_samples)
+            continue;
+
+        if (_segment_convert(seg, icc, frame, trim) < 0 ||
+            _segment_encode_fifo(seg, &pts, false) < 0)
+            goto cleanup;
+    }
+
+    if (finished) {
+        // drain the resampler and encoder, this segment holds the end of the input
+        if (_segment_convert(seg, icc, NULL, 0) < 0 ||
+            _segment_encode_fifo(seg, &pts, true) < 0 ||
+            _segment_encode(seg, NULL) < 0)
+            goto cleanup;
+    }
+    seg->ret = 0;
+
+cleanup:
+    av_frame_unref(frame);
+    if (session->output_frame)
+        av_frame_unref(session->output_frame);
+    av_packet_unref(session->input_packet);
+    av_packet_unref(session->output_packet);
+    if (icc)
+        avcodec_free_context(&icc);
+    if (ifc)
+        avformat_close_input(&ifc);
+
+    return NULL;
+}
+
+/**
+ * Transcode the input as concurrent segments if it's long enough to benefit.
+ * @return 0 on success, > 0 if the input was not segmented and should be
+ *         transcoded serially, otherwise an error code
+ */
+static int _transcode_segmented(struct gpod_ff_media_info *info_, struct gpod_ff_transcode_ctx* target_,
+                                struct gpod_ff_transcode_session* session, char** err_)
+{
+#if LIBAVFORMAT_VERSION_MAJOR > 58
+    const
+#endif
+    AVOutputFormat *output_format  = NULL;
+    AVFormatContext*  ifc = NULL;
+    AVCodecContext*  icc = NULL;
+    AVFormatContext*  ofc = NULL;
+    struct _segment_out  out = { 0 };
+    struct _segment*  segs = NULL;
+    GThread**  threads = NULL;
+    struct _enc_cfg  cfg;
+    char*  err = NULL;
+    int  idx;
+    int  n = 0;
+    int  ret = 1;
+
+    if ( !(output_format = av_guess_format(NULL, target_->path, NULL)) ||
+         open_input_file(info_->path, &ifc, &icc, &idx, 1, &err) < 0)
+        goto cleanup;
+
+    if (ifc->duration == AV_NOPTS_VALUE ||
+        ifc->duration < 2*GPOD_FF_XCODE_SEGMENT_MIN*(int64_t)AV_TIME_BASE)
+        goto cleanup;
+
+    if (_output_enc_cfg(target_, session, icc, output_format, &cfg, &err) < 0)
+        goto cleanup;
+    cfg.segmented = true;
+    cfg.threads = 1;  // the budget is spent on the segments
+
+    // used by first segment and provides the stream params for the output
+    if (_session_encoder(session, &cfg, &err) < 0 || session->enc->frame_size <= 0)
+        goto cleanup;
+    // nothing encoded yet, the first segment takes it as is rather than reset/reopen
+    session->enc_used = false;
+
+    const int64_t  frame_size = session->enc->frame_size;
+    const int64_t  out_rate = session->enc->sample_rate;
+    const int64_t  step = out_rate / av_gcd(icc->sample_rate, out_rate);
+    const int64_t  granule = frame_size / av_gcd(frame_size, step) * step;
+    const int64_t  total = av_rescale(ifc->duration, out_rate, AV_TIME_BASE);
+    const int64_t  preroll = (GPOD_FF_XCODE_SEGMENT_PREROLL*out_rate + granule-1) / granule * granule;
+
+    n = (int)FFMIN(target_->segments, total / (GPOD_FF_XCODE_SEGMENT_MIN*out_rate));
+    if (n < 2)
+        goto cleanup;
+
+    const int64_t  len = (total/n + granule-1) / granule * granule;
+
+    segs = (struct _segment*)calloc(n, sizeof(struct _segment));
+    threads = (GThread**)calloc(n, sizeof(GThread*));
+    for (int i=0; i<n; ++i) {
+        struct _segment*  seg = &segs[i];
+        seg->path = info_->path;
+        seg->cfg = &cfg;
+        seg->target = target_;
+        seg->from = i == 0 ? 0 : i*len - preroll;
+        seg->skip = i == 0 ? 0 : preroll / frame_size;
+        seg->keep = i == n-1 ? -1 : len / frame_size;
+        seg->measure_from = i*len;
+        seg->measure_to = i == n-1 ? -1 : (i+1)*len;
+        seg->out = i == 0 ? &out : NULL;
+        if (i > 0 && (seg->spool = tmpfile()) == NULL)
+            goto cleanup;
+        if ( (seg->session = i == 0 ? session : gpod_ff_transcode_session_new()) == NULL)
+            goto cleanup;
+    }
+
+    /* a failed segment still falls back to the serial transcode which
+     * rewrites the output */
+    if (_output_open(target_->path, output_format, session->enc, NULL, &ofc, &err) < 0)
+        goto cleanup;
+
+    if (target_->sync_meta) {
+	av_dict_copy(&ofc->metadata, ifc->metadata, 0);
+    }
+
+    if (write_output_file_header(ofc, &err) < 0)
+        goto cleanup;
+
+    out.ofc = ofc;
+    out.time_base = session->enc->time_base;
+    out.initial_padding = session->enc->initial_padding;
+    out.frame_size = session->enc->frame_size;
+
+    for (int i=1; i<n; ++i) {
+        threads[i] = g_thread_new("gpod-ff-seg", _segment_xcode, &segs[i]);
+    }
+    _segment_xcode(&segs[0]);
+    for (int i=1; i<n; ++i) {
+        g_thread_join(threads[i]);
+    }
+
+    for (int i=0; i<n; ++i) {
+        if (segs[i].ret < 0) {
+            g_printerr("segment %d/%d of %s failed, transcoding serially - %s\n",
+                       i+1, n, info_->path, segs[i].err ? segs[i].err : "<unknown error>");
+            goto cleanup;
+        }
+    }
+
+    /* all segments encoded, anything failing from here on is a real error */
+    AVPacket*  pkt = session->output_packet;
+    for (int i=1; i<n; ++i) {
+        rewind(segs[i].spool);
+        while ( (ret = _segment_spool_read(segs[i].spool, pkt)) > 0) {
+            if ( (ret = _segment_out_write(&out, pkt, err_)) < 0)
+                goto cleanup;
+        }
+        if (ret < 0) {
+            av_packet_unref(pkt);
+            *err_ = strdup("Could not read spooled packets");
+            goto cleanup;
+        }
+        fclose(segs[i].spool);
+        segs[i].spool = NULL;
+    }
+
+    if ( (ret = write_output_file_trailer(ofc, err_)) < 0)
+        goto cleanup;
+
+    if (target_->loudness) {
+        /* block energies of each segment's share, less the blocks straddling
+         * the boundaries */
+        for (int i=1; i<n; ++i) {
+            gpod_ff_loudness_merge(segs[0].loudness, segs[i].loudness);
+        }
+        if (!gpod_ff_loudness_lufs(segs[0].loudness, &target_->lufs))
+            target_->lufs = 0;
+    }
+
+    ret = 0;
+
+cleanup:
+    if (segs) {
+        for (int i=0; i<n; ++i) {
+            gpod_ff_loudness_free(segs[i].loudness);
+            if (segs[i].session != session) {
+                gpod_ff_transcode_session_free(segs[i].session);
+            }
+            if (segs[i].spool) {
+                fclose(segs[i].spool);
+            }
+            free(segs[i].err);
+        }
+        free(segs);
+    }
+    free(threads);
+    if (ret > 0 && err) {
+        g_printerr("unable to segment %s, transcoding serially - %s\n", info_->path, err);
+    }
+    free(err);
+
+    if (ofc) {
+        avio_closep(&ofc->pb);
+        avformat_free_context(ofc);
+    }
+    if (icc)
+        avcodec_free_context(&icc);
+    if (ifc)
+        avformat_close_input(&ifc);
+
+    return ret;
+}
+
+int  gpod_ff_transcode(struct gpod_ff_media_info *info_, struct gpod_ff_transcode_ctx* target_, char** err_)
+{
+    AVFormatContext  *input_format_context = NULL, *output_format_context = NULL;
+    AVCodecContext  *input_codec_context = NULL, *output_codec_context = NULL;
+    SwrContext  *resample_context = NULL;
+    AVAudioFifo  *fifo = NULL;
+    /* Temporary storage of the input samples of the frame read from the file. */
+    AVFrame *input_frame = NULL;
+    AVFrame *output_frame = NULL;
+    AVPacket *input_packet = NULL;
+    AVPacket *output_packet = NULL;
+    struct gpod_ff_loudness*  loudness = NULL;
+    int ret = AVERROR_EXIT;
+    int audio_stream_idx;
+
+    /* without a caller provided session everything is setup and torn down
+     * for this file alone */
+    struct gpod_ff_transcode_session*  session = target_->session ? target_->session : gpod_ff_transcode_session_new();
+    if (session == NULL) {
+        *err_ = strdup("Could not allocate transcode session");
+        return AVERROR(ENOMEM);
+    }
+    input_frame = session->input_frame;
+    output_frame = session->output_frame;
+    input_packet = session->input_packet;
+    output_packet = session->output_packet;
+    session->allocs = 0;
+    target_->realtime = 0;
+    target_->lufs = 0;
+
+    /* timestamp for the audio frames. */
+    int64_t pts = 0;
+    const gint64  then = g_get_monotonic_time();
+
+    if (target_->segments > 1) {
+        if ( (ret = _transcode_segmented(info_, target_, session, err_)) <= 0) {
+            goto segmented;
+        }
+        ret = AVERROR_EXIT;
+    }
+
+    if (_session_codec(target_, session, err_))
+        goto cleanup;
+
+    /* Open the input file for reading. */
+    if (open_input_file(info_->path, &input_format_context,
+                        &input_codec_context, &audio_stream_idx,
+                        _dec_threads(session->codec, target_->threads), err_))
+        goto cleanup;
+
+    /* Open the output file for writing. */
+    if (open_output_file(target_, session, input_codec_context,
+                         &output_format_context, &output_codec_context, err_))
+        goto cleanup;
+
+    if (target_->loudness) {
+        if ( (loudness = gpod_ff_loudness_new(input_codec_context)) == NULL) {
+            *err_ = strdup("Could not allocate loudness meter");
+            goto cleanup;
+        }
+        session->loudness = loudness;
+    }
+
+    if (target_->sync_meta) {
+	av_dict_copy(&output_format_context->metadata, input_format_context->metadata, 0);
+    }
+
+#ifdef GPOD_XCODE_SWR_DEBUG
+    printf("input: file=%s  channels=%d  layout=%d  format=%s  sample_rate=%d  output: channels=%d  layout=%d  format=%s  sample_rate=%d\n",
+	    info_->path, input_codec_context->channels, input_codec_context->channel_layout, av_get_sample_fmt_name(input_codec_context->sample_fmt), input_codec_context->sample_rate,
+	    output_codec_context->channels, output_codec_context->channel_layout, av_get_sample_fmt_name(output_codec_context->sample_fmt), output_codec_context->sample_rate
+	    );
+#endif
+
+    /* Initialize the resampler to be able to convert audio sample formats,
+     * unless the encoder was negotiated to take the decoder's output as is. */
+    if (input_codec_context->sample_fmt != output_codec_context->sample_fmt ||
+        input_codec_context->sample_rate != output_codec_context->sample_rate ||
+        GPOD_FF_CTX_CHANNELS(input_codec_context) != GPOD_FF_CTX_CHANNELS(output_codec_context))
+    {
+        if (_session_resampler(session, input_codec_context, output_codec_context, target_, err_))
+            goto cleanup;
+        resample_context = session->swr;
+    }
+
+    /* Initialize the FIFO buffer to store audio samples to be encoded. */
+    if (_session_fifo(&session->fifo, &session->fifo_cfg, output_codec_context, &session->allocs, err_))
+        goto cleanup;
+    fifo = session->fifo;
+
+    /* Write the header of the output file container. */
+    if (write_output_file_header(output_format_context, err_))
+        goto cleanup;
+
+    /* Loop as long as we have input samples to read or output samples
+     * to write; abort as soon as we have neither. */
+    while (1) {
+        /* Use the encoder's desired frame size for processing. */
+        const int output_frame_size = output_codec_context->frame_size;
+        int finished                = 0;
+
+        /* Make sure that there is one frame worth of samples in the FIFO
+         * buffer so that the encoder can do its work.
+         * Since the decoder's and the encoder's frame size may differ, we
+         * need to FIFO buffer to store as many frames worth of input samples
+         * that they make up at least one frame worth of output samples.
+         * Sample rate conversion streams through the resampler into the
+         * same FIFO, its delay drained once the input is finished. */
+        while (av_audio_fifo_size(fifo) < output_frame_size) {
+            /* Decode one frame worth of audio samples, convert it to the
+             * output sample format and put it into the FIFO buffer. */
+            if (read_decode_convert_and_store(fifo, input_frame, input_packet, input_format_context,
+                        input_codec_context,
+                        audio_stream_idx,
+                        output_codec_context,
+                        resample_context,
+                        session, &finished, err_))
+                goto cleanup;
+
+            /* If we are at the end of the input file, we continue
+             * encoding the remaining audio samples to the output file. */
+            if (finished)
+                break;
+        }
+
+        /* If we have enough samples for the encoder, we encode them.
+         * At the end of the file, we pass the remaining samples to
+         * the encoder. */
+        while (av_audio_fifo_size(fifo) >= output_frame_size ||
+               (finished && av_audio_fifo_size(fifo) > 0))
+            /* Take one frame worth of audio samples from the FIFO buffer,
+             * encode it and write it to the output file. */
+            if (load_encode_and_write(fifo, &output_frame, output_packet, output_format_context,
+                                      output_codec_context, &pts, &session->allocs, err_))
+                goto cleanup;
+
+        /* If we are at the end of the input file and have encoded
+         * all remaining samples, we can exit this loop and finish. */
+        if (finished) {
+            int data_written;
+            /* Flush the encoder as it may have delayed frames. */
+            do {
+                if (encode_audio_frame(NULL, output_packet, output_format_context,
+                                       output_codec_context, &pts, &data_written, err_))
+                    goto cleanup;
+            } while (data_written);
+            break;
+        }
     }
 
     /* Write the trailer of the output file container. */
     if (write_output_file_trailer(output_format_context, err_))
         goto cleanup;
 
-    struct stat  st;
-    stat(info_->path, &st);
-    info_->file_size = st.st_size;
-
+    if (loudness && !gpod_ff_loudness_lufs(loudness, &target_->lufs))
+        target_->lufs = 0;
     ret = 0;
 
+segmented:
+    if (ret == 0) {
+        struct stat  st;
+        stat(info_->path, &st);
+        info_->file_size = st.st_size;
+        target_->realtime = _realtime(info_->audio.song_length*1000LL, then);
+    }
+
 cleanup:
-    if (input_samples_fifo)
-        av_audio_fifo_free(input_samples_fifo);
-    if (fifo)
-        av_audio_fifo_free(fifo);
-    swr_free(&resample_context);
-    if (output_codec_context)
-        avcodec_free_context(&output_codec_context);
     if (output_format_context) {
         avio_closep(&output_format_context->pb);
         avformat_free_context(output_format_context);
@@ -1245,14 +2239,840 @@ cleanup:
         avcodec_free_context(&input_codec_context);
     if (input_format_context)
         avformat_close_input(&input_format_context);
-    if (input_frame)
-        av_frame_free(&input_frame);
-    if (input_packet)
-        av_packet_free(&input_packet);
+
+    // may have been free'd/realloc'd on error
+    session->output_frame = output_frame;
+    session->loudness = NULL;
+    gpod_ff_loudness_free(loudness);
+    target_->allocs = session->allocs;
+    av_frame_unref(input_frame);
     if (output_frame)
-        av_frame_free(&output_frame);
-    if (output_packet)
-        av_packet_free(&output_packet);
+        av_frame_unref(output_frame);
+    av_packet_unref(input_packet);
+    av_packet_unref(output_packet);
+
+    if (ret < 0) {
+        // encoder/resampler in unknown state, don't reuse
+        avcodec_free_context(&session->enc);
+        swr_free(&session->swr);
+    }
+    else {
+        _session_enc_release(session);
+    }
+
+    if (session != target_->session) {
+        gpod_ff_transcode_session_free(session);
+    }
+
+    return ret;
+}
+
+int  gpod_ff_loudness_scan(double* lufs_, const char* file_, unsigned threads_, char** err_)
+{
+    AVFormatContext*  ifc = NULL;
+    AVCodecContext*  icc = NULL;
+    AVFrame*  frame = NULL;
+    AVPacket*  pkt = NULL;
+    struct gpod_ff_loudness*  loudness = NULL;
+    int  idx;
+    int  finished = 0;
+    int  data_present;
+    int  ret = AVERROR_EXIT;
+
+    if (open_input_file(file_, &ifc, &icc, &idx, threads_, err_))
+        goto cleanup;
+
+    if ( !(frame = av_frame_alloc()) || !(pkt = av_packet_alloc()) ||
+         !(loudness = gpod_ff_loudness_new(icc)) ) {
+        *err_ = strdup("Could not allocate frame/packet/loudness meter");
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    while (!finished)
+    {
+        av_frame_unref(frame);
+        if ( (ret = decode_audio_frame(frame, pkt, ifc, icc, idx, &data_present, &finished, err_)) < 0)
+            goto cleanup;
+
+        if (data_present)
+            gpod_ff_loudness_add(loudness, frame, 0, frame->nb_samples);
+    }
+
+    ret = gpod_ff_loudness_lufs(loudness, lufs_) ? 0 : 1;
+
+cleanup:
+    gpod_ff_loudness_free(loudness);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    if (icc)
+        avcodec_free_context(&icc);
+    if (ifc)
+        avformat_close_input(&ifc);
+
+    return ret;
+}
+
+int  gpod_ff_remux(struct gpod_ff_media_info *info_, struct gpod_ff_transcode_ctx* target_, char** err_)
+{
+#if LIBAVFORMAT_VERSION_MAJOR > 58
+    const
+#endif
+    AVOutputFormat *output_format  = NULL;
+    AVFormatContext*  ifc = NULL;
+    AVFormatContext*  ofc = NULL;
+    AVPacket*  pkt = NULL;
+    int64_t  offset = AV_NOPTS_VALUE;
+    int  idx;
+    int  ret;
+
+    if (!(output_format = av_guess_format(NULL, target_->path, NULL))) {
+        *err_ = strdup("Could not find output file format");
+        return AVERROR_EXIT;
+    }
+
+    if ((ret = avformat_open_input(&ifc, info_->path, NULL, NULL)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not open input file '%s' (error '%s')",
+                info_->path, av_err2str(ret));
+        *err_ = strdup(err);
+        return ret;
+    }
+
+    if ((ret = avformat_find_stream_info(ifc, NULL)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not open find stream info (error '%s')",
+                av_err2str(ret));
+        *err_ = strdup(err);
+        goto cleanup;
+    }
+
+    if ((idx = av_find_best_stream(ifc, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0)) < 0) {
+        *err_ = strdup("Expected an audio input stream, but found none");
+        ret = AVERROR_EXIT;
+        goto cleanup;
+    }
+    const AVStream*  ist = ifc->streams[idx];
+
+    if ((ret = _output_open(target_->path, output_format, NULL, ist->codecpar, &ofc, err_)) < 0)
+        goto cleanup;
+
+    if (target_->sync_meta) {
+	av_dict_copy(&ofc->metadata, ifc->metadata, 0);
+    }
+
+    if ((ret = write_output_file_header(ofc, err_)) < 0)
+        goto cleanup;
+
+    if ( (pkt = av_packet_alloc()) == NULL) {
+        *err_ = strdup("Could not allocate packet");
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    const AVStream*  ost = ofc->streams[0];
+    while ((ret = av_read_frame(ifc, pkt)) >= 0)
+    {
+        if (pkt->stream_index != idx) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        // streams such as mpegts don't start at 0
+        if (offset == AV_NOPTS_VALUE) {
+            offset = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : (pkt->pts != AV_NOPTS_VALUE ? pkt->pts : 0);
+        }
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts -= offset;
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts -= offset;
+
+        av_packet_rescale_ts(pkt, ist->time_base, ost->time_base);
+        pkt->stream_index = 0;
+        pkt->pos = -1;
+
+        /* interleaved write so the muxer applies any bitstream filter it
+         * needs, ie adts to mp4 */
+        if ((ret = av_interleaved_write_frame(ofc, pkt)) < 0) {
+            char  err[1024];
+            snprintf(err, 1024, "Could not write frame (error '%s')", av_err2str(ret));
+            *err_ = strdup(err);
+            goto cleanup;
+        }
+    }
+    if (ret != AVERROR_EOF) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not read frame (error '%s')", av_err2str(ret));
+        *err_ = strdup(err);
+        goto cleanup;
+    }
+
+    if ((ret = write_output_file_trailer(ofc, err_)) < 0)
+        goto cleanup;
+
+    struct stat  st;
+    if (stat(target_->path, &st) == 0) {
+        info_->file_size = st.st_size;
+    }
+    ret = 0;
+
+cleanup:
+    av_packet_free(&pkt);
+    if (ofc) {
+        avio_closep(&ofc->pb);
+        avformat_free_context(ofc);
+    }
+    avformat_close_input(&ifc);
+
+    return ret;
+}
+
+
+/* video transcode: decode -> scale -> h264 baseline, audio decode -> resample
+ * -> aac, muxed to m4v
+ */
+struct _video_xcode {
+    AVFormatContext*  ifc;
+    AVFormatContext*  ofc;
+
+    int  vidx;
+    int  aidx;
+    AVCodecContext*  vdec;
+    AVCodecContext*  venc;
+    AVCodecContext*  adec;
+    AVCodecContext*  aenc;
+
+    struct SwsContext*  sws;
+    SwrContext*  swr;
+    AVAudioFifo*  fifo;
+    struct _scratch  scratch;
+    unsigned  allocs;
+    struct gpod_ff_loudness*  loudness;
+
+    AVFrame*  frame;
+    AVFrame*  scaled;
+    AVFrame*  aframe;
+    AVPacket*  pkt;
+    AVPacket*  opkt;
+
+    int64_t  vpts;  // last video pts sent to encoder
+    int64_t  apts;  // next audio pts, in samples
+};
+
+/**
+ * Open a decoder for the input stream.
+ * @return Error code (0 if successful)
+ */
+static int _video_open_decoder(AVFormatContext* ifc_, int idx_, unsigned threads_,
+                               AVCodecContext** ctx_, char** err_)
+{
+    const AVStream*  stream = ifc_->streams[idx_];
+    const AVCodec*  codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    int  error;
+
+    if (codec == NULL || (*ctx_ = avcodec_alloc_context3(codec)) == NULL) {
+        *err_ = strdup("Could not allocate a decoding context");
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+
+    if ((error = avcodec_parameters_to_context(*ctx_, stream->codecpar)) < 0) {
+        *err_ = strdup("Could not initialize decoder parameters");
+        return error;
+    }
+    (*ctx_)->pkt_timebase = stream->time_base;
+    (*ctx_)->thread_count = threads_;
+
+    if ((error = avcodec_open2(*ctx_, codec, NULL)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not open input codec (error '%s')", av_err2str(error));
+        *err_ = strdup(err);
+        return error;
+    }
+    return 0;
+}
+
+/**
+ * Open the h264 encoder, scaling the input to fit the device limits whilst
+ * keeping its display aspect.
+ * @return Error code (0 if successful)
+ */
+static int _video_open_venc(struct _video_xcode* x_, const struct gpod_ff_transcode_ctx* target_,
+                            unsigned threads_, char** err_)
+{
+    const AVStream*  st = x_->ifc->streams[x_->vidx];
+    const AVCodec*  codec;
+    AVDictionary*  opts = NULL;
+    int  error;
+
+    if ( (codec = avcodec_find_encoder_by_name(target_->video_opts.enc_name)) == NULL) {
+        char  err[256];
+        snprintf(err, 256,"Could not find encoder %s.", target_->video_opts.enc_name);
+        *err_ = strdup(err);
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    if ( (x_->venc = avcodec_alloc_context3(codec)) == NULL) {
+        *err_ = strdup("Could not allocate an encoding context");
+        return AVERROR(ENOMEM);
+    }
+
+    AVRational  sar = x_->vdec->sample_aspect_ratio;
+    if (sar.num <= 0 || sar.den <= 0) {
+        sar = (AVRational){ 1, 1 };
+    }
+    const int64_t  dw = av_rescale(x_->vdec->width, sar.num, sar.den);
+    int64_t  w = FFMIN(dw, target_->video_opts.width);
+    int64_t  h = av_rescale(x_->vdec->height, w, dw);
+    if (h > target_->video_opts.height) {
+        h = target_->video_opts.height;
+        w = av_rescale(dw, h, x_->vdec->height);
+    }
+
+    AVRational  fps = av_guess_frame_rate(x_->ifc, (AVStream*)st, NULL);
+    if (fps.num <= 0 || fps.den <= 0 || av_q2d(fps) > target_->video_opts.fps) {
+        fps = av_d2q(target_->video_opts.fps, 1001);
+    }
+
+    AVCodecContext*  enc = x_->venc;
+    enc->width = FFMAX(w & ~1, 2);
+    enc->height = FFMAX(h & ~1, 2);
+    enc->sample_aspect_ratio = (AVRational){ 1, 1 };
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    enc->framerate = fps;
+    enc->time_base = av_inv_q(fps);
+    enc->bit_rate = target_->video_opts.bitrate;
+    enc->rc_max_rate = target_->video_opts.max_bitrate;
+    enc->rc_buffer_size = target_->video_opts.max_bitrate;
+    enc->max_b_frames = 0;
+    enc->profile = FF_PROFILE_H264_BASELINE;
+    enc->level = 30;
+    enc->thread_count = threads_;
+    enc->thread_type = FF_THREAD_FRAME;
+    if (x_->ofc->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    av_dict_set(&opts, "profile", "baseline", 0);
+    av_dict_set(&opts, "preset", "fast", 0);
+    error = avcodec_open2(enc, codec, &opts);
+    av_dict_free(&opts);
+    if (error < 0) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not open video codec (error '%s')", av_err2str(error));
+        *err_ = strdup(err);
+        return error;
+    }
+
+    if ( (x_->sws = sws_getContext(x_->vdec->width, x_->vdec->height, x_->vdec->pix_fmt,
+                                   enc->width, enc->height, enc->pix_fmt,
+                                   SWS_BICUBIC, NULL, NULL, NULL)) == NULL) {
+        *err_ = strdup("Could not create scaler");
+        return AVERROR(EINVAL);
+    }
+
+    x_->scaled->format = enc->pix_fmt;
+    x_->scaled->width = enc->width;
+    x_->scaled->height = enc->height;
+    if ((error = av_frame_get_buffer(x_->scaled, 0)) < 0) {
+        *err_ = strdup("Could not allocate scaled frame");
+        return error;
+    }
+    return 0;
+}
+
+/**
+ * Open the aac encoder and the resampler feeding it.
+ * @return Error code (0 if successful)
+ */
+static int _video_open_aenc(struct _video_xcode* x_, const struct gpod_ff_transcode_ctx* target_, char** err_)
+{
+    const AVCodec*  codec;
+    int  error;
+
+    if ( (codec = avcodec_find_encoder_by_name(target_->video_opts.audio_enc_name)) == NULL) {
+        char  err[256];
+        snprintf(err, 256,"Could not find encoder %s.", target_->video_opts.audio_enc_name);
+        *err_ = strdup(err);
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    if ( (x_->aenc = avcodec_alloc_context3(codec)) == NULL) {
+        *err_ = strdup("Could not allocate an encoding context");
+        return AVERROR(ENOMEM);
+    }
+
+    AVCodecContext*  enc = x_->aenc;
+    const int  channels = FFMIN(GPOD_FF_CTX_CHANNELS(x_->adec), target_->video_opts.channels);
+#ifdef HAVE_FF5_CH_LAYOUT
+    av_channel_layout_default(&enc->ch_layout, channels);
+#else
+    enc->channels       = channels;
+    enc->channel_layout = av_get_default_channel_layout(channels);
+#endif
+    enc->sample_rate = _select_samplerate(codec, x_->adec->sample_rate);
+    enc->sample_fmt = codec->sample_fmts[0];
+    enc->bit_rate = target_->video_opts.audio_bitrate;
+    enc->time_base = (AVRational){ 1, enc->sample_rate };
+    if (x_->ofc->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if ((error = avcodec_open2(enc, codec, NULL)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not open output codec (error '%s')", av_err2str(error));
+        *err_ = strdup(err);
+        return error;
+    }
+
+    if ((error = init_resampler(x_->adec, enc, target_->audio_opts.resampler, target_->audio_opts.resample_precision, &x_->swr, err_)) < 0 ||
+        (error = init_fifo(&x_->fifo, enc, err_)) < 0) {
+        return error;
+    }
+    ++x_->allocs;
+    return 0;
+}
+
+/**
+ * Send a frame (NULL to flush) to the encoder and write out the resulting
+ * packets to the output stream.
+ * @return Error code (0 if successful)
+ */
+static int _video_encode(struct _video_xcode* x_, AVCodecContext* enc_, int ost_, AVFrame* frame_, char** err_)
+{
+    const AVStream*  st = x_->ofc->streams[ost_];
+    int  error;
+
+    if ((error = avcodec_send_frame(enc_, frame_)) < 0 && error != AVERROR_EOF) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not send frame for encoding (error '%s')", av_err2str(error));
+        *err_ = strdup(err);
+        return error;
+    }
+
+    while ((error = avcodec_receive_packet(enc_, x_->opkt)) == 0) {
+        x_->opkt->stream_index = ost_;
+        av_packet_rescale_ts(x_->opkt, enc_->time_base, st->time_base);
+        if ((error = av_interleaved_write_frame(x_->ofc, x_->opkt)) < 0) {
+            char  err[1024];
+            snprintf(err, 1024, "Could not write frame (error '%s')", av_err2str(error));
+            *err_ = strdup(err);
+            return error;
+        }
+    }
+    return error == AVERROR(EAGAIN) || error == AVERROR_EOF ? 0 : error;
+}
+
+/**
+ * Scale and encode the decoded video frame, dropping frames that would
+ * exceed the output frame rate.
+ * @return Error code (0 if successful)
+ */
+static int _video_frame(struct _video_xcode* x_, char** err_)
+{
+    const AVStream*  ist = x_->ifc->streams[x_->vidx];
+    const int64_t  start = x_->ifc->start_time == AV_NOPTS_VALUE ? 0 : x_->ifc->start_time;
+    AVFrame*  frame = x_->frame;
+    int  error;
+
+    int64_t  pts = frame->best_effort_timestamp == AV_NOPTS_VALUE ? x_->vpts+1 :
+                       av_rescale_q(frame->best_effort_timestamp, ist->time_base, x_->venc->time_base) -
+                       av_rescale_q(start, AV_TIME_BASE_Q, x_->venc->time_base);
+    if (pts < 0 || pts <= x_->vpts) {
+        return 0;
+    }
+    x_->vpts = pts;
+
+    // encoder may still hold a ref on the previous frame
+    if ((error = av_frame_make_writable(x_->scaled)) < 0) {
+        *err_ = strdup("Could not make scaled frame writable");
+        return error;
+    }
+    sws_scale(x_->sws, (const uint8_t* const*)frame->data, frame->linesize, 0, frame->height,
+              x_->scaled->data, x_->scaled->linesize);
+    x_->scaled->pts = pts;
+
+    return _video_encode(x_, x_->venc, 0, x_->scaled, err_);
+}
+
+/**
+ * Resample the decoded audio (NULL frame flushes the resampler) and encode
+ * whole encoder frames, or everything remaining when flushing.
+ * @return Error code (0 if successful)
+ */
+static int _video_audio(struct _video_xcode* x_, const AVFrame* frame_, char** err_)
+{
+    AVCodecContext*  enc = x_->aenc;
+    const int  n = frame_ ? frame_->nb_samples : 0;
+    int  error;
+
+    gpod_ff_loudness_add(x_->loudness, frame_, 0, n);
+
+    if ((error = _scratch_reserve(&x_->scratch, enc, swr_get_out_samples(x_->swr, n), &x_->allocs, err_)) < 0 ||
+        (error = convert_samples(frame_ ? (const uint8_t**)frame_->extended_data : NULL, n,
+                                 x_->scratch.data, x_->scratch.capacity, x_->swr, err_)) < 0 ||
+        (error = add_samples_to_fifo(x_->fifo, x_->scratch.data, error, &x_->allocs, err_)) < 0) {
+        return error;
+    }
+
+    while (av_audio_fifo_size(x_->fifo) >= enc->frame_size ||
+           (!frame_ && av_audio_fifo_size(x_->fifo) > 0))
+    {
+        const int  size = FFMIN(av_audio_fifo_size(x_->fifo), enc->frame_size);
+        if ((error = init_output_frame(&x_->aframe, enc, size, &x_->allocs, err_)) < 0) {
+            return error;
+        }
+        if (av_audio_fifo_read(x_->fifo, (void **)x_->aframe->data, size) < size) {
+            *err_ = strdup("Could not read data from FIFO");
+            return AVERROR_EXIT;
+        }
+        x_->aframe->pts = x_->apts;
+        x_->apts += size;
+
+        if ((error = _video_encode(x_, enc, 1, x_->aframe, err_)) < 0) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send a packet (NULL to flush) to the decoder and process every frame.
+ * @return Error code (0 if successful)
+ */
+static int _video_decode(struct _video_xcode* x_, AVCodecContext* dec_, const AVPacket* pkt_, char** err_)
+{
+    int  error;
+
+    if ((error = avcodec_send_packet(dec_, pkt_)) < 0 && error != AVERROR_EOF) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not send packet for decoding (error '%s')", av_err2str(error));
+        *err_ = strdup(err);
+        return error;
+    }
+
+    while ((error = avcodec_receive_frame(dec_, x_->frame)) == 0)
+    {
+        error = dec_ == x_->vdec ? _video_frame(x_, err_) : _video_audio(x_, x_->frame, err_);
+        av_frame_unref(x_->frame);
+        if (error < 0) {
+            return error;
+        }
+    }
+
+    if (error == AVERROR(EAGAIN) || error == AVERROR_EOF) {
+        return 0;
+    }
+    char  err[1024];
+    snprintf(err, 1024, "Could not decode frame (error '%s')", av_err2str(error));
+    *err_ = strdup(err);
+    return error;
+}
+
+int  gpod_ff_transcode_video(struct gpod_ff_media_info *info_, struct gpod_ff_transcode_ctx* target_, char** err_)
+{
+    struct _video_xcode  x;
+    AVStream*  ost;
+    int  ret;
+
+    memset(&x, 0, sizeof(x));
+    x.vpts = -1;
+    target_->realtime = 0;
+    target_->lufs = 0;
+    const gint64  then = g_get_monotonic_time();
+
+    /* split the budget, the encoder being far more expensive than decoding
+     * the (typically) larger source */
+    const unsigned  threads = FFMAX(target_->threads, 1);
+    const unsigned  dec_threads = FFMAX(threads/4, 1);
+    const unsigned  enc_threads = FFMAX(threads - dec_threads, 1);
+
+    if ((ret = avformat_open_input(&x.ifc, info_->path, NULL, NULL)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not open input file '%s' (error '%s')",
+                info_->path, av_err2str(ret));
+        *err_ = strdup(err);
+        return ret;
+    }
+
+    if ((ret = avformat_find_stream_info(x.ifc, NULL)) < 0) {
+        *err_ = strdup("Could not open find stream info");
+        goto cleanup;
+    }
+
+    if ((x.vidx = av_find_best_stream(x.ifc, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+        *err_ = strdup("Expected a video input stream, but found none");
+        ret = AVERROR_EXIT;
+        goto cleanup;
+    }
+    x.aidx = av_find_best_stream(x.ifc, AVMEDIA_TYPE_AUDIO, -1, x.vidx, NULL, 0);
+
+    if ( !(x.frame = av_frame_alloc()) || !(x.scaled = av_frame_alloc()) ||
+         !(x.pkt = av_packet_alloc()) || !(x.opkt = av_packet_alloc()) ) {
+        *err_ = strdup("Could not allocate frame/packet");
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    if ((ret = _video_open_decoder(x.ifc, x.vidx, dec_threads, &x.vdec, err_)) < 0 ||
+        (x.aidx >= 0 && (ret = _video_open_decoder(x.ifc, x.aidx, 1, &x.adec, err_)) < 0))
+        goto cleanup;
+
+    // explicit, .m4v also maps to the raw mpeg4 muxer; ipod adds the uuid atom
+    if ((ret = avformat_alloc_output_context2(&x.ofc, NULL, "ipod", target_->path)) < 0 || !x.ofc) {
+        *err_ = strdup("Could not allocate output format context");
+        ret = ret < 0 ? ret : AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    if ((ret = _video_open_venc(&x, target_, enc_threads, err_)) < 0 ||
+        (x.adec && (ret = _video_open_aenc(&x, target_, err_)) < 0))
+        goto cleanup;
+
+    if (x.adec && target_->loudness &&
+        (x.loudness = gpod_ff_loudness_new(x.adec)) == NULL) {
+        *err_ = strdup("Could not allocate loudness meter");
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    if ( (ost = avformat_new_stream(x.ofc, NULL)) == NULL ||
+         (ret = avcodec_parameters_from_context(ost->codecpar, x.venc)) < 0) {
+        *err_ = strdup("Could not create video stream");
+        ret = ret < 0 ? ret : AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    ost->time_base = x.venc->time_base;
+
+    if (x.aenc) {
+        if ( (ost = avformat_new_stream(x.ofc, NULL)) == NULL ||
+             (ret = avcodec_parameters_from_context(ost->codecpar, x.aenc)) < 0) {
+            *err_ = strdup("Could not create audio stream");
+            ret = ret < 0 ? ret : AVERROR(ENOMEM);
+            goto cleanup;
+        }
+        ost->time_base = x.aenc->time_base;
+    }
+
+    if (target_->sync_meta) {
+	av_dict_copy(&x.ofc->metadata, x.ifc->metadata, 0);
+    }
+
+    if ((ret = avio_open(&x.ofc->pb, target_->path, AVIO_FLAG_WRITE)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024,"Could not open output file '%s' (error '%s')",
+                target_->path, av_err2str(ret));
+        *err_ = strdup(err);
+        goto cleanup;
+    }
+
+    if ((ret = write_output_file_header(x.ofc, err_)) < 0)
+        goto cleanup;
+
+    while ((ret = av_read_frame(x.ifc, x.pkt)) >= 0)
+    {
+        if (x.pkt->stream_index == x.vidx) {
+            ret = _video_decode(&x, x.vdec, x.pkt, err_);
+        }
+        else if (x.adec && x.pkt->stream_index == x.aidx) {
+            ret = _video_decode(&x, x.adec, x.pkt, err_);
+        }
+        av_packet_unref(x.pkt);
+        if (ret < 0)
+            goto cleanup;
+    }
+    if (ret != AVERROR_EOF) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not read frame (error '%s')", av_err2str(ret));
+        *err_ = strdup(err);
+        goto cleanup;
+    }
+
+    // drain everything buffered in the decoders, resampler and encoders
+    if ((ret = _video_decode(&x, x.vdec, NULL, err_)) < 0 ||
+        (ret = _video_encode(&x, x.venc, 0, NULL, err_)) < 0)
+        goto cleanup;
+
+    if (x.adec) {
+        if ((ret = _video_decode(&x, x.adec, NULL, err_)) < 0 ||
+            (ret = _video_audio(&x, NULL, err_)) < 0 ||
+            (ret = _video_encode(&x, x.aenc, 1, NULL, err_)) < 0)
+            goto cleanup;
+    }
+
+    if ((ret = write_output_file_trailer(x.ofc, err_)) < 0)
+        goto cleanup;
+
+    struct stat  st;
+    if (stat(target_->path, &st) == 0) {
+        info_->file_size = st.st_size;
+    }
+    target_->allocs = x.allocs;
+    target_->realtime = _realtime(x.ifc->duration, then);
+    if (x.loudness && !gpod_ff_loudness_lufs(x.loudness, &target_->lufs))
+        target_->lufs = 0;
+    ret = 0;
+
+cleanup:
+    if (x.ofc) {
+        avio_closep(&x.ofc->pb);
+        avformat_free_context(x.ofc);
+    }
+    gpod_ff_loudness_free(x.loudness);
+    sws_freeContext(x.sws);
+    swr_free(&x.swr);
+    if (x.fifo)
+        av_audio_fifo_free(x.fifo);
+    _scratch_free(&x.scratch);
+    av_frame_free(&x.frame);
+    av_frame_free(&x.scaled);
+    av_frame_free(&x.aframe);
+    av_packet_free(&x.pkt);
+    av_packet_free(&x.opkt);
+    avcodec_free_context(&x.venc);
+    avcodec_free_context(&x.aenc);
+    avcodec_free_context(&x.vdec);
+    avcodec_free_context(&x.adec);
+    avformat_close_input(&x.ifc);
+
+    return ret;
+}
+
+int  gpod_ff_artwork_scale(uint8_t** data_, int* size_, enum AVCodecID codec_id_,
+                           const uint8_t* src_, int src_size_, unsigned max_, char** err_)
+{
+#if LIBAVFORMAT_VERSION_MAJOR > 58
+    const
+#endif
+    AVCodec*  codec;
+    AVCodecContext*  dec = NULL;
+    AVCodecContext*  enc = NULL;
+    struct SwsContext*  sws = NULL;
+    AVFrame*  frame = NULL;
+    AVFrame*  scaled = NULL;
+    AVPacket*  pkt = NULL;
+    int  ret = AVERROR_EXIT;
+
+    *data_ = NULL;
+    *size_ = 0;
+
+    if ( (codec = avcodec_find_decoder(codec_id_)) == NULL) {
+        *err_ = strdup("No decoder for artwork");
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+
+    if ( !(dec = avcodec_alloc_context3(codec)) || !(frame = av_frame_alloc()) ||
+         !(scaled = av_frame_alloc()) || !(pkt = av_packet_alloc()) ) {
+        *err_ = strdup("Could not allocate artwork decoder");
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    if ((ret = avcodec_open2(dec, codec, NULL)) < 0 ||
+        (ret = av_new_packet(pkt, src_size_)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not open artwork decoder (error '%s')", av_err2str(ret));
+        *err_ = strdup(err);
+        goto cleanup;
+    }
+    memcpy(pkt->data, src_, src_size_);
+
+    if ((ret = avcodec_send_packet(dec, pkt)) < 0 ||
+        (ret = avcodec_send_packet(dec, NULL)) < 0 ||
+        (ret = avcodec_receive_frame(dec, frame)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not decode artwork (error '%s')", av_err2str(ret));
+        *err_ = strdup(err);
+        goto cleanup;
+    }
+    av_packet_unref(pkt);
+
+    if (frame->width <= 0 || frame->height <= 0) {
+        *err_ = strdup("Invalid artwork dimensions");
+        ret = AVERROR_INVALIDDATA;
+        goto cleanup;
+    }
+
+    // already a jpeg that fits, libgpod scales to each device thumb size
+    if (codec_id_ == AV_CODEC_ID_MJPEG && frame->width <= max_ && frame->height <= max_) {
+        if ( (*data_ = (uint8_t*)malloc(src_size_)) == NULL) {
+            ret = AVERROR(ENOMEM);
+            goto cleanup;
+        }
+        memcpy(*data_, src_, src_size_);
+        *size_ = src_size_;
+        ret = 0;
+        goto cleanup;
+    }
+
+    // fit within max_, keeping the aspect
+    int  w = frame->width;
+    int  h = frame->height;
+    if (w > max_ || h > max_) {
+        if (w >= h) {
+            h = FFMAX((int)av_rescale(h, max_, w), 1);
+            w = max_;
+        }
+        else {
+            w = FFMAX((int)av_rescale(w, max_, h), 1);
+            h = max_;
+        }
+    }
+
+    if ( (codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG)) == NULL ||
+         (enc = avcodec_alloc_context3(codec)) == NULL) {
+        *err_ = strdup("No jpeg encoder for artwork");
+        ret = AVERROR_ENCODER_NOT_FOUND;
+        goto cleanup;
+    }
+    enc->width = w;
+    enc->height = h;
+    enc->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    enc->time_base = (AVRational){ 1, 25 };
+    enc->flags |= AV_CODEC_FLAG_QSCALE;
+    enc->global_quality = FF_QP2LAMBDA * 3;
+
+    if ((ret = avcodec_open2(enc, codec, NULL)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not open artwork encoder (error '%s')", av_err2str(ret));
+        *err_ = strdup(err);
+        goto cleanup;
+    }
+
+    scaled->format = enc->pix_fmt;
+    scaled->width = w;
+    scaled->height = h;
+    if ((ret = av_frame_get_buffer(scaled, 0)) < 0 ||
+        (sws = sws_getContext(frame->width, frame->height, frame->format,
+                              w, h, enc->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL)) == NULL) {
+        *err_ = strdup("Could not setup artwork scaler");
+        ret = ret < 0 ? ret : AVERROR(EINVAL);
+        goto cleanup;
+    }
+    sws_scale(sws, (const uint8_t* const*)frame->data, frame->linesize, 0, frame->height,
+              scaled->data, scaled->linesize);
+    scaled->pts = 0;
+    scaled->quality = enc->global_quality;
+
+    if ((ret = avcodec_send_frame(enc, scaled)) < 0 ||
+        (ret = avcodec_send_frame(enc, NULL)) < 0 ||
+        (ret = avcodec_receive_packet(enc, pkt)) < 0) {
+        char  err[1024];
+        snprintf(err, 1024, "Could not encode artwork (error '%s')", av_err2str(ret));
+        *err_ = strdup(err);
+        goto cleanup;
+    }
+
+    if ( (*data_ = (uint8_t*)malloc(pkt->size)) == NULL) {
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    memcpy(*data_, pkt->data, pkt->size);
+    *size_ = pkt->size;
+    ret = 0;
+
+cleanup:
+    sws_freeContext(sws);
+    av_frame_free(&frame);
+    av_frame_free(&scaled);
+    av_packet_free(&pkt);
+    avcodec_free_context(&dec);
+    avcodec_free_context(&enc);
 
     return ret;
 }
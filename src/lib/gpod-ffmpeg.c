@@ -53,6 +53,9 @@ void gpod_ff_meta_free(struct gpod_ff_meta*  obj_)
 void  gpod_ff_media_info_free(struct gpod_ff_media_info*  obj_)
 {
     gpod_ff_meta_free(&obj_->meta);
+    free(obj_->artwork.data);
+    obj_->artwork.data = NULL;
+    obj_->artwork.size = 0;
 }
 
 void  gpod_ff_media_info_init(struct gpod_ff_media_info*  obj_)
@@ -76,15 +79,6 @@ struct metadata_map
     int (*handler_function) (struct gpod_ff_meta*, char *);
 };
 
-static char errbuf[64];
-
-static inline char *
-err2str (int errnum)
-{
-    av_strerror (errnum, errbuf, sizeof (errbuf));
-    return errbuf;
-}
-
 static int
 parse_genre(struct gpod_ff_meta *mfi, char *genre_string)
 {
@@ -375,6 +369,10 @@ static bool  device_support_video(Itdb_IpodGeneration idevice_, const struct gpo
 {
     const struct gpod_video_support*  p = video_support;
 
+    if (mi_->video.codec_id != AV_CODEC_ID_H264) {
+        return false;
+    }
+
     while (p->profile)
     {
 	if (mi_->video.height <= p->max_height &&
@@ -405,11 +403,122 @@ static bool  device_support_video(Itdb_IpodGeneration idevice_, const struct gpo
 }
 
 
-int  gpod_ff_scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_IpodGeneration idevice_, char** err_)
+/* fast probe limits - enough for the headers and a handful of frames, the
+ * defaults (5MB/5s) decode well into the file
+ */
+#define GPOD_FF_FAST_PROBESIZE        (64*1024)
+#define GPOD_FF_FAST_ANALYZEDURATION  (AV_TIME_BASE/2)
+
+static int  _par_channels(const AVCodecParameters* par_)
+{
+#ifdef HAVE_FF5_CH_LAYOUT
+    return par_->ch_layout.nb_channels;
+#else
+    return par_->channels;
+#endif
+}
+
+static int64_t  _duration(const AVFormatContext* ctx_, const AVStream* st_)
+{
+    if (ctx_->duration != AV_NOPTS_VALUE) {
+        return ctx_->duration;
+    }
+    return st_ && st_->duration != AV_NOPTS_VALUE ? av_rescale_q(st_->duration, st_->time_base, AV_TIME_BASE_Q) : AV_NOPTS_VALUE;
+}
+
+/* have we everything the scan needs: audio params and duration or, for real
+ * video, the picture size
+ */
+static bool  _probe_complete(const AVFormatContext* ctx_)
+{
+    const AVStream*  ast = NULL;
+    bool  video = false;
+
+    for (unsigned i=0; i<ctx_->nb_streams; ++i) {
+        const AVStream*  st = ctx_->streams[i];
+        const AVCodecParameters*  par = st->codecpar;
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO && !(st->disposition & AV_DISPOSITION_ATTACHED_PIC) &&
+            par->codec_id != AV_CODEC_ID_MJPEG && par->codec_id != AV_CODEC_ID_MJPEGB) {
+            if (par->width <= 0 || par->height <= 0)
+                return false;
+            video = true;
+        }
+        if (par->codec_type == AVMEDIA_TYPE_AUDIO && ast == NULL) {
+            ast = st;
+        }
+    }
+
+    if (ast && (ast->codecpar->codec_id == AV_CODEC_ID_NONE ||
+                ast->codecpar->sample_rate <= 0 || _par_channels(ast->codecpar) <= 0))
+        return false;
+
+    return (ast || video) && _duration(ctx_, ast) != AV_NOPTS_VALUE;
+}
+
+/* mp3 (with a xing/vbri/info header), mp4 and flac carry the stream params
+ * and duration in their headers, no frames need to be read
+ */
+static bool  _header_only(const AVFormatContext* ctx_)
+{
+    const char*  name = ctx_->iformat->name;
+    return (strcmp(name, "mp3") == 0 || strcmp(name, "flac") == 0 || strstr(name, "mp4")) &&
+           _probe_complete(ctx_);
+}
+
+/* Open and probe the file, in fast mode with tight probe limits and without
+ * reading any frames where the headers suffice.
+ * @return 0 on success, 1 if the fast probe was incomplete, otherwise error
+ */
+static int  _probe(AVFormatContext** ctx_, const char* file_, bool fast_, char** err_)
+{
+    int  ret;
+
+    if (fast_) {
+        if ( (*ctx_ = avformat_alloc_context()) == NULL) {
+            *err_ = strdup("failed to allocate format context");
+            return -1;
+        }
+        (*ctx_)->probesize = GPOD_FF_FAST_PROBESIZE;
+        (*ctx_)->max_analyze_duration = GPOD_FF_FAST_ANALYZEDURATION;
+    }
+
+    // ctx is freed on failure
+    if ( (ret = avformat_open_input(ctx_, file_, NULL, NULL)) < 0) {
+        if (fast_) {
+            // format couldn't be identified in the probe size, ie large id3 tags
+            return 1;
+        }
+        char  err[1024];
+        snprintf(err, 1024, "%s", av_err2str(ret));
+        *err_ = strdup(err);
+        return -1;
+    }
+
+    if (fast_ && _header_only(*ctx_)) {
+        return 0;
+    }
+
+    if ( (ret = avformat_find_stream_info(*ctx_, NULL)) < 0) {
+        avformat_close_input(ctx_);
+        if (fast_) {
+            return 1;
+        }
+        *err_ = strdup("failed to find audio/data stream");
+        return -1;
+    }
+
+    if (fast_ && !_probe_complete(*ctx_)) {
+        avformat_close_input(ctx_);
+        return 1;
+    }
+    return 0;
+}
+
+static int  _scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_IpodGeneration idevice_, bool fast_, char** err_)
 {
     AVFormatContext *ctx;
     const struct metadata_map*  extra_md_map = NULL;
-    enum AVCodecID codec_id;
     enum AVCodecID video_codec_id;
     enum AVCodecID audio_codec_id;
     AVStream *video_stream;
@@ -420,16 +529,14 @@ int  gpod_ff_scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_Ipod
 
     ctx = NULL;
 
-    if ( (ret = avformat_open_input(&ctx, file_, NULL, NULL)) < 0) {
-        char  err[1024];
-        snprintf(err, 1024, "%s", av_err2str(ret));
-        *err_ = strdup(err);
-        return -1;
+    const gint64  then = g_get_monotonic_time();
+    info_->probe_fallback = false;
+    if ( (ret = _probe(&ctx, file_, fast_, err_)) > 0) {
+        info_->probe_fallback = true;
+        ret = _probe(&ctx, file_, false, err_);
     }
-
-    if ( (ret = avformat_find_stream_info(ctx, NULL)) < 0) {
-        *err_ = strdup("failed to find audio/data stream");
-        avformat_close_input(&ctx);
+    info_->probe_usecs = g_get_monotonic_time() - then;
+    if (ret < 0) {
         return -1;
     }
 
@@ -464,12 +571,17 @@ int  gpod_ff_scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_Ipod
 #else
 	info_->audio.channels = audio_stream->codecpar->channels;
 #endif
-	info_->audio.song_length = ctx->duration / (AV_TIME_BASE / 1000); /* ms */
+	// header only probes leave the container's duration to the stream
+	const int64_t  duration = _duration(ctx, audio_stream);
+	info_->audio.song_length = duration == AV_NOPTS_VALUE ? 0 : duration / (AV_TIME_BASE / 1000); /* ms */
 	if (ctx->bit_rate > 0) {
 	    info_->audio.bitrate = ctx->bit_rate / 1000;
 	}
-	else if (ctx->duration > AV_TIME_BASE) /* guesstimate */ {
-	    info_->audio.bitrate = ((info_->file_size * 8) / (ctx->duration / AV_TIME_BASE)) / 1000;
+	else if (audio_stream->codecpar->bit_rate > 0) {
+	    info_->audio.bitrate = audio_stream->codecpar->bit_rate / 1000;
+	}
+	else if (duration > AV_TIME_BASE) /* guesstimate */ {
+	    info_->audio.bitrate = ((info_->file_size * 8) / (duration / AV_TIME_BASE)) / 1000;
 	}
     }
 
@@ -479,53 +591,36 @@ int  gpod_ff_scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_Ipod
 	    continue;
 	}
 
-	// only care about h264
-        switch (ctx->streams[i]->codecpar->codec_id)
-	{
-	    case AV_CODEC_ID_H264:
+	const AVStream*  stream = ctx->streams[i];
+        if ((stream->disposition & AV_DISPOSITION_ATTACHED_PIC) ||
+            stream->codecpar->codec_id == AV_CODEC_ID_MJPEG ||
+            stream->codecpar->codec_id == AV_CODEC_ID_MJPEGB) {
+	    // embedded artwork, not video - first picture is the front cover
+	    if (info_->artwork.data == NULL && (stream->disposition & AV_DISPOSITION_ATTACHED_PIC) &&
+	        stream->attached_pic.size > 0 &&
+	        (info_->artwork.data = (uint8_t*)malloc(stream->attached_pic.size)) )
 	    {
-		switch (ctx->streams[i]->codecpar->profile)
-		{
-		    // only believe in
-		    case FF_PROFILE_H264_BASELINE:
-		    case FF_PROFILE_H264_CONSTRAINED_BASELINE:
-		    case FF_PROFILE_H264_MAIN:
-		    case FF_PROFILE_H264_EXTENDED:
-		    case FF_PROFILE_H264_HIGH:
-		    case FF_PROFILE_H264_HIGH_10:
-		    case FF_PROFILE_H264_HIGH_10_INTRA:
-		    case FF_PROFILE_H264_MULTIVIEW_HIGH:
-		    case FF_PROFILE_H264_HIGH_422:
-		    case FF_PROFILE_H264_HIGH_422_INTRA:
-		    case FF_PROFILE_H264_STEREO_HIGH:
-		    case FF_PROFILE_H264_HIGH_444:
-		    case FF_PROFILE_H264_HIGH_444_PREDICTIVE:
-		    case FF_PROFILE_H264_HIGH_444_INTRA:
-		    case FF_PROFILE_H264_CAVLC_444:
-		    {
-			info_->has_video = true;
-			if (!video_stream)
-			{
-			    video_stream = ctx->streams[i];
-			    info_->video.codec_id = video_codec_id = codec_id;
-			    info_->video.height = video_stream->codecpar->height;
-			    info_->video.width = video_stream->codecpar->width;
-			    info_->video.profile = video_stream->codecpar->profile;
-			    info_->video.bitrate = video_stream->codecpar->bit_rate;
-			    info_->video.length = video_stream->duration/AV_TIME_BASE;
-			    info_->video.fps = video_stream->avg_frame_rate.den ? video_stream->avg_frame_rate.num/(float)video_stream->avg_frame_rate.den : 0;
-			}
-		    } break;
-
-		    default:
-			break;
-		}
-	    } break;
+		memcpy(info_->artwork.data, stream->attached_pic.data, stream->attached_pic.size);
+		info_->artwork.size = stream->attached_pic.size;
+		info_->artwork.codec_id = stream->codecpar->codec_id;
+	    }
+	    continue;
+	}
 
-	    case AV_CODEC_ID_MJPEG:
-	    case AV_CODEC_ID_MJPEGB:
-		// embedded artwork, not video
-		break;
+	/* only h264 may be supported as is (depending on profile and device
+	 * limits), anything else is video that needs transcoding
+	 */
+	info_->has_video = true;
+	if (!video_stream)
+	{
+	    video_stream = ctx->streams[i];
+	    info_->video.codec_id = video_codec_id = video_stream->codecpar->codec_id;
+	    info_->video.height = video_stream->codecpar->height;
+	    info_->video.width = video_stream->codecpar->width;
+	    info_->video.profile = video_stream->codecpar->profile;
+	    info_->video.bitrate = video_stream->codecpar->bit_rate;
+	    info_->video.length = video_stream->duration/AV_TIME_BASE;
+	    info_->video.fps = video_stream->avg_frame_rate.den ? video_stream->avg_frame_rate.num/(float)video_stream->avg_frame_rate.den : 0;
 	}
     }
 
@@ -548,7 +643,10 @@ int  gpod_ff_scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_Ipod
 	info_->description = avc_desc->long_name;
 
 	info_->supported_ipod_fmt = device_support_video(idevice_, info_);
-	info_->type = avcodec_profile_name(video_codec_id, info_->video.profile);
+	const char*  profile = avcodec_profile_name(video_codec_id, info_->video.profile);
+	if (profile) {
+	    info_->type = profile;
+	}
 
         if (video_stream->metadata) {
             info_->meta.has_meta = true;
@@ -565,17 +663,19 @@ int  gpod_ff_scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_Ipod
         switch (audio_codec_id)
         {
             case AV_CODEC_ID_MP3:
-                info_->supported_ipod_fmt = true;
+                if ( !(info_->supported_ipod_fmt = strcmp(ctx->iformat->name, "mp3") == 0) ) {
+                    info_->remux = "mp3";
+                }
 
                 extra_md_map = md_map_id3;
                 break;
 
             case AV_CODEC_ID_AAC:
-                info_->supported_ipod_fmt = true;
-                break;
-
             case AV_CODEC_ID_ALAC:
-                info_->supported_ipod_fmt = true;
+                // iPod only plays these from mp4 containers, not adts/mkv/ts/caf...
+                if ( !(info_->supported_ipod_fmt = strstr(ctx->iformat->name, "mp4") != NULL) ) {
+                    info_->remux = "m4a";
+                }
                 break;
 
     // this block of types will needs transcoding to go onto iPod
@@ -642,6 +742,16 @@ int  gpod_ff_scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_Ipod
     return 0;
 }
 
+int  gpod_ff_scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_IpodGeneration idevice_, char** err_)
+{
+    return _scan(info_, file_, idevice_, false, err_);
+}
+
+int  gpod_ff_scan_fast(struct gpod_ff_media_info *info_, const char *file_, Itdb_IpodGeneration idevice_, char** err_)
+{
+    return _scan(info_, file_, idevice_, true, err_);
+}
+
 
 Itdb_Track*  gpod_ff_meta_to_track(const struct gpod_ff_media_info* meta_, time_t time_added_, bool sanitize_)
 {
@@ -682,8 +792,8 @@ Itdb_Track*  gpod_ff_meta_to_track(const struct gpod_ff_media_info* meta_, time_
 
 const struct gpod_ff_enc_support*  gpod_ff_enc_supported(enum gpod_ff_enc enc_)
 {
-    // this could be null if gpod-ff-init() not called
-    const struct gpod_ff_enc_support*  p = gpod_ff_encoders;
+    // this could be null if gpod_ff_init() not called
+    const struct gpod_ff_enc_support*  p = g_atomic_pointer_get(&gpod_ff_encoders);
     while (p && p->name) {
         if (p->enc == enc_) {
 	    return p;
@@ -698,6 +808,19 @@ void  gpod_ff_transcode_ctx_init(struct gpod_ff_transcode_ctx* obj_,
 {
     memset(obj_, 0, sizeof(struct gpod_ff_transcode_ctx));
 
+    // video is always h264 to the most widely supported device's limits
+    const struct gpod_video_support*  vs = &video_support[0];
+    obj_->video_opts.enc_name = "libx264";
+    const struct gpod_ff_enc_support*  fdk = gpod_ff_enc_supported(GPOD_FF_ENC_FDKAAC);
+    obj_->video_opts.audio_enc_name = fdk && fdk->supported ? "libfdk_aac" : "aac";
+    obj_->video_opts.width = vs->max_width;
+    obj_->video_opts.height = vs->max_height;
+    obj_->video_opts.max_bitrate = vs->max_vbit_rate;
+    obj_->video_opts.bitrate = vs->max_vbit_rate * 3/5;
+    obj_->video_opts.fps = vs->max_fps;
+    obj_->video_opts.audio_bitrate = 128000;  // iPod accepts upto 160kbps
+    obj_->video_opts.channels = vs->channels;
+
     // default the transcode params
     obj_->audio_opts.channels = 2;
     obj_->audio_opts.quality = quality_;
@@ -795,9 +918,9 @@ int  gpod_ff_audio_hash(char** hash_, const char* file_, char** err_)
 
     ret = av_hash_alloc(&hash, "sha256");
     if (ret < 0) {
-        snprintf(err, sizeof(err), "failed to alloc hash - %s\n", ret == EINVAL ? "unknown hash" : strerror(ret));
+        snprintf(err, sizeof(err), "failed to alloc hash - %s\n", ret == AVERROR(EINVAL) ? "unknown hash" : av_err2str(ret));
         *err_ = strdup(err);
-	if (ret != EINVAL)  {
+	if (ret != AVERROR(EINVAL))  {
 	    ret = ENOMEM;
 	}
         goto cleanup;
@@ -846,12 +969,15 @@ static struct  gpod_ff_enc_support  _gpod_ff_encoders[] = {
 const struct  gpod_ff_enc_support*  gpod_ff_encoders = NULL;
 
 
+/* only the first caller initialises, any concurrent callers wait for it so
+ * the encoder table is never seen half populated
+ */
 void  gpod_ff_init()
 {
-    if (gpod_ff_encoders) {
+    static gsize  once = 0;
+    if (!g_once_init_enter(&once)) {
         return;
     }
-    gpod_ff_encoders = _gpod_ff_encoders;
 
     av_log_set_flags(AV_LOG_SKIP_REPEATED);
     av_log_set_callback(_avlog_callback_null);
@@ -861,4 +987,7 @@ void  gpod_ff_init()
 	p->supported = avcodec_find_encoder_by_name(p->enc_name) != NULL;
 	++p;
     }
+
+    g_atomic_pointer_set(&gpod_ff_encoders, _gpod_ff_encoders);
+    g_once_init_leave(&once, 1);
 }
@@ -89,10 +89,21 @@ struct gpod_ff_media_info
     bool  has_video; // is video file
     bool  has_audio; // is audio file
     bool  supported_ipod_fmt;  // mp3, m4a, mp4/m4v
+    const char*  remux;        // supported codec in an unsupported container, extn to stream copy into
+
+    int64_t  probe_usecs;      // time spent opening/probing the file
+    bool  probe_fallback;      // fast probe was incomplete, full probe used
 
     struct gpod_ff_audio  audio;
     struct gpod_ff_video  video;
     struct gpod_ff_meta  meta;
+
+    // embedded cover art as found in the file, jpeg/png...
+    struct {
+        enum AVCodecID  codec_id;
+        uint8_t*  data;
+        int  size;
+    } artwork;
 };
 
 enum gpod_ff_enc {
@@ -138,24 +149,78 @@ enum gpod_ff_transcode_quality {
     GPOD_FF_XCODE_MAX
 };
 
+// sample rate conversion, soxr requires ffmpeg built with libsoxr
+enum gpod_ff_resampler {
+    GPOD_FF_RESAMPLE_SWR = 0,
+    GPOD_FF_RESAMPLE_SOXR,
+};
+
+enum gpod_ff_resample_precision {
+    GPOD_FF_RESAMPLE_STD = 0,  // engine defaults
+    GPOD_FF_RESAMPLE_FAST,
+    GPOD_FF_RESAMPLE_HIGH,
+};
+
+/* per thread encoder/resampler/fifo/frame state that can be carried across
+ * gpod_ff_transcode() calls to avoid the setup costs for each file
+ */
+struct gpod_ff_transcode_session;
+
 struct gpod_ff_transcode_ctx {
     struct {
         enum AVCodecID  codec_id;
         const char*  enc_name;  // if set use this over codec_id
         uint8_t  channels;
         uint32_t  samplerate;
-        enum AVSampleFormat  samplefmt;
+        enum AVSampleFormat  samplefmt;  // AV_SAMPLE_FMT_NONE to match the input where possible
         enum gpod_ff_transcode_quality  quality;
         float  quality_scale_factor;
+        enum gpod_ff_resampler  resampler;
+        enum gpod_ff_resample_precision  resample_precision;
     } audio_opts;
 
+    // iPod limits for video transcodes
+    struct {
+        const char*  enc_name;
+        const char*  audio_enc_name;
+        uint32_t  width;       // max
+        uint32_t  height;      // max
+        uint32_t  bitrate;
+        uint32_t  max_bitrate;
+        float  fps;            // max
+        uint32_t  audio_bitrate;
+        uint8_t  channels;
+    } video_opts;
+
     bool  sync_meta;
 
     const char*  extn;
     char  path[PATH_MAX];
     char  tmpprfx[PATH_MAX];
+
+    struct gpod_ff_transcode_session*  session;  // optional, not owned
+
+    /* split long inputs into up to this many concurrently encoded segments,
+     * 0/1 disables
+     */
+    unsigned  segments;
+
+    // cpu budget for codecs that thread internally, 0/1 for single threaded
+    unsigned  threads;
+
+    // measure the integrated loudness of the decoded input whilst transcoding
+    bool  loudness;
+
+    unsigned  allocs;  // [out] sample buffer allocations made by the last transcode
+    double  realtime;  // [out] input duration over wall time of the last transcode
+    double  lufs;      // [out] integrated loudness if requested, 0 if not measurable
 };
 
+/* the scan/hash/loudness/transcode/remux functions keep no state between
+ * calls and report errors via the per call malloc'd err_, so are safe to call
+ * concurrently after gpod_ff_init(); the media info, transcode ctx and
+ * session passed to them must not be shared between threads
+ */
 void  gpod_ff_meta_free(struct gpod_ff_meta*  obj_);
 void  gpod_ff_media_info_free(struct gpod_ff_media_info*  obj_);
 void  gpod_ff_media_info_init(struct gpod_ff_media_info*  obj_);
@@ -163,6 +228,12 @@ void  gpod_ff_media_info_init(struct gpod_ff_media_info*  obj_);
 #ifndef GPOD_FF_STANDALONE
 int  gpod_ff_scan(struct gpod_ff_media_info *info_, const char *file_, Itdb_IpodGeneration target_, char** err_);
 
+/* as above but with tight probe limits, taking duration/bitrate from the
+ * headers of mp3/m4a/flac where possible - falls back to the full probe if
+ * the headers are not enough
+ */
+int  gpod_ff_scan_fast(struct gpod_ff_media_info *info_, const char *file_, Itdb_IpodGeneration target_, char** err_);
+
 Itdb_Track*  gpod_ff_meta_to_track(const struct gpod_ff_media_info* meta_, time_t time_added_, bool sanitize_);
 #endif
 
@@ -174,10 +245,63 @@ void  gpod_ff_transcode_ctx_init(struct gpod_ff_transcode_ctx* obj_,
 
 int  gpod_ff_transcode(struct gpod_ff_media_info *info_, struct gpod_ff_transcode_ctx* target, char** err_);
 
+/* video and its audio to h264 baseline/aac in an m4v, within the
+ * target's video_opts limits
+ */
+int  gpod_ff_transcode_video(struct gpod_ff_media_info *info_, struct gpod_ff_transcode_ctx* target, char** err_);
+
+/* copy the audio stream, without decoding, into the container given by the
+ * target path's extn - for info_->remux files
+ */
+int  gpod_ff_remux(struct gpod_ff_media_info *info_, struct gpod_ff_transcode_ctx* target, char** err_);
+
+/* sessions are not thread safe - use one per thread
+ *
+ * a session holds the encoder between files only if the encoder can be
+ * flushed (AV_CODEC_CAP_ENCODER_FLUSH), others are reopened for each file;
+ * the resampler, fifo and buffers are always kept
+ */
+struct gpod_ff_transcode_session*  gpod_ff_transcode_session_new();
+void  gpod_ff_transcode_session_free(struct gpod_ff_transcode_session* obj_);
+
+/* decode the image (embedded artwork) and, if larger than max_ in either
+ * dimension or not a jpeg, scale to fit and encode as jpeg - on success
+ * returns 0 and data_ must be freed
+ */
+int  gpod_ff_artwork_scale(uint8_t** data_, int* size_, enum AVCodecID codec_id_,
+                           const uint8_t* src_, int src_size_, unsigned max_, char** err_);
+
+/* EBU R128 integrated loudness meter fed with decoded frames, the frames
+ * matching the rate/channels of the decoder given at creation whose channel
+ * layout determines each channel's weighting
+ */
+struct gpod_ff_loudness;
+
+struct gpod_ff_loudness*  gpod_ff_loudness_new(const AVCodecContext* ctx_);
+void  gpod_ff_loudness_free(struct gpod_ff_loudness* obj_);
+
+void  gpod_ff_loudness_add(struct gpod_ff_loudness* obj_, const AVFrame* frame_, int offset_, int nb_samples_);
+
+/* combine the measurements of separately metered consecutive parts of the
+ * same input, less the blocks spanning the joins */
+void  gpod_ff_loudness_merge(struct gpod_ff_loudness* obj_, const struct gpod_ff_loudness* from_);
+
+// false if nothing above the gates, ie silence or too short
+bool  gpod_ff_loudness_lufs(const struct gpod_ff_loudness* obj_, double* lufs_);
+
+// iTunes soundcheck value adjusting the loudness to the -18 LUFS reference
+uint32_t  gpod_ff_soundcheck(double lufs_);
+
+/* decode only pass over the file's audio, returns 0 and the loudness,
+ * > 0 if it has no measurable loudness, otherwise an error
+ */
+int  gpod_ff_loudness_scan(double* lufs_, const char* file_, unsigned threads_, char** err_);
+
 /* On success, returns 0 and hash_ is non-NULL and must be freeed
  */
 int  gpod_ff_audio_hash(char** hash_, const char* file_, char** err_);
 
+// once per process, safe to call from any/many threads
 void  gpod_ff_init();
 
 #ifdef __cplusplus
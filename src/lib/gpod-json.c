@@ -0,0 +1,183 @@
+/*
+ *  Copyright (C) 2022 Ray <whatdoineed2do @ gmail com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include "gpod-json.h"
+
+#include <string.h>
+#include <inttypes.h>
+
+
+void  gpod_json_init(struct gpod_json* obj_, FILE* f_)
+{
+    memset(obj_, 0, sizeof(struct gpod_json));
+    obj_->f = f_;
+    obj_->first[0] = true;
+}
+
+static void  _str(FILE* f_, const char* s_)
+{
+    static const char  hex[] = "0123456789abcdef";
+
+    putc('"', f_);
+    for (const unsigned char* p = (const unsigned char*)s_; *p; ++p)
+    {
+        switch (*p)
+        {
+            case '"':   fputs("\\\"", f_);  break;
+            case '\\':  fputs("\\\\", f_);  break;
+            case '\b':  fputs("\\b", f_);  break;
+            case '\f':  fputs("\\f", f_);  break;
+            case '\n':  fputs("\\n", f_);  break;
+            case '\r':  fputs("\\r", f_);  break;
+            case '\t':  fputs("\\t", f_);  break;
+            default:
+                if (*p < 0x20) {
+                    fputs("\\u00", f_);
+                    putc(hex[*p >> 4], f_);
+                    putc(hex[*p & 0xf], f_);
+                }
+                else {
+                    putc(*p, f_);  // utf8 passes through as is
+                }
+        }
+    }
+    putc('"', f_);
+}
+
+// separator and key ahead of the next value at the current level, false if dropped
+static bool  _value(struct gpod_json* obj_, const char* key_)
+{
+    if (obj_->overflow) {
+        return false;
+    }
+
+    if (obj_->first[obj_->depth]) {
+        obj_->first[obj_->depth] = false;
+        if (obj_->depth) {
+            putc(' ', obj_->f);
+        }
+    }
+    else if (obj_->depth) {
+        fputs(", ", obj_->f);
+    }
+
+    if (key_) {
+        _str(obj_->f, key_);
+        fputs(": ", obj_->f);
+    }
+    return true;
+}
+
+// a completed top level value, next one starts afresh on a new line
+static void  _done(struct gpod_json* obj_)
+{
+    if (obj_->depth == 0) {
+        putc('\n', obj_->f);
+        obj_->first[0] = true;
+    }
+}
+
+static void  _begin(struct gpod_json* obj_, const char* key_, char c_)
+{
+    if (obj_->overflow || obj_->depth+1 >= GPOD_JSON_MAX_DEPTH) {
+        ++obj_->overflow;
+        return;
+    }
+    _value(obj_, key_);
+    putc(c_, obj_->f);
+    obj_->first[++obj_->depth] = true;
+}
+
+static void  _end(struct gpod_json* obj_, char c_)
+{
+    if (obj_->overflow) {
+        --obj_->overflow;
+        return;
+    }
+    if (obj_->depth == 0) {
+        return;
+    }
+    if (!obj_->first[obj_->depth]) {
+        putc(' ', obj_->f);
+    }
+    putc(c_, obj_->f);
+    --obj_->depth;
+    _done(obj_);
+}
+
+void  gpod_json_object_begin(struct gpod_json* obj_, const char* key_)
+{
+    _begin(obj_, key_, '{');
+}
+
+void  gpod_json_object_end(struct gpod_json* obj_)
+{
+    _end(obj_, '}');
+}
+
+void  gpod_json_array_begin(struct gpod_json* obj_, const char* key_)
+{
+    _begin(obj_, key_, '[');
+}
+
+void  gpod_json_array_end(struct gpod_json* obj_)
+{
+    _end(obj_, ']');
+}
+
+void  gpod_json_string(struct gpod_json* obj_, const char* key_, const char* data_)
+{
+    if (!_value(obj_, key_)) {
+        return;
+    }
+    if (data_) {
+        _str(obj_->f, data_);
+    }
+    else {
+        fputs("null", obj_->f);
+    }
+    _done(obj_);
+}
+
+void  gpod_json_int(struct gpod_json* obj_, const char* key_, int64_t data_)
+{
+    if (!_value(obj_, key_)) {
+        return;
+    }
+    fprintf(obj_->f, "%" PRId64, data_);
+    _done(obj_);
+}
+
+void  gpod_json_uint(struct gpod_json* obj_, const char* key_, uint64_t data_)
+{
+    if (!_value(obj_, key_)) {
+        return;
+    }
+    fprintf(obj_->f, "%" PRIu64, data_);
+    _done(obj_);
+}
+
+void  gpod_json_boolean(struct gpod_json* obj_, const char* key_, bool data_)
+{
+    if (!_value(obj_, key_)) {
+        return;
+    }
+    fputs(data_ ? "true" : "false", obj_->f);
+    _done(obj_);
+}
@@ -0,0 +1,65 @@
+/*
+ *  Copyright (C) 2022 Ray <whatdoineed2do @ gmail com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef GPOD_JSON_H
+#define GPOD_JSON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* streaming json writer: values are written to the stream as they are
+ * given, nothing is retained beyond the nesting state
+ *
+ * key_ names the member inside an object and must be NULL inside an array
+ * or at the top level.  Each top level value is terminated by a newline so
+ * a sequence of them is NDJSON.  Anything nested deeper than
+ * GPOD_JSON_MAX_DEPTH is dropped, its begin/end pairs still balance
+ */
+#define GPOD_JSON_MAX_DEPTH  32
+
+struct gpod_json {
+    FILE*  f;
+    unsigned  depth;
+    bool  first[GPOD_JSON_MAX_DEPTH];  // no member/element written at this level yet
+    unsigned  overflow;  // levels opened beyond the max depth
+};
+
+void  gpod_json_init(struct gpod_json* obj_, FILE* f_);
+
+void  gpod_json_object_begin(struct gpod_json* obj_, const char* key_);
+void  gpod_json_object_end(struct gpod_json* obj_);
+void  gpod_json_array_begin(struct gpod_json* obj_, const char* key_);
+void  gpod_json_array_end(struct gpod_json* obj_);
+
+// NULL data_ is written as null
+void  gpod_json_string(struct gpod_json* obj_, const char* key_, const char* data_);
+void  gpod_json_int(struct gpod_json* obj_, const char* key_, int64_t data_);
+void  gpod_json_uint(struct gpod_json* obj_, const char* key_, uint64_t data_);
+void  gpod_json_boolean(struct gpod_json* obj_, const char* key_, bool data_);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
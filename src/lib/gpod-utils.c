@@ -153,35 +153,48 @@ bool  gpod_write_supported(const Itdb_IpodInfo* ipi_)
     return false;
 }
 
-void  gpod_walk_dir(const gchar *dir_, GSList **l_) 
+bool  gpod_walk_dir_foreach(const gchar* dir_, gpod_walk_dir_cb cb_, void* data_)
 {
     GDir*  dir_handle;
     const gchar*  filename;
     gchar*  path;
+    bool  ret = true;
 
     if (!g_file_test(dir_, G_FILE_TEST_IS_DIR)) {
-        *l_ = g_slist_append(*l_, g_strdup(dir_));
-        return;
+        return cb_(dir_, data_);
     }
 
     if ( (dir_handle = g_dir_open(dir_, 0, NULL)) == NULL) {
-        return;
+        return true;
     }
 
-    while ((filename = g_dir_read_name(dir_handle)))
+    while (ret && (filename = g_dir_read_name(dir_handle)))
     {
         path = g_build_filename(dir_, filename, NULL);
 
         if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
-            gpod_walk_dir(path, l_);
-            g_free(path);
+            ret = gpod_walk_dir_foreach(path, cb_, data_);
         }
         else {
-            *l_ = g_slist_append(*l_, path);
+            ret = cb_(path, data_);
         }
+        g_free(path);
     }
 
     g_dir_close(dir_handle);
+    return ret;
+}
+
+static bool  _gpod_walk_dir_append(const gchar* path_, void* l_)
+{
+    GSList**  l = (GSList**)l_;
+    *l = g_slist_append(*l, g_strdup(path_));
+    return true;
+}
+
+void  gpod_walk_dir(const gchar *dir_, GSList **l_) 
+{
+    gpod_walk_dir_foreach(dir_, _gpod_walk_dir_append, l_);
 }
 
 char*  gpod_sanitize_text(char* what_, bool sanitize_)
@@ -296,25 +309,19 @@ guint  gpod_saved_cksum(const Itdb_Track* track_)
     return track_->unk196;
 }
 
-static guint  _track_mkhash(Itdb_Track* track_)
-{ 
-    const guint  hash = gpod_saved_cksum(track_) ? gpod_saved_cksum(track_) : gpod_hash(track_);
-    track_->userdata = malloc(sizeof(guint));
-    *((guint*)track_->userdata) = hash;
-    track_->userdata_destroy = free;
-
-    return hash;
+void   gpod_store_src_cksum(Itdb_Track* track_, guint cksum_)
+{
+    track_->unk204 = cksum_;
 }
 
-static guint  _track_hash(gconstpointer v_)
-{ 
-    return *((guint*)(v_));
+guint  gpod_saved_src_cksum(const Itdb_Track* track_)
+{
+    return track_->unk204;
 }
 
-
-static gboolean  _track_hash_equals(gconstpointer v0_, gconstpointer v1_)
-{
-    return *((guint*)v0_) == *((guint*)v1_);
+static guint  _track_mkhash(const Itdb_Track* track_)
+{ 
+    return gpod_saved_cksum(track_) ? gpod_saved_cksum(track_) : gpod_hash(track_);
 }
 
 static gint  _track_guintp_cmp(gconstpointer a_, gconstpointer b_)
@@ -331,13 +338,31 @@ static void  _track_destroy(gpointer k_, gpointer v_, gpointer d_)
     g_slist_free(v_);
 }
 
+static void  _track_htbl_insert(GHashTable* htbl_, guint hash_, Itdb_Track* track_)
+{
+    const gpointer  key = GUINT_TO_POINTER(hash_);
+    g_hash_table_insert(htbl_, key,
+                        g_slist_insert_sorted(g_hash_table_lookup(htbl_, key), track_, _track_guintp_cmp));
+}
+
+static void  _track_htbl_remove(GHashTable* htbl_, guint hash_, const Itdb_Track* track_)
+{
+    const gpointer  key = GUINT_TO_POINTER(hash_);
+    GSList*  l = g_slist_remove(g_hash_table_lookup(htbl_, key), track_);
+    if (l) {
+        g_hash_table_insert(htbl_, key, l);
+    }
+    else {
+        g_hash_table_remove(htbl_, key);
+    }
+}
+
 
 void  gpod_track_fs_hash_init(struct gpod_track_fs_hash* htbl_, Itdb_iTunesDB* itdb_)
 {
     memset(htbl_, 0, sizeof(struct gpod_track_fs_hash));
-    htbl_->tbl = g_hash_table_new(_track_hash, _track_hash_equals);
-
-    GHashTable*  htbl = htbl_->tbl;
+    htbl_->tbl = g_hash_table_new(g_direct_hash, g_direct_equal);
+    htbl_->src = g_hash_table_new(g_direct_hash, g_direct_equal);
 
     Itdb_Track*  track;
 
@@ -351,14 +376,7 @@ void  gpod_track_fs_hash_init(struct gpod_track_fs_hash* htbl_, Itdb_iTunesDB* i
 	}
 
 	track = (Itdb_Track*)i->data;
-        _track_mkhash(track);
-
-        g_hash_table_insert(htbl,
-                            track->userdata,
-                            g_slist_insert_sorted(g_hash_table_lookup(htbl, track->userdata),
-                                                  track,
-                                                  _track_guintp_cmp)
-                           );
+        gpod_track_fs_hash_add(htbl_, track);
     }
 }
 
@@ -366,19 +384,64 @@ void  gpod_track_fs_hash_destroy(struct gpod_track_fs_hash* htbl_)
 {
     g_hash_table_foreach(htbl_->tbl, _track_destroy, NULL);
     g_hash_table_destroy(htbl_->tbl);
+    g_hash_table_foreach(htbl_->src, _track_destroy, NULL);
+    g_hash_table_destroy(htbl_->src);
 
     memset(htbl_, 0, sizeof(struct gpod_track_fs_hash));
 }
 
+void  gpod_track_fs_hash_add(struct gpod_track_fs_hash* htbl_, Itdb_Track* track_)
+{
+    _track_htbl_insert(htbl_->tbl, _track_mkhash(track_), track_);
+    if (gpod_saved_src_cksum(track_)) {
+        _track_htbl_insert(htbl_->src, gpod_saved_src_cksum(track_), track_);
+    }
+}
+
+void  gpod_track_fs_hash_remove(struct gpod_track_fs_hash* htbl_, const Itdb_Track* track_)
+{
+    if (gpod_saved_src_cksum(track_)) {
+        _track_htbl_remove(htbl_->src, gpod_saved_src_cksum(track_), track_);
+    }
+
+    if (gpod_saved_cksum(track_)) {
+        _track_htbl_remove(htbl_->tbl, gpod_saved_cksum(track_), track_);
+        return;
+    }
+
+    // hash was generated from the file at init time, dont regenerate for a rare event
+    GHashTableIter  i;
+    gpointer  key;
+    gpointer  value;
+    g_hash_table_iter_init(&i, htbl_->tbl);
+    while (g_hash_table_iter_next(&i, &key, &value)) {
+        if (g_slist_find((GSList*)value, track_)) {
+            _track_htbl_remove(htbl_->tbl, GPOINTER_TO_UINT(key), track_);
+            break;
+        }
+    }
+}
+
 bool  gpod_track_fs_hash_contains(const struct gpod_track_fs_hash* htbl_, const Itdb_Track* track_, const char* path_)
 {
-    const guint  hash = track_->itdb ? gpod_hash(track_) : gpod_hash_file(path_);
+    const guint  hash = track_->itdb ? gpod_hash(track_) : 
+                        gpod_saved_cksum(track_) ? gpod_saved_cksum(track_) : gpod_hash_file(path_);
 
-    GSList*  what = g_hash_table_lookup(htbl_->tbl, &hash);
+    GSList*  what = g_hash_table_lookup(htbl_->tbl, GUINT_TO_POINTER(hash));
 
     return what == NULL ? false : true;
 }
 
+GSList*  gpod_track_fs_hash_lookup_cksum(const struct gpod_track_fs_hash* htbl_, guint cksum_)
+{
+    if (cksum_ == 0) {
+        return NULL;
+    }
+
+    GSList*  what = g_hash_table_lookup(htbl_->tbl, GUINT_TO_POINTER(cksum_));
+    return what ? what : g_hash_table_lookup(htbl_->src, GUINT_TO_POINTER(cksum_));
+}
+
 GSList* gpod_track_fs_hash_lookup(const struct gpod_track_fs_hash* htbl_, const Itdb_Track* track_)
 {
     const guint  hash = gpod_saved_cksum(track_);
@@ -386,7 +449,7 @@ GSList* gpod_track_fs_hash_lookup(const struct gpod_track_fs_hash* htbl_, const
 	return NULL;  // no valid hash
     }
 
-    return g_hash_table_lookup(htbl_->tbl, &hash);
+    return g_hash_table_lookup(htbl_->tbl, GUINT_TO_POINTER(hash));
 }
 
 
@@ -481,13 +544,35 @@ GHashTable*  gpod_track_htbl_create(Itdb_iTunesDB* itdb_)
 	    return NULL;
 	}
         track = (Itdb_Track*)i->data;
-        g_hash_table_insert(htbl, track,
-                            g_slist_append(g_hash_table_lookup(htbl, track), track)
-                           );
+        gpod_track_htbl_insert(htbl, track);
     }
 
     return htbl;
 }
+
+void  gpod_track_htbl_insert(GHashTable* htbl_, Itdb_Track* track_)
+{
+    g_hash_table_insert(htbl_, track_,
+                        g_slist_append(g_hash_table_lookup(htbl_, track_), track_));
+}
+
+void  gpod_track_htbl_remove(GHashTable* htbl_, const Itdb_Track* track_)
+{
+    gpointer  key;
+    gpointer  value;
+    if (!g_hash_table_lookup_extended(htbl_, track_, &key, &value)) {
+        return;
+    }
+
+    /* the key may be the track itself so always re-key on whats left as the
+     * track's fields may be about to change
+     */
+    GSList*  l = g_slist_remove((GSList*)value, track_);
+    g_hash_table_remove(htbl_, key);
+    if (l) {
+        g_hash_table_insert(htbl_, l->data, l);
+    }
+}
 #endif
 
 
@@ -898,7 +983,7 @@ gchar* g_date_time_format_iso8601(GDateTime *datetime)
 
 
 
-void  gpod_duration(char duration_[32], guint then_, guint now_)
+void  gpod_duration(char duration_[32], gint64 then_, gint64 now_)
 {
     const unsigned  sec = (now_-then_)/1000000;
     unsigned  h, m, s;
@@ -923,3 +1008,90 @@ void  gpod_duration(char duration_[32], guint then_, guint now_)
         }
     }
 }
+
+
+/* bucket layout: 0..7 are exact usecs, beyond that each power of 2 is split
+ * into 4 sub buckets using the 2 bits below the msb
+ */
+static unsigned  _gpod_latency_bucket(guint64 usecs_)
+{
+    if (usecs_ < 8) {
+        return (unsigned)usecs_;
+    }
+
+    const unsigned  msb = 63 - __builtin_clzll(usecs_);
+    const unsigned  sub = (usecs_ >> (msb-2)) & 0x3;
+    const unsigned  idx = 8 + (msb-3)*4 + sub;
+
+    return idx < GPOD_LATENCY_BUCKETS ? idx : GPOD_LATENCY_BUCKETS-1;
+}
+
+static guint64  _gpod_latency_bucket_upper(unsigned idx_)
+{
+    if (idx_ < 8) {
+        return idx_;
+    }
+    const unsigned  msb = (idx_-8)/4 + 3;
+    const unsigned  sub = (idx_-8)%4;
+
+    return ((guint64)(4+sub+1) << (msb-2)) - 1;
+}
+
+void  gpod_latency_init(struct gpod_latency* obj_, const char* name_)
+{
+    memset(obj_, 0, sizeof(struct gpod_latency));
+    obj_->name = name_;
+    g_mutex_init(&obj_->lck);
+}
+
+void  gpod_latency_clear(struct gpod_latency* obj_)
+{
+    g_mutex_clear(&obj_->lck);
+}
+
+void  gpod_latency_add(struct gpod_latency* obj_, gint64 usecs_, guint64 bytes_)
+{
+    const guint64  usecs = usecs_ < 0 ? 0 : usecs_;
+
+    g_mutex_lock(&obj_->lck);
+    ++obj_->count;
+    obj_->total += usecs;
+    obj_->bytes += bytes_;
+    if (usecs > obj_->max) {
+        obj_->max = usecs;
+    }
+    ++obj_->buckets[_gpod_latency_bucket(usecs)];
+    g_mutex_unlock(&obj_->lck);
+}
+
+guint64  gpod_latency_percentile(const struct gpod_latency* obj_, double pct_)
+{
+    if (obj_->count == 0) {
+        return 0;
+    }
+
+    // rank of the sample we're after, 1 based
+    guint64  rank = (guint64)(pct_/100.0 * obj_->count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    guint64  seen = 0;
+    for (unsigned i=0; i<GPOD_LATENCY_BUCKETS; ++i)
+    {
+        seen += obj_->buckets[i];
+        if (seen >= rank) {
+            const guint64  upper = _gpod_latency_bucket_upper(i);
+            return upper < obj_->max ? upper : obj_->max;
+        }
+    }
+    return obj_->max;
+}
+
+double  gpod_latency_mbps(const struct gpod_latency* obj_)
+{
+    if (obj_->total == 0 || obj_->bytes == 0) {
+        return 0.0;
+    }
+    return (obj_->bytes/(1024.0*1024.0)) / (obj_->total/1000000.0);
+}
@@ -46,6 +46,12 @@ bool  gpod_write_supported(const Itdb_IpodInfo* ipi_);
 // recursively walk dir, adding files as strings to the list
 void  gpod_walk_dir(const gchar* dir_, GSList **l_);
 
+/* recursively walk dir, calling cb for each file without retaining anything;
+ * cb returning false stops the walk
+ */
+typedef bool (*gpod_walk_dir_cb)(const gchar* path_, void* data_);
+bool  gpod_walk_dir_foreach(const gchar* dir_, gpod_walk_dir_cb cb_, void* data_);
+
 
 // replace some special char/strings to ascii like compatriots
 char*  gpod_sanitize_text(char* what_, bool sanitize_);
@@ -70,28 +76,67 @@ int  gpod_hash_digest_file(struct gpod_hash_digest* res_, const char* track_);
 void   gpod_store_cksum(Itdb_Track* track_, const char* file_);
 guint  gpod_saved_cksum(const Itdb_Track* track_);
 
+// audio hash of the originating file of a transcoded track
+void   gpod_store_src_cksum(Itdb_Track* track_, guint cksum_);
+guint  gpod_saved_src_cksum(const Itdb_Track* track_);
+
 
 struct gpod_track_fs_hash {
-    GHashTable*  tbl;
+    GHashTable*  tbl;  // cksum -> GSList of tracks, oldest first
+    GHashTable*  src;  // src cksum -> GSList of tracks
 };
 
 void  gpod_track_fs_hash_init(struct gpod_track_fs_hash* htbl_, Itdb_iTunesDB* itdb_);
 void  gpod_track_fs_hash_destroy(struct gpod_track_fs_hash* htbl_);
 
+void  gpod_track_fs_hash_add(struct gpod_track_fs_hash* htbl_, Itdb_Track* track_);
+void  gpod_track_fs_hash_remove(struct gpod_track_fs_hash* htbl_, const Itdb_Track* track_);
+
 bool  gpod_track_fs_hash_contains(const struct gpod_track_fs_hash* htbl_, const Itdb_Track* track_, const char* path_);
 GSList* gpod_track_fs_hash_lookup(const struct gpod_track_fs_hash* htbl_, const Itdb_Track* track_);
 
+// tracks whose stored or src cksum matches
+GSList* gpod_track_fs_hash_lookup_cksum(const struct gpod_track_fs_hash* htbl_, guint cksum_);
+
 GTree*       gpod_track_key_tree_create(Itdb_iTunesDB *itdb_);
 void         gpod_track_key_tree_destroy(GTree* tree_);
 
 GHashTable*  gpod_track_htbl_create(Itdb_iTunesDB* itdb_);
 void         gpod_track_htbl_destroy(GHashTable* htbl_);
 
+// maintain the title/artist/album keyed table, remove before modifying any key fields
+void         gpod_track_htbl_insert(GHashTable* htbl_, Itdb_Track* track_);
+void         gpod_track_htbl_remove(GHashTable* htbl_, const Itdb_Track* track_);
+
 // create recent playlists from given date
 void  gpod_playlist_recent(unsigned* playlists_, unsigned* tracks_,
 	                   Itdb_iTunesDB* itdb_, unsigned album_limit_, gint64  when_);
 
-void  gpod_duration(char duration_[32], guint then_, guint now_);
+void  gpod_duration(char duration_[32], gint64 then_, gint64 now_);
+
+
+/* latency/throughput accumulator - samples (usecs) are kept in log-linear
+ * buckets so memory is fixed regardless of number of samples and
+ * percentiles are accurate to within 25%
+ */
+#define GPOD_LATENCY_BUCKETS  160
+
+struct gpod_latency {
+    const char*  name;
+    GMutex   lck;
+
+    guint64  count;
+    guint64  total;  // usecs
+    guint64  max;
+    guint64  bytes;
+    guint32  buckets[GPOD_LATENCY_BUCKETS];
+};
+
+void     gpod_latency_init(struct gpod_latency* obj_, const char* name_);
+void     gpod_latency_clear(struct gpod_latency* obj_);
+void     gpod_latency_add(struct gpod_latency* obj_, gint64 usecs_, guint64 bytes_);
+guint64  gpod_latency_percentile(const struct gpod_latency* obj_, double pct_);
+double   gpod_latency_mbps(const struct gpod_latency* obj_);
 
 // raspberry pi buster ships 2.58
 #ifndef GLIB_VERSION_2_60
@@ -0,0 +1,298 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <glib.h>
+#include <gpod/itdb.h>
+
+#include "gpod-ffmpeg.h"
+#include <libavutil/log.h>
+
+
+/* benchmark: gpod_ff_scan()/gpod_ff_scan_fast()/gpod_ff_audio_hash() over a
+ * corpus (see bench-corpus.sh) reported per file type, with the files evicted
+ * from the page cache (cold) and read in advance (warm)
+ */
+enum bench_op {
+    BENCH_OP_PROBE = 0,
+    BENCH_OP_FAST,
+    BENCH_OP_HASH,
+    BENCH_OP_MAX
+};
+
+static const char*  bench_op_names[BENCH_OP_MAX] = { "probe", "fast", "hash" };
+
+enum bench_cache {
+    BENCH_COLD = 0,
+    BENCH_WARM,
+    BENCH_CACHE_MAX
+};
+
+struct bench_type {
+    char  name[64];
+    unsigned  files;
+    uint64_t  bytes;
+    gint64  usecs[BENCH_OP_MAX][BENCH_CACHE_MAX];
+    unsigned  fails[BENCH_OP_MAX];
+};
+
+struct bench_file {
+    char*  path;
+    off_t  size;
+    struct bench_type*  type;
+};
+
+
+// <type>-<n>.<extn> -> <type>
+static void  _type_name(char* dst_, size_t sz_, const char* file_)
+{
+    g_strlcpy(dst_, file_, sz_);
+
+    char*  p = strrchr(dst_, '.');
+    if (p) {
+        *p = '\0';
+    }
+    if ( (p = strrchr(dst_, '-')) && p != dst_) {
+        *p = '\0';
+    }
+}
+
+// drop the file's pages so the next read comes from the device
+static void  _evict(const char* path_)
+{
+    int  fd;
+    if ( (fd = open(path_, O_RDONLY)) < 0) {
+        return;
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void  _preload(const char* path_)
+{
+    int  fd;
+    if ( (fd = open(path_, O_RDONLY)) < 0) {
+        return;
+    }
+    char  buf[64*1024];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    close(fd);
+}
+
+static int  _op(enum bench_op op_, const char* path_)
+{
+    struct gpod_ff_media_info  mi;
+    char*  err = NULL;
+    char*  hash = NULL;
+    int  ret;
+
+    switch (op_)
+    {
+        case BENCH_OP_PROBE:
+        case BENCH_OP_FAST:
+            gpod_ff_media_info_init(&mi);
+            ret = op_ == BENCH_OP_PROBE ? gpod_ff_scan(&mi, path_, ITDB_IPOD_GENERATION_VIDEO_1, &err)
+                                        : gpod_ff_scan_fast(&mi, path_, ITDB_IPOD_GENERATION_VIDEO_1, &err);
+            gpod_ff_media_info_free(&mi);
+            break;
+
+        case BENCH_OP_HASH:
+        default:
+            ret = gpod_ff_audio_hash(&hash, path_, &err);
+            free(hash);
+    }
+    free(err);
+    return ret;
+}
+
+static int  _file_cmp(gconstpointer x_, gconstpointer y_)
+{
+    return strcmp((*(const struct bench_file**)x_)->path, (*(const struct bench_file**)y_)->path);
+}
+
+static int  _bench(const char* dir_, unsigned iterations_)
+{
+    GError*  error = NULL;
+    GDir*  dir = g_dir_open(dir_, 0, &error);
+    if (dir == NULL) {
+        fprintf(stderr, "unable to open corpus %s - %s\n", dir_, error->message);
+        g_error_free(error);
+        return -1;
+    }
+
+    GPtrArray*  files = g_ptr_array_new();
+    GPtrArray*  types = g_ptr_array_new();
+
+    const char*  name;
+    while ( (name = g_dir_read_name(dir)) )
+    {
+        char*  path = g_build_filename(dir_, name, NULL);
+        GStatBuf  st;
+        if (g_stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            g_free(path);
+            continue;
+        }
+
+        char  tname[64];
+        _type_name(tname, sizeof(tname), name);
+
+        struct bench_type*  type = NULL;
+        for (unsigned i=0; i<types->len; ++i) {
+            if (strcmp(((struct bench_type*)g_ptr_array_index(types, i))->name, tname) == 0) {
+                type = g_ptr_array_index(types, i);
+                break;
+            }
+        }
+        if (type == NULL) {
+            type = g_new0(struct bench_type, 1);
+            g_strlcpy(type->name, tname, sizeof(type->name));
+            g_ptr_array_add(types, type);
+        }
+        ++type->files;
+        type->bytes += st.st_size;
+
+        struct bench_file*  f = g_new0(struct bench_file, 1);
+        f->path = path;
+        f->size = st.st_size;
+        f->type = type;
+        g_ptr_array_add(files, f);
+    }
+    g_dir_close(dir);
+
+    if (files->len == 0) {
+        fprintf(stderr, "no files in corpus %s\n", dir_);
+        g_ptr_array_free(files, TRUE);
+        g_ptr_array_free(types, TRUE);
+        return -1;
+    }
+    g_ptr_array_sort(files, _file_cmp);
+
+    for (unsigned n=0; n<iterations_; ++n)
+    {
+        for (unsigned i=0; i<files->len; ++i)
+        {
+            struct bench_file*  f = g_ptr_array_index(files, i);
+
+            for (enum bench_op op=0; op<BENCH_OP_MAX; ++op)
+            {
+                _evict(f->path);
+                gint64  then = g_get_monotonic_time();
+                const int  ret = _op(op, f->path);
+                f->type->usecs[op][BENCH_COLD] += g_get_monotonic_time() - then;
+
+                _preload(f->path);
+                then = g_get_monotonic_time();
+                _op(op, f->path);
+                f->type->usecs[op][BENCH_WARM] += g_get_monotonic_time() - then;
+
+                if (ret < 0 && n == 0) {
+                    ++f->type->fails[op];
+                }
+            }
+        }
+    }
+
+    printf("%u files, %u iterations\n"
+           "  %-20s %-6s %5s %9s %14s %10s %14s %10s %6s\n",
+           files->len, iterations_,
+           "type", "op", "files", "MB", "cold us/file", "MB/s", "warm us/file", "MB/s", "fails");
+
+    for (unsigned i=0; i<types->len; ++i)
+    {
+        const struct bench_type*  t = g_ptr_array_index(types, i);
+        const double  mb = t->bytes/(1024.0*1024.0);
+
+        for (enum bench_op op=0; op<BENCH_OP_MAX; ++op)
+        {
+            const double  cold = t->usecs[op][BENCH_COLD] / (double)iterations_;
+            const double  warm = t->usecs[op][BENCH_WARM] / (double)iterations_;
+
+            printf("  %-20s %-6s %5u %9.2f %14.1f %10.2f %14.1f %10.2f %6u\n",
+                   t->name, bench_op_names[op], t->files, mb,
+                   cold/t->files, cold > 0 ? mb/(cold/1000000.0) : 0,
+                   warm/t->files, warm > 0 ? mb/(warm/1000000.0) : 0,
+                   t->fails[op]);
+        }
+    }
+
+    for (unsigned i=0; i<files->len; ++i) {
+        struct bench_file*  f = g_ptr_array_index(files, i);
+        g_free(f->path);
+        g_free(f);
+    }
+    for (unsigned i=0; i<types->len; ++i) {
+        g_free(g_ptr_array_index(types, i));
+    }
+    g_ptr_array_free(files, TRUE);
+    g_ptr_array_free(types, TRUE);
+
+    return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+    const struct option  long_opts[] = {
+        { "verbose",    0, 0, 'v' },
+        { "iterations", 1, 0, 'n' },
+        { "help",       0, 0, 'h' },
+
+        {0, 0, 0,  0 }
+    };
+    char  opt_args[sizeof(long_opts)*2] = { 0 };
+    {
+        char*  og = opt_args;
+        const struct option* op = long_opts;
+        while (op->name) {
+            *og++ = op->val;
+            if (op->has_arg != no_argument) {
+                *og++ = ':';
+            }
+            ++op;
+        }
+    }
+
+    bool  default_gpod_log_level = true;
+    unsigned  iterations = 3;
+    int  c;
+    while ( (c=getopt_long(argc, argv, opt_args, long_opts, NULL)) != -1)
+    {
+        switch (c) {
+	    case 'v':  av_log_set_level(AV_LOG_VERBOSE); default_gpod_log_level = false; break;
+	    case 'n':  iterations = atoi(optarg) > 0 ? atoi(optarg) : 1;  break;
+
+	    case 'h':
+	    default:
+	        printf("usage: [OPTIONS] <corpus dir>\n"
+		       "\n"
+		       "    times probe (full and fast) and audio hash of each file type in the corpus (see\n"
+		       "    bench-corpus.sh), with the files evicted from (cold) and preloaded into (warm) the\n"
+		       "    page cache\n"
+		       "\n"
+		       "    -v  --verbose                   ffmpeg logging\n"
+		       "    -n  --iterations  <N>           passes over the corpus, averaged - default: 3\n"
+		       "\n");
+		return 1;
+	}
+    }
+
+    if (optind == argc) {
+        fprintf(stderr, "no corpus dir\n");
+        return 1;
+    }
+
+    if (default_gpod_log_level) {
+        gpod_ff_init();
+    }
+
+    return _bench(argv[optind], iterations) == 0 ? 0 : 1;
+}
@@ -1,9 +1,12 @@
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <getopt.h>
 
 #include "gpod-ffmpeg.h"
@@ -35,6 +38,270 @@ int _generate_sample()
 }
 
 
+#define TEST_FF_XCODE_SAMPLE_RATES  3
+
+struct sample_hash_pair {
+    int sample;
+    char* hash;
+};
+
+struct Fmt {
+    enum gpod_ff_enc  enc;
+    enum gpod_ff_transcode_quality  quality;
+    const char*  name;
+    struct sample_hash_pair  hashes[TEST_FF_XCODE_SAMPLE_RATES+1];
+};
+
+
+/* benchmark: synthesised inputs through each encoder/quality, reported as
+ * csv that can be saved and used as the baseline of a later run
+ */
+struct bench_opts {
+    unsigned  iterations;
+    unsigned  seconds;
+    unsigned  threads;
+    double  tolerance;  // pct
+    const char*  csv;
+    const char*  baseline;
+};
+
+struct bench_input {
+    unsigned  rate;
+    unsigned  channels;
+    unsigned  bits;
+};
+
+static const struct bench_input  bench_inputs[] = {
+    { 44100, 2, 16 }, { 44100, 1, 16 }, { 44100, 6, 16 },
+    { 48000, 2, 16 }, { 48000, 2, 24 }, { 48000, 6, 24 },
+    { 96000, 2, 24 }, { 96000, 6, 24 },
+    { 0, 0, 0 }
+};
+
+/* process_maxrss_kb is the whole process' high water mark so far, not the
+ * row's own; buf_allocs counts the transcode's sample buffer (re)allocations,
+ * not every heap allocation */
+#define TEST_FF_XCODE_CSV_HEADER  "input,encoder,quality,iterations,realtime_median,realtime_min,process_maxrss_kb,buf_allocs,buf_allocs_per_sec"
+
+static void  _put_le(uint8_t* dst_, uint32_t v_, unsigned n_)
+{
+    for (unsigned i=0; i<n_; ++i) {
+        dst_[i] = (v_ >> (8*i)) & 0xff;
+    }
+}
+
+/* deterministic pcm wav: a triangle tone per channel (so a downmix is
+ * not silent) under low level lcg noise, written as WAVE_FORMAT_EXTENSIBLE
+ * for >2 channels or >16 bits
+ */
+static int  _bench_wav(const char* path_, const struct bench_input* in_, unsigned seconds_)
+{
+    const unsigned  bps = in_->bits/8;
+    const unsigned  align = bps * in_->channels;
+    const uint32_t  frames = in_->rate * seconds_;
+    const uint32_t  data_len = frames * align;
+    const bool  extensible = in_->channels > 2 || in_->bits > 16;
+    const uint32_t  mask = in_->channels == 1 ? 0x4 : in_->channels == 2 ? 0x3 : 0x3f;
+
+    FILE*  f;
+    if ( (f = fopen(path_, "w")) == NULL) {
+        return -errno;
+    }
+
+    uint8_t  hdr[68];
+    unsigned  n = 0;
+    memcpy(hdr+n, "RIFF", 4);  n += 4;
+    _put_le(hdr+n, (extensible ? 60 : 36) + data_len, 4);  n += 4;
+    memcpy(hdr+n, "WAVEfmt ", 8);  n += 8;
+    _put_le(hdr+n, extensible ? 40 : 16, 4);  n += 4;
+    _put_le(hdr+n, extensible ? 0xfffe : 1, 2);  n += 2;
+    _put_le(hdr+n, in_->channels, 2);  n += 2;
+    _put_le(hdr+n, in_->rate, 4);  n += 4;
+    _put_le(hdr+n, in_->rate * align, 4);  n += 4;
+    _put_le(hdr+n, align, 2);  n += 2;
+    _put_le(hdr+n, in_->bits, 2);  n += 2;
+    if (extensible) {
+        static const uint8_t  pcm_guid[] = { 0x01,0x00,0x00,0x00, 0x00,0x00, 0x10,0x00, 0x80,0x00, 0x00,0xaa,0x00,0x38,0x9b,0x71 };
+        _put_le(hdr+n, 22, 2);  n += 2;
+        _put_le(hdr+n, in_->bits, 2);  n += 2;
+        _put_le(hdr+n, mask, 4);  n += 4;
+        memcpy(hdr+n, pcm_guid, sizeof(pcm_guid));  n += sizeof(pcm_guid);
+    }
+    memcpy(hdr+n, "data", 4);  n += 4;
+    _put_le(hdr+n, data_len, 4);  n += 4;
+    fwrite(hdr, 1, n, f);
+
+    uint8_t  buf[4096 * 6 * 3];
+    uint32_t  lcg = 0x12345678;
+    uint32_t  done = 0;
+    while (done < frames)
+    {
+        const uint32_t  chunk = frames - done < 4096 ? frames - done : 4096;
+        uint8_t*  p = buf;
+        for (uint32_t i=0; i<chunk; ++i)
+        {
+            for (unsigned c=0; c<in_->channels; ++c)
+            {
+                // triangle at 220*(c+1)Hz, full scale 2^23
+                const uint32_t  period = in_->rate / (220 * (c+1));
+                const int32_t  phase = (int32_t)((done+i) % period);
+                const int32_t  tri = (4 * (1<<22) / (int32_t)period) * (phase < (int32_t)period/2 ? phase : (int32_t)period - phase) - (1<<22);
+
+                lcg = lcg * 1664525u + 1013904223u;
+                const int32_t  sample = tri + ((int32_t)(lcg >> 8) >> 8) - (1<<15);
+
+                _put_le(p, (uint32_t)(sample >> (24 - in_->bits)), bps);
+                p += bps;
+            }
+        }
+        fwrite(buf, 1, p - buf, f);
+        done += chunk;
+    }
+
+    const int  ret = ferror(f) ? -EIO : 0;
+    fclose(f);
+    return ret;
+}
+
+static int  _dbl_cmp(const void* a_, const void* b_)
+{
+    const double  a = *(const double*)a_;
+    const double  b = *(const double*)b_;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// returns matching baseline row's realtime median and buffer allocs/sec
+static bool  _bench_baseline(const char* baseline_, const char* key_, double* realtime_, double* allocs_)
+{
+    FILE*  f;
+    if (baseline_ == NULL || (f = fopen(baseline_, "r")) == NULL) {
+        return false;
+    }
+
+    char  line[512];
+    bool  found = false;
+    while (!found && fgets(line, sizeof(line), f))
+    {
+        char  input[128], enc[64], quality[32];
+        unsigned  iterations, allocs;
+        long  rss;
+        double  rt, rt_min, aps;
+
+        if (sscanf(line, "%127[^,],%63[^,],%31[^,],%u,%lf,%lf,%ld,%u,%lf",
+                   input, enc, quality, &iterations, &rt, &rt_min, &rss, &allocs, &aps) != 9) {
+            continue;
+        }
+
+        char  key[256];
+        snprintf(key, sizeof(key), "%s,%s,%s", input, enc, quality);
+        if (strcmp(key, key_) == 0) {
+            *realtime_ = rt;
+            *allocs_ = aps;
+            found = true;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static int  _bench(const struct bench_opts* opts_, const struct Fmt* fmts_)
+{
+    FILE*  csv = stdout;
+    if (opts_->csv && strcmp(opts_->csv, "-") != 0 && (csv = fopen(opts_->csv, "w")) == NULL) {
+        fprintf(stderr, "unable to open %s - %s\n", opts_->csv, strerror(errno));
+        return -1;
+    }
+    fprintf(csv, "%s\n", TEST_FF_XCODE_CSV_HEADER);
+
+    struct gpod_ff_transcode_session*  session = gpod_ff_transcode_session_new();
+    double*  realtimes = (double*)calloc(opts_->iterations, sizeof(double));
+    unsigned  regressions = 0;
+
+    for (const struct bench_input* in = bench_inputs; in->rate; ++in)
+    {
+        char  input[128];
+        snprintf(input, sizeof(input), "bench-%u-%uch-%ubit.wav", in->rate, in->channels, in->bits);
+        if (_bench_wav(input, in, opts_->seconds) < 0) {
+            fprintf(stderr, "unable to generate %s - %s\n", input, strerror(errno));
+            continue;
+        }
+
+        struct gpod_ff_media_info  mi;
+        gpod_ff_media_info_init(&mi);
+        strcpy(mi.path, input);
+        mi.audio.song_length = opts_->seconds * 1000;
+
+        for (const struct Fmt* p = fmts_; p->name; ++p)
+        {
+            struct gpod_ff_transcode_ctx  xcode;
+            gpod_ff_transcode_ctx_init(&xcode, p->enc, p->quality, true);
+            xcode.session = session;
+            xcode.threads = opts_->threads;
+            snprintf(xcode.path, PATH_MAX, p->name, in->rate);
+
+            char  quality[32];
+            if (p->quality == GPOD_FF_XCODE_MAX)  snprintf(quality, sizeof(quality), "max");
+            else if (p->quality <= GPOD_FF_XCODE_VBR_MAX)  snprintf(quality, sizeof(quality), "vbr%d", (int)p->quality);
+            else  snprintf(quality, sizeof(quality), "cbr%d", (int)p->quality/1000);
+
+            char  key[256];
+            snprintf(key, sizeof(key), "%s,%s,%s", input, xcode.audio_opts.enc_name, quality);
+
+            unsigned  n = 0;
+            unsigned  allocs = 0;
+            for (unsigned i=0; i<opts_->iterations; ++i)
+            {
+                char*  err = NULL;
+                if (gpod_ff_transcode(&mi, &xcode, &err) < 0) {
+                    fprintf(stderr, "skipping %s - %s\n", key, err ? err : "<>");
+                    free(err);
+                    break;
+                }
+                realtimes[n++] = xcode.realtime;
+                allocs = xcode.allocs;
+            }
+            unlink(xcode.path);
+            if (n == 0) {
+                continue;
+            }
+
+            qsort(realtimes, n, sizeof(double), _dbl_cmp);
+            const double  median = realtimes[n/2];
+            const double  aps = median > 0 ? allocs * median / opts_->seconds : 0;
+
+            struct rusage  ru;
+            getrusage(RUSAGE_SELF, &ru);
+
+            fprintf(csv, "%s,%u,%.2f,%.2f,%ld,%u,%.2f\n", key, n, median, realtimes[0], ru.ru_maxrss, allocs, aps);
+            fflush(csv);
+
+            double  base_rt, base_aps;
+            if (_bench_baseline(opts_->baseline, key, &base_rt, &base_aps))
+            {
+                const double  delta = base_rt > 0 ? 100.0 * (median - base_rt) / base_rt : 0;
+                if (delta < -opts_->tolerance || aps > base_aps * (1 + opts_->tolerance/100.0) + 1) {
+                    fprintf(stderr, "REGRESSION %s  realtime %.2fx -> %.2fx (%+.1f%%)  buf allocs/sec %.2f -> %.2f\n",
+                            key, base_rt, median, delta, base_aps, aps);
+                    ++regressions;
+                }
+            }
+        }
+        unlink(input);
+    }
+
+    free(realtimes);
+    gpod_ff_transcode_session_free(session);
+    if (csv != stdout) {
+        fclose(csv);
+    }
+
+    if (opts_->baseline) {
+        fprintf(stderr, "%u regressions against %s (tolerance %.1f%%)\n", regressions, opts_->baseline, opts_->tolerance);
+    }
+    return regressions ? 2 : 0;
+}
+
+
 int main(int argc, char* argv[])
 {
     const struct option  long_opts[] = {
@@ -42,6 +309,15 @@ int main(int argc, char* argv[])
         { "debug",   0, 0, 'd' },
         { "info",    0, 0, 'i' },
         { "quiet",   0, 0, 'q' },
+
+        { "bench",      0, 0, 'b' },
+        { "iterations", 1, 0, 'n' },
+        { "seconds",    1, 0, 's' },
+        { "threads",    1, 0, 'T' },
+        { "csv",        1, 0, 'o' },
+        { "baseline",   1, 0, 'B' },
+        { "tolerance",  1, 0, 't' },
+
         { "help",    0, 0, 'h' },
 
         {0, 0, 0,  0 }
@@ -61,6 +337,15 @@ int main(int argc, char* argv[])
 
 
     bool  default_gpod_log_level = true;
+    bool  bench = false;
+    struct bench_opts  bopts = {
+        .iterations = 3,
+        .seconds = 30,
+        .threads = 1,
+        .tolerance = 10,
+        .csv = NULL,
+        .baseline = NULL,
+    };
     int  c;
     while ( (c=getopt_long(argc, argv, opt_args, long_opts, NULL)) != -1)
     {
@@ -70,6 +355,14 @@ int main(int argc, char* argv[])
 	    case 'i':  av_log_set_level(AV_LOG_INFO);    default_gpod_log_level = false; break;
 	    case 'q':  av_log_set_level(AV_LOG_QUIET);   default_gpod_log_level = false; break;
 
+	    case 'b':  bench = true;  break;
+	    case 'n':  bopts.iterations = atoi(optarg) > 0 ? atoi(optarg) : 1;  break;
+	    case 's':  bopts.seconds = atoi(optarg) > 0 ? atoi(optarg) : 1;  break;
+	    case 'T':  bopts.threads = atoi(optarg) > 0 ? atoi(optarg) : 1;  break;
+	    case 'o':  bopts.csv = optarg;  break;
+	    case 'B':  bopts.baseline = optarg;  break;
+	    case 't':  bopts.tolerance = atof(optarg);  break;
+
 	    case 'h':
 	    default:
 	        printf("usage: [OPTIONS] [file to xcode]\n"
@@ -82,6 +375,16 @@ int main(int argc, char* argv[])
 		       "    -d  --debug\n"
 		       "    -i  --info\n"
 		       "    -q  --quiet\n"
+		       "\n"
+		       "  benchmark:\n"
+		       "    -b  --bench                     synthesised 44.1/48/96kHz, mono/stereo/5.1, 16/24bit inputs through\n"
+		       "                                    each encoder/quality, reported as csv\n"
+		       "    -n  --iterations  <N>           runs per combination, median reported - default: 3\n"
+		       "    -s  --seconds     <N>           length of synthesised inputs - default: 30\n"
+		       "    -T  --threads     <N>           transcode thread budget - default: 1\n"
+		       "    -o  --csv         <file|->      csv output, save as a baseline for later runs - default: stdout\n"
+		       "    -B  --baseline    <file>        compare against baseline csv, exit 2 on regression\n"
+		       "    -t  --tolerance   <pct>         allowed realtime/buf allocs/sec regression - default: 10\n"
 		       "\n");
 		return 1;
 		break;
@@ -103,17 +406,8 @@ int main(int argc, char* argv[])
     }
 
 
-    const unsigned  sample_rates[] = { 44100, 22050, 48000, 0 };
-    struct sample_hash_pair {
-	int sample;
-	char* hash;
-    };
-    const struct Fmt {
-        enum gpod_ff_enc  enc;
-        enum gpod_ff_transcode_quality  quality;
-        const char*  name;
-	struct sample_hash_pair  hashes[sizeof(sample_rates)/sizeof(unsigned)];
-    } fmts[] = {
+    const unsigned  sample_rates[TEST_FF_XCODE_SAMPLE_RATES+1] = { 44100, 22050, 48000, 0 };
+    const struct Fmt  fmts[] = {
         {
 	    .enc = GPOD_FF_ENC_FDKAAC,
 	    .quality = GPOD_FF_XCODE_VBR1,
@@ -251,6 +545,10 @@ int main(int argc, char* argv[])
         { 0, 0, NULL }
     };
 
+    if (bench) {
+        return _bench(&bopts, fmts);
+    }
+
     struct gpod_ff_media_info  mi;
     gpod_ff_media_info_init(&mi);
     strcpy(mi.path, path);
@@ -279,6 +577,9 @@ int main(int argc, char* argv[])
     struct gpod_ff_transcode_ctx  xcode;
     char*  err;
 
+    // carried across all xcodes so reused encoders must produce identical output
+    struct gpod_ff_transcode_session*  session = gpod_ff_transcode_session_new();
+
     const unsigned*  sample_rate = sample_rates;
     while (*sample_rate)
     {
@@ -288,6 +589,7 @@ int main(int argc, char* argv[])
 	    err = NULL;
 	    gpod_ff_transcode_ctx_init(&xcode, p->enc, p->quality, true);
 	    xcode.audio_opts.samplerate = *sample_rate;
+	    xcode.session = session;
 	    sprintf(xcode.path, p->name, xcode.audio_opts.samplerate);
 
 	    printf("xcoding  %' 33s.. ", xcode.path);
@@ -312,7 +614,7 @@ int main(int argc, char* argv[])
 		         ++shp;
 		    }
 		}
-		printf(" audio hash %s  [%s]", ret < 0 ? "n/a" : hash, hash_result);
+		printf(" audio hash %s  [%s]  allocs=%u", ret < 0 ? "n/a" : hash, hash_result, xcode.allocs);
 		free(hash);
 		free(errb);
 	    }
@@ -322,7 +624,7 @@ int main(int argc, char* argv[])
 	}
 	++sample_rate;
     }
-
+    gpod_ff_transcode_session_free(session);
 
     return 0;
 }